@@ -0,0 +1,148 @@
+/****************************************************************************
+
+Бенчмарк №01: скорость диспетчеризации событий NetDaemon
+
+Создает множество eventfd (по умолчанию 100000, но не больше RLIMIT_NOFILE),
+в каждом раунде взводит случайную выборку дескрипторов и измеряет сколько
+событий в секунду демон успевает доставить обработчикам.
+
+Использование: bench01_dispatch [число дескрипторов] [число раундов]
+
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <nanosoft/netdaemon.h>
+#include <nanosoft/utils.h>
+
+/**
+* Число взводимых дескрипторов за раунд
+*/
+#define BENCH_BATCH 1000
+
+/**
+* Число обработанных событий в текущем раунде
+*/
+int handled = 0;
+
+/**
+* Ожидаемое число событий в текущем раунде
+*/
+int expected = 0;
+
+/**
+* Объект-обертка над eventfd
+*/
+class EventObject: public AsyncObject
+{
+public:
+	EventObject(int afd): AsyncObject(afd) { }
+	
+	/**
+	* Взвести событие
+	*/
+	void fire()
+	{
+		uint64_t v = 1;
+		if ( write(getFd(), &v, sizeof(v)) != sizeof(v) ) perror("write");
+	}
+
+protected:
+	virtual uint32_t getEventsMask()
+	{
+		return EPOLLIN;
+	}
+	
+	virtual void onEvent(uint32_t events)
+	{
+		uint64_t v;
+		if ( read(getFd(), &v, sizeof(v)) == sizeof(v) ) handled++;
+		if ( handled >= expected ) getDaemon()->stop();
+	}
+	
+	virtual void onTerminate()
+	{
+	}
+};
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 200;
+	
+	// поднимаем лимит дескрипторов насколько позволяет система
+	struct rlimit rl;
+	if ( getrlimit(RLIMIT_NOFILE, &rl) == 0 )
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+		if ( rl.rlim_cur != RLIM_INFINITY && count > (int) rl.rlim_cur - 32 ) count = rl.rlim_cur - 32;
+	}
+	
+	NetDaemon daemon(count, 64);
+	
+	std::vector<EventObject *> objects;
+	for(int i = 0; i < count; i++)
+	{
+		int fd = eventfd(0, EFD_NONBLOCK);
+		if ( fd < 0 )
+		{
+			perror("eventfd");
+			break;
+		}
+		EventObject *obj = new EventObject(fd);
+		objects.push_back(obj);
+		daemon.addObject(obj);
+	}
+	count = objects.size();
+	
+	printf("fds: %d, table: %d entries, %d KB\n", count, (int) daemon.getTableSize(), (int) (daemon.getTableMemory() / 1024));
+	
+	std::vector<int> order(count);
+	for(int i = 0; i < count; i++) order[i] = i;
+	
+	srand(1);
+	int batch = count < BENCH_BATCH ? count : BENCH_BATCH;
+	int64_t total_time = 0;
+	int64_t total_events = 0;
+	for(int r = 0; r < rounds; r++)
+	{
+		// случайная выборка без повторов, повторно взведенный eventfd
+		// дал бы только одно событие
+		for(int i = 0; i < batch; i++)
+		{
+			int j = i + rand() % (count - i);
+			int t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+			objects[order[i]]->fire();
+		}
+		handled = 0;
+		expected = batch;
+	
+		int64_t start = microtime();
+		daemon.run();
+		total_time += microtime() - start;
+		total_events += handled;
+	}
+	
+	printf("events: %lld, time: %.3f s, rate: %.0f events/s\n", (long long) total_events, total_time / 1e6, total_events * 1e6 / (total_time ? total_time : 1));
+	
+	for(size_t i = 0; i < objects.size(); i++)
+	{
+		int fd = objects[i]->getFd();
+		daemon.removeObject(objects[i]);
+		close(fd);
+	}
+	
+	return 0;
+}
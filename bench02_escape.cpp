@@ -0,0 +1,123 @@
+/****************************************************************************
+
+Бенчмарк №02: скорость экранирования XML (XMLWriter::escape)
+
+Сравнивает прежнюю посимвольную реализацию с векторной на текстах разной
+"плотности" спец. символов: чистый текст, обычное сообщение с редкими
+спец. символами и текст с разметкой. Заодно проверяет, что результаты
+совпадают.
+
+Использование: bench02_escape [объем данных на тест, МБ]
+
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <nanosoft/xmlwriter.h>
+#include <nanosoft/utils.h>
+
+using namespace nanosoft;
+
+/**
+* Размер тестового текста
+*/
+#define BENCH_TEXT_SIZE 4096
+
+/**
+* Прежняя реализация XMLWriter::escape()
+*/
+std::string escape_reference(const std::string &text)
+{
+	std::string result;
+	for(std::string::const_iterator pos = text.begin(); pos != text.end(); ++pos)
+	{
+		switch ( *pos )
+		{
+		case '<': result.append("&lt;"); break;
+		case '>': result.append("&gt;"); break;
+		case '&': result.append("&amp;"); break;
+		case '"': result.append("&quot;"); break;
+		default: result.append( &*pos, 1 );
+		}
+	}
+	return result;
+}
+
+/**
+* Сгенерировать текст, в среднем один спец. символ на каждые every
+* символов (every = 0 - без спец. символов)
+*/
+std::string make_text(int every)
+{
+	const char specials[] = "<>&\"";
+	std::string text;
+	srand(1);
+	for(int i = 0; i < BENCH_TEXT_SIZE; i++)
+	{
+		if ( every && rand() % every == 0 ) text += specials[rand() % 4];
+		else text += char('a' + rand() % 26);
+	}
+	return text;
+}
+
+/**
+* Вывести результат замера
+*/
+void report(const char *name, int64_t bytes, int64_t time)
+{
+	printf("  %-12s %8.1f MB/s\n", name, bytes / (time ? (double) time : 1.0));
+}
+
+int main(int argc, char **argv)
+{
+	int mb = argc > 1 ? atoi(argv[1]) : 200;
+	int rounds = (int) ((int64_t) mb * 1024 * 1024 / BENCH_TEXT_SIZE);
+	
+	struct
+	{
+		const char *name;
+		int every;
+	} cases[] = {
+		{ "clean", 0 },
+		{ "message", 100 },
+		{ "markup", 4 }
+	};
+	
+	std::vector<char> buf(XMLWRITER_ESCAPE_MAX(BENCH_TEXT_SIZE));
+	int failed = 0;
+	
+	for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		std::string text = make_text(cases[c].every);
+		std::string expect = escape_reference(text);
+		std::string result = XMLWriter::escape(text);
+		size_t n = XMLWriter::escape(&buf[0], text.data(), text.size());
+		bool ok = result == expect && std::string(&buf[0], n) == expect;
+		if ( ! ok ) failed++;
+		printf("%s (%s):\n", cases[c].name, ok ? "ok" : "MISMATCH");
+	
+		int64_t bytes = (int64_t) rounds * text.size();
+		size_t total = 0;
+	
+		int64_t start = microtime();
+		for(int i = 0; i < rounds; i++) total += escape_reference(text).size();
+		report("reference", bytes, microtime() - start);
+	
+		start = microtime();
+		for(int i = 0; i < rounds; i++) total += XMLWriter::escape(text).size();
+		report("string", bytes, microtime() - start);
+	
+		start = microtime();
+		for(int i = 0; i < rounds; i++) total += XMLWriter::escape(&buf[0], text.data(), text.size());
+		report("buffer", bytes, microtime() - start);
+	
+		// не даем компилятору выбросить циклы
+		if ( total == 0 ) printf("\n");
+	}
+	
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+/****************************************************************************
+
+Бенчмарк №03: скорость разбора XML-потока (XMLParser)
+
+Сравнивает expat (ENGINE_EXPAT) и собственный токенизатор (ENGINE_NATIVE)
+на XMPP-подобном потоке: обычные сообщения, длинные тексты и станзы
+с большим числом атрибутов. Поток подается кусками по BENCH_CHUNK_SIZE
+байт, как при чтении из сокета. Обработчики ничего не копируют, заодно
+проверяется, что оба движка выдают одинаковое число событий.
+
+Отдельно замеряется разбор коротких документов через TagParser: новый
+парсер на каждый документ против одного парсера, сбрасываемого на месте.
+
+Использование: bench03_xmlparse [объем данных на тест, МБ]
+
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+
+#include <nanosoft/xmlparser.h>
+#include <nanosoft/tagparser.h>
+#include <nanosoft/utils.h>
+
+/**
+* Размер куска, подаваемого парсеру
+*/
+#define BENCH_CHUNK_SIZE 4096
+
+/**
+* Парсер, считающий события
+*/
+class CountParser: public XMLParser
+{
+protected:
+	virtual void onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts) { events += 1 + atts.count; }
+	
+	virtual void onCharacterDataRaw(const xml_chars_t &cdata) { bytes += cdata.len; }
+	
+	virtual void onEndElementRaw(const xml_chars_t &name) { events++; }
+	
+	virtual void onParseError(const char *message) { printf("parse error: %s\n", message); }
+
+public:
+	int64_t events;
+	int64_t bytes;
+	
+	CountParser(engine_t engine): events(0), bytes(0) { setEngine(engine); }
+};
+
+/**
+* Сгенерировать станзу
+*/
+std::string make_stanza(const char *kind, int i)
+{
+	char buf[256];
+	std::string s;
+	if ( kind[0] == 'm' )
+	{
+		snprintf(buf, sizeof(buf), "<message from='user%d@example.com/home' to='friend@example.com' type='chat' id='m%d'>", i % 100, i);
+		s = buf;
+		s += "<body>Hello! How are you doing today? Let's meet at 5 &amp; talk.</body>";
+		s += "<active xmlns='http://jabber.org/protocol/chatstates'/></message>\n";
+	}
+	else if ( kind[0] == 't' )
+	{
+		s = "<message to='friend@example.com'><body>";
+		for(int j = 0; j < 40; j++) s += "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod. ";
+		s += "</body></message>\n";
+	}
+	else
+	{
+		snprintf(buf, sizeof(buf), "<presence from='user%d@example.com/home' id='p%d'>", i % 100, i);
+		s = buf;
+		for(int j = 0; j < 8; j++)
+		{
+			snprintf(buf, sizeof(buf), "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='http://example.com/%d' ver='QgayPKawpkPSDYmwT/WM94uAlu0='/>", j);
+			s += buf;
+		}
+		s += "</presence>\n";
+	}
+	return s;
+}
+
+/**
+* Разобрать поток указанным движком
+*/
+void run(const char *name, XMLParser::engine_t engine, const std::string &stream, int rounds, int64_t &events)
+{
+	CountParser parser(engine);
+	const char *head = "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>";
+	parser.parseXML(head, strlen(head), false);
+	
+	int64_t start = microtime();
+	for(int r = 0; r < rounds; r++)
+	{
+		for(size_t pos = 0; pos < stream.size(); pos += BENCH_CHUNK_SIZE)
+		{
+			size_t len = stream.size() - pos;
+			if ( len > BENCH_CHUNK_SIZE ) len = BENCH_CHUNK_SIZE;
+			parser.parseXML(stream.data() + pos, len, false);
+		}
+	}
+	int64_t time = microtime() - start;
+	
+	int64_t bytes = (int64_t) rounds * stream.size();
+	printf("  %-12s %8.1f MB/s\n", name, bytes / (time ? (double) time : 1.0));
+	events = parser.events + parser.bytes;
+}
+
+/**
+* Разобрать короткие документы TagParser'ом
+*/
+void run_short(int count)
+{
+	std::string doc = "<iq type='get' id='ping1' to='example.com'><ping xmlns='urn:xmpp:ping'/></iq>";
+	
+	int64_t start = microtime();
+	for(int i = 0; i < count; i++)
+	{
+		TagParser parser;
+		parser.parseString(doc);
+	}
+	int64_t time = microtime() - start;
+	printf("  %-12s %8.0f docs/s\n", "new parser", count * 1000000.0 / (time ? time : 1));
+	
+	TagParser parser;
+	start = microtime();
+	for(int i = 0; i < count; i++) parser.parseString(doc);
+	time = microtime() - start;
+	printf("  %-12s %8.0f docs/s\n", "reused", count * 1000000.0 / (time ? time : 1));
+}
+
+int main(int argc, char **argv)
+{
+	int mb = argc > 1 ? atoi(argv[1]) : 100;
+	const char *kinds[] = { "messages", "text", "attributes" };
+	int failed = 0;
+	
+	for(size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+	{
+		std::string stream;
+		for(int i = 0; stream.size() < 1024 * 1024; i++) stream += make_stanza(kinds[k], i);
+		int rounds = mb * 1024 * 1024 / (int) stream.size();
+		if ( rounds < 1 ) rounds = 1;
+	
+		int64_t expat_events, native_events;
+		printf("%s:\n", kinds[k]);
+		run("expat", XMLParser::ENGINE_EXPAT, stream, rounds, expat_events);
+		run("native", XMLParser::ENGINE_NATIVE, stream, rounds, native_events);
+		if ( expat_events != native_events )
+		{
+			printf("  MISMATCH: %lld vs %lld events\n", (long long) expat_events, (long long) native_events);
+			failed++;
+		}
+	}
+	
+	printf("short documents:\n");
+	run_short(mb * 2000);
+	
+	return failed ? 1 : 0;
+}
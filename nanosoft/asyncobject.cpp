@@ -98,6 +98,13 @@ void AsyncObject::onTerminate()
 	fprintf(stderr, "AsyncObject::onTerminate() DEPRICATED !!!!!!!!!!!!\n");
 }
 
+/**
+* Отложенная запись отправила весь буфер
+*/
+void AsyncObject::onFlush()
+{
+}
+
 /**
 * Послать сигнал завершения
 */
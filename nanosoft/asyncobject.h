@@ -55,7 +55,7 @@ protected:
 	/**
 	* Установить демона
 	*/
-	void setDaemon(NetDaemon *pDaemon);
+	virtual void setDaemon(NetDaemon *pDaemon);
 	
 	/**
 	* Обработка системной ошибки
@@ -91,6 +91,14 @@ protected:
 	* корректно попрощаться с пиром (peer).
 	*/
 	virtual void onTerminate();
+	
+	/**
+	* Отложенная запись отправила весь буфер
+	*
+	* Вызывается демоном в конце хода (см. NetDaemon::scheduleFlush()),
+	* если все данные объекта ушли сразу и события EPOLLOUT не будет
+	*/
+	virtual void onFlush();
 public:
 	/**
 	* Конструктор
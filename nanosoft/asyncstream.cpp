@@ -1,17 +1,66 @@
 #include <nanosoft/asyncstream.h>
 #include <nanosoft/netdaemon.h>
 #include <nanosoft/debug.h>
+#include <nanosoft/easytag.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
+/**
+* Предустановленный словарь zlib для XMPP-станз
+*
+* zlib лучше всего использует строки в конце словаря, поэтому самые частые
+* фрагменты (presence, message, iq) расположены ближе к концу
+*/
+const char zlib_xmpp_dictionary[] =
+	"<stream:stream xmlns=\"jabber:client\" xmlns:stream=\"http://etherx.jabber.org/streams\" version=\"1.0\">"
+	"<stream:features><starttls xmlns=\"urn:ietf:params:xml:ns:xmpp-tls\"/>"
+	"<compression xmlns=\"http://jabber.org/features/compress\"><method>zlib</method></compression>"
+	"<mechanisms xmlns=\"urn:ietf:params:xml:ns:xmpp-sasl\"><mechanism>PLAIN</mechanism></mechanisms>"
+	"<bind xmlns=\"urn:ietf:params:xml:ns:xmpp-bind\"/><session xmlns=\"urn:ietf:params:xml:ns:xmpp-session\"/>"
+	"</stream:features>"
+	"<query xmlns=\"jabber:iq:roster\"><item subscription=\"both\" jid=\"\" name=\"\"><group></group></item></query>"
+	"<vCard xmlns=\"vcard-temp\"><FN></FN><NICKNAME></NICKNAME><PHOTO><TYPE>image/png</TYPE><BINVAL></BINVAL></PHOTO></vCard>"
+	"<c xmlns=\"http://jabber.org/protocol/caps\" hash=\"sha-1\" node=\"\" ver=\"\"/>"
+	"<x xmlns=\"vcard-temp:x:update\"><photo></photo></x>"
+	"<delay xmlns=\"urn:xmpp:delay\" stamp=\"\"/>"
+	"<iq type=\"result\" id=\"\"/><iq type=\"get\" id=\"\"><ping xmlns=\"urn:xmpp:ping\"/></iq>"
+	"<active xmlns=\"http://jabber.org/protocol/chatstates\"/>"
+	"<composing xmlns=\"http://jabber.org/protocol/chatstates\"/>"
+	"<message type=\"chat\" to=\"\" from=\"\" id=\"\"><body></body></message>"
+	"<presence from=\"\" to=\"\"><show>away</show><status></status><priority>0</priority></presence>"
+	"<presence type=\"unavailable\" from=\"\" to=\"\"/>";
+
+/**
+* Размер словаря zlib_xmpp_dictionary
+*/
+const size_t zlib_xmpp_dictionary_size = sizeof(zlib_xmpp_dictionary) - 1;
+
 /**
 * Конструктор
 */
-AsyncStream::AsyncStream(int afd): AsyncObject(afd), flags(0)
+AsyncStream::AsyncStream(int afd): AsyncObject(afd), flags(0), write_blocked(false), low_watermark(0), high_watermark(0), deferred_flush(false), direct_write(false),
+	relay_target(0), relay_source(0), relay_pending(0)
 {
+	relay_pipe[0] = -1;
+	relay_pipe[1] = -1;
+	
 #ifdef HAVE_LIBZ
 	compression = false;
+	zlib_window_bits = ZLIB_WINDOW_BITS;
+	zlib_mem_level = ZLIB_MEM_LEVEL;
+	zlib_dict = 0;
+	zlib_dict_len = 0;
+	zlib_memory = 0;
+	tx_parked = false;
+	rx_parked = false;
+	rx_window = 0;
+	rx_window_len = 0;
+	rx_bits = 0;
+	rx_last_byte = 0;
+	rx_buf = 0;
+	rx_buf_len = 0;
+	rx_delivering = false;
 #endif // HAVE_LIBZ
 
 #ifdef HAVE_GNUTLS
@@ -24,9 +73,16 @@ AsyncStream::AsyncStream(int afd): AsyncObject(afd), flags(0)
 */
 AsyncStream::~AsyncStream()
 {
+	detachRelay();
+	if ( relay_source ) relay_source->detachRelay();
 	disableCompression();
 	disableTLS();
 	close();
+	
+#ifdef HAVE_LIBZ
+	// буфер мог остаться, если компрессию отключили из обработчика onRead()
+	free(rx_buf);
+#endif // HAVE_LIBZ
 }
 
 /**
@@ -60,6 +116,12 @@ void AsyncStream::handleError()
 */
 void AsyncStream::handleRead()
 {
+	if ( relay_target )
+	{
+		handleRelay();
+		return;
+	}
+	
 	char chunk[FD_READ_CHUNK_SIZE];
 	ssize_t ret;
 	
@@ -92,6 +154,7 @@ void AsyncStream::handleRead()
 			putInDecompressor(chunk, ret);
 			ret = gnutls_record_recv(tls_session, chunk, sizeof(chunk));
 		}
+		flushDecompressor();
 		if ( ret == GNUTLS_E_AGAIN ) return;
 		if ( ret == GNUTLS_E_REHANDSHAKE )
 		{
@@ -115,6 +178,7 @@ void AsyncStream::handleRead()
 		putInDecompressor(chunk, ret);
 		ret = ::read(getFd(), chunk, sizeof(chunk));
 	}
+	flushDecompressor();
 	if ( ret < 0 )
 	{
 		if ( errno != EAGAIN ) stderror();
@@ -140,6 +204,25 @@ void AsyncStream::putInDecompressor(const char *data, size_t len)
 	putInReadEvent(data, len);
 }
 
+/**
+* Передать обработчику onRead() данные накопленные декомпрессором
+*
+* Вызывается по окончании чтения из сокета
+*/
+void AsyncStream::flushDecompressor()
+{
+#ifdef HAVE_LIBZ
+	if ( compression )
+	{
+		flushInflate();
+		
+		// между чтениями буфер не держим, иначе каждое сжатое соединение
+		// занимало бы лишние ZLIB_INFLATE_CHUNK_SIZE байт
+		freeInflateBuffer();
+	}
+#endif // HAVE_LIBZ
+}
+
 /**
 * Передать данные обработчику onRead()
 */
@@ -155,29 +238,224 @@ void AsyncStream::putInReadEvent(const char *data, size_t len)
 }
 
 #ifdef HAVE_LIBZ
+/**
+* Функция выделения памяти для zlib с учетом объема
+*
+* Перед блоком сохраняется его размер, чтобы zlibFree() мог вычесть его
+*/
+voidpf AsyncStream::zlibAlloc(voidpf opaque, uInt items, uInt size)
+{
+	size_t bytes = (size_t)items * size + sizeof(max_align_t);
+	char *p = (char *)malloc(bytes);
+	if ( p == 0 ) return Z_NULL;
+	*(size_t *)p = bytes;
+	static_cast<AsyncStream *>(opaque)->zlib_memory += bytes;
+	return p + sizeof(max_align_t);
+}
+
+/**
+* Функция освобождения памяти для zlib с учетом объема
+*/
+void AsyncStream::zlibFree(voidpf opaque, voidpf address)
+{
+	char *p = (char *)address - sizeof(max_align_t);
+	static_cast<AsyncStream *>(opaque)->zlib_memory -= *(size_t *)p;
+	free(p);
+}
+
+/**
+* Инициализировать компрессор исходящего трафика
+*
+* @param raw TRUE - без заголовка zlib (продолжение запаркованного потока)
+*/
+bool AsyncStream::initDeflate(bool raw)
+{
+	memset(&strm_tx, 0, sizeof(strm_tx));
+	strm_tx.zalloc = zlibAlloc;
+	strm_tx.zfree = zlibFree;
+	strm_tx.opaque = this;
+	
+	int bits = raw ? -zlib_window_bits : zlib_window_bits;
+	int status = deflateInit2(&strm_tx, ZLIB_COMPRESS_LEVEL, Z_DEFLATED, bits, zlib_mem_level, Z_DEFAULT_STRATEGY);
+	if ( status != Z_OK )
+	{
+		(void)deflateEnd(&strm_tx);
+		return false;
+	}
+	
+	// после парковки пир уже не помнит словарь, только окно,
+	// поэтому словарь устанавливаем только в начале потока
+	if ( ! raw && zlib_dict )
+	{
+		status = deflateSetDictionary(&strm_tx, (const Bytef*)zlib_dict, zlib_dict_len);
+		if ( status != Z_OK )
+		{
+			(void)deflateEnd(&strm_tx);
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+/**
+* Инициализировать декомпрессор входящего трафика
+*
+* @param raw TRUE - без заголовка zlib (продолжение запаркованного потока)
+*/
+bool AsyncStream::initInflate(bool raw)
+{
+	memset(&strm_rx, 0, sizeof(strm_rx));
+	strm_rx.zalloc = zlibAlloc;
+	strm_rx.zfree = zlibFree;
+	strm_rx.opaque = this;
+	
+	// окно декомпрессора определяет пир, без заголовка берем максимальное
+	int status = inflateInit2(&strm_rx, raw ? -MAX_WBITS : 0);
+	if ( status != Z_OK )
+	{
+		(void)inflateEnd(&strm_rx);
+		return false;
+	}
+	
+	return true;
+}
+
+/**
+* Восстановить запаркованный декомпрессор
+*/
+bool AsyncStream::resumeInflate()
+{
+	// если до парковки ничего не было принято, то заголовок zlib ещё впереди
+	// NOTE inflateEnd() не сбрасывает total_in, а initInflate() сбрасывает
+	bool raw = strm_rx.total_in > 0;
+	if ( ! initInflate(raw) ) return false;
+	
+	if ( rx_window_len > 0 )
+	{
+		inflateSetDictionary(&strm_rx, (const Bytef*)rx_window, rx_window_len);
+		free(rx_window);
+		rx_window = 0;
+		rx_window_len = 0;
+	}
+	
+	if ( rx_bits > 0 )
+	{
+		inflatePrime(&strm_rx, rx_bits, rx_last_byte >> (8 - rx_bits));
+	}
+	
+	rx_parked = false;
+	return true;
+}
+
+/**
+* Освободить буфер распакованных данных, если он не используется
+*/
+void AsyncStream::freeInflateBuffer()
+{
+	rx_buf_len = 0;
+	if ( ! rx_delivering )
+	{
+		free(rx_buf);
+		rx_buf = 0;
+	}
+}
+
 /**
 * Обработка поступивших сжатых данных
+*
+* Распакованные данные накапливаются в буфере rx_buf и передаются
+* обработчику onRead() когда буфер заполнится или по окончании
+* чтения из сокета, см. flushInflate()
 */
 void AsyncStream::handleInflate(const char *data, size_t len)
 {
-	char buf[ZLIB_INFLATE_CHUNK_SIZE];
+	if ( rx_parked && ! resumeInflate() )
+	{
+		onError("AsyncStream::handleInflate() failed to resume inflate");
+		return;
+	}
+	
+	if ( rx_buf == 0 )
+	{
+		rx_buf = (char *)malloc(ZLIB_INFLATE_CHUNK_SIZE);
+		if ( rx_buf == 0 )
+		{
+			onError("AsyncStream::handleInflate() out of memory");
+			return;
+		}
+		rx_buf_len = 0;
+	}
 	
 	strm_rx.next_in = (unsigned char*)data;
 	strm_rx.avail_in = len;
+	if ( len > 0 ) rx_last_byte = (unsigned char)data[len - 1];
 	
-	while ( strm_rx.avail_out == 0 )
+	while ( 1 )
 	{
-		strm_rx.next_out = (unsigned char*)buf;
-		strm_rx.avail_out = sizeof(buf);
+		if ( rx_buf_len == ZLIB_INFLATE_CHUNK_SIZE )
+		{
+			flushInflate();
+			
+			// обработчик мог отключить или запарковать компрессию
+			if ( ! compression || rx_parked ) return;
+		}
 		
-		inflate(&strm_rx, Z_SYNC_FLUSH);
+		strm_rx.next_out = (unsigned char*)rx_buf + rx_buf_len;
+		strm_rx.avail_out = ZLIB_INFLATE_CHUNK_SIZE - rx_buf_len;
 		
-		size_t have = sizeof(buf) - strm_rx.avail_out;
+		int status = inflate(&strm_rx, Z_SYNC_FLUSH);
+		rx_buf_len = ZLIB_INFLATE_CHUNK_SIZE - strm_rx.avail_out;
 		
-		putInReadEvent(buf, have);
+		switch ( status )
+		{
+		case Z_OK:
+		case Z_BUF_ERROR:
+			// если буфер заполнен, то у zlib могут оставаться данные,
+			// иначе Z_BUF_ERROR означает лишь что входные данные кончились
+			if ( strm_rx.avail_out == 0 ) continue;
+			if ( strm_rx.avail_in == 0 ) return;
+			if ( status == Z_OK ) continue;
+			onError("AsyncStream::handleInflate() inflate stalled");
+			return;
+		case Z_NEED_DICT:
+			if ( zlib_dict && inflateSetDictionary(&strm_rx, (const Bytef*)zlib_dict, zlib_dict_len) == Z_OK )
+			{
+				continue;
+			}
+			onError("AsyncStream::handleInflate() unknown dictionary");
+			return;
+		case Z_STREAM_END:
+			// пир завершил сжатый поток, остаток входных данных игнорируем
+			if ( strm_rx.avail_in > 0 )
+			{
+				fprintf(stderr, "AsyncStream[%d]: %u bytes after end of zlib stream\n", getFd(), strm_rx.avail_in);
+			}
+			return;
+		default:
+			onError(strm_rx.msg ? strm_rx.msg : "AsyncStream::handleInflate() inflate failed");
+			return;
+		}
 	}
+}
+
+/**
+* Передать накопленные распакованные данные обработчику onRead()
+*/
+void AsyncStream::flushInflate()
+{
+	if ( rx_buf_len == 0 ) return;
+	
+	size_t len = rx_buf_len;
+	rx_buf_len = 0;
 	
-	strm_rx.avail_out = 0;
+	rx_delivering = true;
+	putInReadEvent(rx_buf, len);
+	rx_delivering = false;
+	
+	// буфер освобождается после парковки/отключения компрессии,
+	// но не во время работы обработчика
+	if ( ! compression || rx_parked ) freeInflateBuffer();
 }
 #endif // HAVE_LIBZ
 
@@ -192,14 +470,52 @@ void AsyncStream::handleWrite()
 	NetDaemon *d = getDaemon();
 	if ( d )
 	{
-		if ( d->push(getFd()) )
-		{
-			onEmpty();
-		}
+		afterWrite(d, d->push(getFd()));
 	}
 	else fprintf(stderr, "AsyncStream[%d]::handleWrite, daemon=NULL\n", getFd());
 }
 
+/**
+* Действия после записи буфера в сокет
+*
+* Продолжает ретрансляцию в поток, снимает блокировку записи
+* (onWritable()) и вызывает onEmpty(), если буфер пуст
+*
+* @param d демон
+* @param empty TRUE буфер записан полностью
+*/
+void AsyncStream::afterWrite(NetDaemon *d, bool empty)
+{
+	// данные ретрансляции идут после уже накопленных в буфере
+	if ( relay_source && relay_source->relay_pending > 0 && d->getBufferedSize(getFd()) == 0 )
+	{
+		if ( relay_source->flushRelay() ) d->modifyObject(relay_source);
+	}
+	
+	if ( write_blocked && ( high_watermark == 0 || d->getBufferedSize(getFd()) <= low_watermark ) )
+	{
+		write_blocked = false;
+		onWritable();
+	}
+	
+	if ( empty && d->getBufferedSize(getFd()) == 0 )
+	{
+		onEmpty();
+	}
+}
+
+/**
+* Отложенная запись отправила весь буфер
+*
+* EPOLLOUT не будет, поэтому шаги handleWrite() после записи
+* выполняются здесь
+*/
+void AsyncStream::onFlush()
+{
+	NetDaemon *d = getDaemon();
+	if ( d ) afterWrite(d, true);
+}
+
 /**
 * Обработка обрыва связи
 */
@@ -214,7 +530,173 @@ void AsyncStream::handlePeerDown()
 */
 uint32_t AsyncStream::getEventsMask()
 {
-	return EPOLLIN | EPOLLRDHUP | EPOLLONESHOT | EPOLLHUP | EPOLLERR;
+	uint32_t mask = EPOLLRDHUP | EPOLLONESHOT | EPOLLHUP | EPOLLERR;
+	
+	// пока получатель ретрансляции не принял данные, источник не читаем
+	if ( relay_pending == 0 ) mask |= EPOLLIN;
+	
+	// ждем готовности принять данные ретрансляции
+	if ( relay_source && relay_source->relay_pending > 0 ) mask |= EPOLLOUT;
+	
+	return mask;
+}
+
+/**
+* Ретранслировать поступившие данные
+*/
+void AsyncStream::handleRelay()
+{
+	while ( flushRelay() )
+	{
+		ssize_t r = splice(getFd(), 0, relay_pipe[1], 0, FD_RELAY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if ( r <= 0 )
+		{
+			if ( r < 0 && errno != EAGAIN ) stderror();
+			return;
+		}
+		relay_pending += r;
+	}
+}
+
+/**
+* Передать содержимое канала получателю
+* @return TRUE канал пуст, FALSE получатель пока не может принять данные
+*/
+bool AsyncStream::flushRelay()
+{
+	NetDaemon *d = relay_target->getDaemon();
+	if ( d == 0 )
+	{
+		// получатель удален из демона, передать данные некуда
+		breakRelay();
+		return false;
+	}
+	
+	if ( relay_pending == 0 ) return true;
+	
+	// не обгонять данные уже накопленные в буфере получателя,
+	// получатель продолжит ретрансляцию из handleWrite()
+	if ( d->getBufferedSize(relay_target->getFd()) > 0 ) return false;
+	
+	while ( relay_pending > 0 )
+	{
+		ssize_t r = splice(relay_pipe[0], 0, relay_target->getFd(), 0, relay_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if ( r <= 0 )
+		{
+			if ( r < 0 && errno != EAGAIN ) stderror();
+			
+			// подождать EPOLLOUT получателя
+			d->modifyObject(relay_target);
+			return false;
+		}
+		relay_pending -= r;
+	}
+	
+	return true;
+}
+
+/**
+* Начать ретрансляцию входящих данных в другой поток
+*
+* @param target получатель, должен обслуживаться тем же демоном
+* @return TRUE ретрансляция начата, FALSE ретрансляция невозможна
+*/
+bool AsyncStream::startRelay(AsyncStream *target)
+{
+	if ( target == 0 || target == this || relay_target || target->relay_source ) return false;
+	if ( getDaemon() == 0 || target->getDaemon() != getDaemon() ) return false;
+	
+	if ( isCompressionEnable() || isTLSEnable() || target->isCompressionEnable() || target->isTLSEnable() )
+	{
+		// нужна обработка данных, используйте onRead() + put()
+		return false;
+	}
+	
+	if ( pipe2(relay_pipe, O_NONBLOCK | O_CLOEXEC) < 0 )
+	{
+		stderror();
+		return false;
+	}
+	
+	relay_target = target;
+	target->relay_source = this;
+	return true;
+}
+
+/**
+* Остановить ретрансляцию
+*
+* Данные оставшиеся в канале передаются получателю через put()
+*/
+void AsyncStream::stopRelay()
+{
+	if ( relay_target == 0 ) return;
+	
+	char chunk[FD_READ_CHUNK_SIZE];
+	while ( relay_pending > 0 )
+	{
+		ssize_t r = ::read(relay_pipe[0], chunk, sizeof(chunk));
+		if ( r <= 0 ) break;
+		relay_pending -= r;
+		if ( ! relay_target->put(chunk, r) ) break;
+	}
+	
+	AsyncStream *target = relay_target;
+	detachRelay();
+	
+	NetDaemon *d = getDaemon();
+	if ( d )
+	{
+		d->modifyObject(this);
+		d->modifyObject(target);
+	}
+}
+
+/**
+* Разорвать ретрансляцию без передачи данных оставшихся в канале
+*/
+void AsyncStream::detachRelay()
+{
+	if ( relay_target == 0 ) return;
+	
+	relay_target->relay_source = 0;
+	relay_target = 0;
+	relay_pending = 0;
+	::close(relay_pipe[0]);
+	::close(relay_pipe[1]);
+	relay_pipe[0] = -1;
+	relay_pipe[1] = -1;
+}
+
+/**
+* Прервать ретрансляцию, получатель которой удален из демона
+*
+* Источник снова читается обычным образом, вызывается onRelayError()
+*/
+void AsyncStream::breakRelay()
+{
+	if ( relay_target == 0 ) return;
+	
+	detachRelay();
+	
+	// источник мог быть снят с чтения (EPOLLIN) в ожидании получателя
+	NetDaemon *d = getDaemon();
+	if ( d ) d->modifyObject(this);
+	
+	onRelayError("relay target removed from daemon");
+}
+
+/**
+* Установить демона
+*
+* При удалении из демона прерывает ретрансляцию в этот поток
+*/
+void AsyncStream::setDaemon(NetDaemon *pDaemon)
+{
+	// до смены демона: AsyncObject::setDaemon(0) может освободить объект
+	if ( pDaemon == 0 && relay_source ) relay_source->breakRelay();
+	
+	AsyncObject::setDaemon(pDaemon);
 }
 
 /**
@@ -286,6 +768,59 @@ void AsyncStream::onEmpty()
 {
 }
 
+/**
+* Установить уровни буфера
+*
+* @param low нижний уровень (в байтах)
+* @param high верхний уровень (в байтах), 0 - отключить уровни
+* @return TRUE уровни установлены, FALSE неверные значения (low >= high)
+*/
+bool AsyncStream::setWatermarks(size_t low, size_t high)
+{
+	if ( high > 0 && low >= high ) return false;
+	low_watermark = high > 0 ? low : 0;
+	high_watermark = high;
+	return true;
+}
+
+/**
+* Вернуть размер буферизованных данных (в байтах)
+*/
+size_t AsyncStream::getBufferedSize()
+{
+	NetDaemon *daemon = getDaemon();
+	return daemon ? daemon->getBufferedSize(getFd()) : 0;
+}
+
+/**
+* Обработчик блокировки записи
+*
+* Вызывается один раз, когда put() не смог принять данные из-за квоты
+* или нехватки буфера
+*/
+void AsyncStream::onWriteBlocked()
+{
+}
+
+/**
+* Обработчик разблокировки записи
+*
+* Вызывается после onWriteBlocked(), когда буфер освободился
+*/
+void AsyncStream::onWritable()
+{
+}
+
+/**
+* Обработчик обрыва ретрансляции
+*
+* По умолчанию сообщает об ошибке через onError()
+*/
+void AsyncStream::onRelayError(const char *message)
+{
+	onError(message);
+}
+
 /**
 * Установить соединение
 * @param sa указатель на структуру sockaddr
@@ -427,27 +962,25 @@ bool AsyncStream::enableCompression(compression_method_t method)
 #ifdef HAVE_LIBZ
 	if ( ! compression && canCompression(method) )
 	{
-		int status;
+		// ретрансляция через splice() несовместима со сжатием
+		stopRelay();
+		if ( relay_source ) relay_source->stopRelay();
 		
 		// инициализация компрессора исходящего трафика
-		memset(&strm_tx, 0, sizeof(strm_tx));
-		status = deflateInit(&strm_tx, ZLIB_COMPRESS_LEVEL);
-		if ( status != Z_OK )
+		if ( ! initDeflate(false) )
 		{
-			(void)deflateEnd(&strm_tx);
 			return false;
 		}
 		
 		// инициализация декомпрессора входящего трафика
-		memset(&strm_rx, 0, sizeof(strm_rx));
-		status = inflateInit(&strm_rx);
-		if ( status != Z_OK )
+		if ( ! initInflate(false) )
 		{
 			(void)deflateEnd(&strm_tx);
-			(void)inflateEnd(&strm_rx);
 			return false;
 		}
 		
+		tx_parked = false;
+		rx_parked = false;
 		compression = true;
 		return true;
 	}
@@ -466,13 +999,164 @@ bool AsyncStream::disableCompression()
 #ifdef HAVE_LIBZ
 	if ( compression )
 	{
-		(void)deflateEnd(&strm_tx);
-		(void)inflateEnd(&strm_rx);
+		if ( ! tx_parked ) (void)deflateEnd(&strm_tx);
+		if ( ! rx_parked ) (void)inflateEnd(&strm_rx);
+		
+		free(rx_window);
+		rx_window = 0;
+		rx_window_len = 0;
+		freeInflateBuffer();
 		
 		compression = false;
 	}
+	return true;
+#else
+	return true;
+#endif // HAVE_LIBZ
+}
+
+/**
+* Установить параметры компрессора
+*
+* Меньшие значения экономят память ценой степени сжатия, действуют
+* при следующем включении компрессии. Декомпрессор всегда использует
+* размер окна, указанный пиром в заголовке zlib.
+*
+* @param windowBits размер окна (от 9 до 15)
+* @param memLevel уровень памяти (от 1 до 9)
+* @return TRUE - параметры приняты, FALSE - недопустимые параметры
+*/
+bool AsyncStream::setCompressionParams(int windowBits, int memLevel)
+{
+#ifdef HAVE_LIBZ
+	if ( windowBits < 9 || windowBits > MAX_WBITS ) return false;
+	if ( memLevel < 1 || memLevel > MAX_MEM_LEVEL ) return false;
+	zlib_window_bits = windowBits;
+	zlib_mem_level = memLevel;
+	return true;
+#else
+	return false;
+#endif // HAVE_LIBZ
+}
+
+/**
+* Установить предустановленный словарь компрессии
+*
+* Словарь должен быть установлен до включения компрессии и должен быть
+* известен пиру (например zlib_xmpp_dictionary), иначе пир не сможет
+* распаковать поток. Словарь не копируется.
+*
+* @param dict словарь или NULL чтобы отключить словарь
+* @param len размер словаря
+*/
+void AsyncStream::setCompressionDictionary(const char *dict, size_t len)
+{
+#ifdef HAVE_LIBZ
+	zlib_dict = dict;
+	zlib_dict_len = dict ? len : 0;
+#endif // HAVE_LIBZ
+}
+
+/**
+* Вернуть объем памяти занимаемый компрессией (в байтах)
+*/
+size_t AsyncStream::getCompressionMemory()
+{
+#ifdef HAVE_LIBZ
+	return zlib_memory + rx_window_len + (rx_buf ? ZLIB_INFLATE_CHUNK_SIZE : 0);
 #else
+	return 0;
+#endif // HAVE_LIBZ
+}
+
+/**
+* Запарковать компрессию простаивающего потока
+*
+* Освобождает контексты zlib, при поступлении новых данных контексты
+* создаются заново прозрачно для пользователя. Компрессор паркуется
+* всегда (с Z_FULL_FLUSH), декомпрессор только если пир остановился
+* на границе блока deflate, при этом сохраняется только заполненная
+* часть его окна.
+*
+* @return TRUE - запаркованы оба контекста, FALSE - не все
+*/
+bool AsyncStream::parkCompression()
+{
+#ifdef HAVE_LIBZ
+	if ( ! compression ) return false;
+	
+	if ( ! tx_parked )
+	{
+		// Z_FULL_FLUSH гарантирует, что следующие блоки не ссылаются
+		// на предыдущие данные, значит окно компрессора больше не нужно
+		char buf[ZLIB_DEFLATE_CHUNK_SIZE];
+		strm_tx.next_in = 0;
+		strm_tx.avail_in = 0;
+		do
+		{
+			strm_tx.next_out = (unsigned char*)buf;
+			strm_tx.avail_out = sizeof(buf);
+			deflate(&strm_tx, Z_FULL_FLUSH);
+			size_t have = sizeof(buf) - strm_tx.avail_out;
+			if ( ! putInTLS(buf, have) ) return false;
+		}
+		while ( strm_tx.avail_out == 0 );
+		
+		(void)deflateEnd(&strm_tx);
+		tx_parked = true;
+	}
+	
+	if ( ! rx_parked )
+	{
+		if ( strm_rx.total_in == 0 )
+		{
+			// ещё ничего не принято, нечего сохранять
+			(void)inflateEnd(&strm_rx);
+			freeInflateBuffer();
+			rx_bits = 0;
+			rx_parked = true;
+			return true;
+		}
+		
+		// декомпрессор должен ждать заголовок следующего блока (128),
+		// последний блок (64) не должен встречаться. Если пир использует
+		// Z_SYNC_FLUSH, то битовый буфер пуст, но на всякий случай
+		// оставшиеся биты восстанавливаются через inflatePrime(). После
+		// Z_PARTIAL_FLUSH пир оставляет блок незавершенным и парковка
+		// декомпрессора невозможна.
+		if ( rx_buf_len != 0 || strm_rx.avail_in != 0 || (strm_rx.data_type & ~7) != 128 ) return false;
+		rx_bits = strm_rx.data_type & 7;
+		
+		uInt len = 0;
+		if ( inflateGetDictionary(&strm_rx, Z_NULL, &len) != Z_OK ) return false;
+		if ( len > 0 )
+		{
+			rx_window = (char *)malloc(len);
+			if ( rx_window == 0 ) return false;
+			inflateGetDictionary(&strm_rx, (Bytef*)rx_window, &len);
+			rx_window_len = len;
+		}
+		
+		(void)inflateEnd(&strm_rx);
+		freeInflateBuffer();
+		rx_parked = true;
+	}
+	
 	return true;
+#else
+	return false;
+#endif // HAVE_LIBZ
+}
+
+/**
+* Проверить запаркована ли компрессия
+*/
+bool AsyncStream::isCompressionParked()
+{
+#ifdef HAVE_LIBZ
+	return compression && tx_parked && rx_parked;
+#else
+	return false;
 #endif // HAVE_LIBZ
 }
 
@@ -512,6 +1196,10 @@ bool AsyncStream::enableTLS(AsyncStream::tls_ctx *ctx)
 #ifdef HAVE_GNUTLS
 	if ( tls_status != tls_off ) return true;
 	
+	// ретрансляция через splice() несовместима с TLS
+	stopRelay();
+	if ( relay_source ) relay_source->stopRelay();
+	
 	gnutls_init(&tls_session, GNUTLS_SERVER);
 	
 	gnutls_priority_set (tls_session, ctx->priority_cache);
@@ -598,6 +1286,13 @@ bool AsyncStream::putDeflate(const char *data, size_t len)
 {
 	char buf[ZLIB_DEFLATE_CHUNK_SIZE];
 	
+	if ( tx_parked )
+	{
+		// продолжаем поток без заголовка, окно пира сохранено
+		if ( ! initDeflate(true) ) return false;
+		tx_parked = false;
+	}
+	
 	strm_tx.next_in = (unsigned char*)data;
 	strm_tx.avail_in = len;
 	
@@ -606,7 +1301,9 @@ bool AsyncStream::putDeflate(const char *data, size_t len)
 		strm_tx.next_out = (unsigned char*)buf;
 		strm_tx.avail_out = sizeof(buf);
 		
-		deflate(&strm_tx, Z_PARTIAL_FLUSH);
+		// Z_SYNC_FLUSH выравнивает поток по границе байта и блока, что
+		// позволяет пиру запарковать свой декомпрессор
+		deflate(&strm_tx, Z_SYNC_FLUSH);
 		
 		size_t have = sizeof(buf) - strm_tx.avail_out;
 		
@@ -645,6 +1342,171 @@ bool AsyncStream::put(const char *data, size_t len)
 	return putInCompressor(data, len);
 }
 
+/**
+* Записать данные в указанную полосу
+*
+* Если включено сжатие или TLS, то полоса игнорируется
+*
+* @param data указатель на данные
+* @param len размер данных
+* @param lane полоса NetDaemon::LANE_CONTROL или NetDaemon::LANE_BULK
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool AsyncStream::put(const char *data, size_t len, int lane)
+{
+	if ( isCompressionEnable() || isTLSEnable() )
+	{
+		return put(data, len);
+	}
+	
+	if ( DEBUG::DUMP_IO )
+	{
+		std::string io_dump(data, len);
+		printf("DUMP WRITE[%d]: \033[22;34m%s\033[0m\n", getFd(), io_dump.c_str());
+	}
+	
+	return putInBuffer(data, len, lane);
+}
+
+/**
+* Записать данные из нескольких фрагментов
+*
+* Если включено сжатие или TLS, то фрагменты записываются по одному
+*
+* @param iov массив фрагментов данных
+* @param iovcnt число фрагментов
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool AsyncStream::put(const struct iovec *iov, int iovcnt)
+{
+	if ( isCompressionEnable() || isTLSEnable() || DEBUG::DUMP_IO )
+	{
+		for(int i = 0; i < iovcnt; i++)
+		{
+			if ( ! put(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len) ) return false;
+		}
+		return true;
+	}
+	
+	NetDaemon *daemon = getDaemon();
+	if ( daemon )
+	{
+		return handlePut(daemon, daemon->put(getFd(), iov, iovcnt, NetDaemon::LANE_CONTROL));
+	}
+	return false;
+}
+
+/**
+* Записать готовую цепочку блоков
+*
+* Поток всегда становится владельцем цепочки. Если включено сжатие или
+* TLS, то данные блоков передаются через put(), а блоки сразу
+* возвращаются в пул
+*
+* @param blocks цепочка блоков из пула демона
+* @param len размер данных в цепочке
+* @return TRUE цепочка принята, FALSE цепочка не принята
+*/
+bool AsyncStream::putBlocks(nano_block_t *blocks, size_t len)
+{
+	NetDaemon *daemon = getDaemon();
+	if ( ! daemon ) return false;
+	
+	if ( isCompressionEnable() || isTLSEnable() || DEBUG::DUMP_IO )
+	{
+		bool status = true;
+		for(nano_block_t *block = blocks; block && len > 0 && status; block = block->next)
+		{
+			size_t n = len < BLOCKSPOOL_BLOCK_SIZE ? len : BLOCKSPOOL_BLOCK_SIZE;
+			status = put(reinterpret_cast<const char *>(block->data), n);
+			len -= n;
+		}
+		daemon->getPool()->free(blocks);
+		return status;
+	}
+	
+	if ( daemon->putBlocks(getFd(), blocks, len, NetDaemon::LANE_CONTROL) )
+	{
+		return handlePut(daemon, true);
+	}
+	
+	daemon->getPool()->free(blocks);
+	return handlePut(daemon, false);
+}
+
+/**
+* Записать XML-тег/дерево
+*
+* Тег сериализуется прямо в блоки пула демона и ставится в очередь через
+* putBlocks(). Если включено сжатие или TLS, или в пуле нет блоков, то
+* тег сериализуется в строку и записывается через put()
+*
+* @param tag тег
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool AsyncStream::putTag(const EasyTag &tag)
+{
+	NetDaemon *daemon = getDaemon();
+	if ( ! daemon ) return false;
+	
+	if ( ! isCompressionEnable() && ! isTLSEnable() && ! DEBUG::DUMP_IO )
+	{
+		size_t size = tag.serializedSize();
+		nano_block_t *blocks = daemon->getPool()->allocBySize(size);
+		if ( blocks )
+		{
+			tag.serialize(blocks);
+			return putBlocks(blocks, size);
+		}
+	}
+	
+	std::string xml = tag.serialize();
+	return put(xml.data(), xml.size());
+}
+
+/**
+* Записать фрагмент файла
+*
+* Если включено сжатие или TLS, то файл читается блоками и передается
+* через put(), в этом случае при ошибке невозможно точно установить какая
+* часть фрагмента была записана
+*
+* @param file_fd дескриптор файла
+* @param offset смещение в файле
+* @param len размер фрагмента
+* @return TRUE фрагмент принят, FALSE фрагмент не принят
+*/
+bool AsyncStream::putFile(int file_fd, off_t offset, size_t len)
+{
+	NetDaemon *daemon = getDaemon();
+	if ( ! daemon ) return false;
+	
+	if ( ! isCompressionEnable() && ! isTLSEnable() )
+	{
+		if ( daemon->putFile(getFd(), file_fd, offset, len) )
+		{
+			daemon->modifyObject(this);
+			return true;
+		}
+		return false;
+	}
+	
+	char chunk[FD_READ_CHUNK_SIZE];
+	while ( len > 0 )
+	{
+		ssize_t r = pread(file_fd, chunk, len < sizeof(chunk) ? len : sizeof(chunk), offset);
+		if ( r <= 0 )
+		{
+			fprintf(stderr, "AsyncStream[%d]::putFile, pread() fault: %s\n", getFd(), r < 0 ? strerror(errno) : "unexpected end of file");
+			return false;
+		}
+		if ( ! put(chunk, r) ) return false;
+		offset += r;
+		len -= r;
+	}
+	return true;
+}
+
 /**
 * Передать данные компрессору
 *
@@ -721,15 +1583,87 @@ bool AsyncStream::putInTLS(const char *data, size_t len)
 * @return TRUE данные приняты, FALSE данные не приняты - нет места
 */
 bool AsyncStream::putInBuffer(const char *data, size_t len)
+{
+	return putInBuffer(data, len, NetDaemon::LANE_CONTROL);
+}
+
+/**
+* Передать данные в указанную полосу файлового буфера
+*
+* @param data указатель на данные
+* @param len размер данных
+* @param lane полоса NetDaemon::LANE_CONTROL или NetDaemon::LANE_BULK
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool AsyncStream::putInBuffer(const char *data, size_t len, int lane)
 {
 	NetDaemon *daemon = getDaemon();
 	if ( daemon )
 	{
-		if ( daemon->put(getFd(), data, len) )
+		if ( direct_write && canWriteDirect(daemon, len) )
 		{
-			daemon->modifyObject(this);
-			return true;
+			// очередь пуста - пробуем записать напрямую
+			ssize_t r = ::write(getFd(), data, len);
+			if ( r == (ssize_t) len ) return true;
+			if ( r > 0 )
+			{
+				data += r;
+				len -= r;
+			}
 		}
+		
+		return handlePut(daemon, daemon->put(getFd(), data, len, lane));
+	}
+	return false;
+}
+
+/**
+* Проверить возможность прямой записи в сокет
+*
+* Прямая запись возможна если очередь пуста, данные ретрансляции не ждут
+* отправки, TLS отключен и остаток гарантированно поместится в буфер
+*
+* @param daemon демон
+* @param len размер данных
+* @return TRUE можно писать напрямую
+*/
+bool AsyncStream::canWriteDirect(NetDaemon *daemon, size_t len)
+{
+	if ( isTLSEnable() ) return false;
+	if ( relay_source && relay_source->relay_pending > 0 ) return false;
+	if ( daemon->getBufferedSize(getFd()) > 0 ) return false;
+	return daemon->canPut(getFd(), len);
+}
+
+/**
+* Обработать результат записи в файловый буфер
+*
+* Взводит EPOLLOUT если данные приняты и вызывает onWriteBlocked() если
+* данные не приняты или буфер достиг верхнего уровня
+*
+* @param daemon демон
+* @param accepted TRUE данные приняты в буфер
+* @return accepted
+*/
+bool AsyncStream::handlePut(NetDaemon *daemon, bool accepted)
+{
+	if ( accepted )
+	{
+		if ( deferred_flush ) daemon->scheduleFlush(getFd());
+		else daemon->modifyObject(this);
+		if ( high_watermark > 0 && ! write_blocked && daemon->getBufferedSize(getFd()) >= high_watermark )
+		{
+			// данные приняты, но буфер достиг верхнего уровня
+			write_blocked = true;
+			onWriteBlocked();
+		}
+		return true;
+	}
+	
+	if ( ! write_blocked )
+	{
+		write_blocked = true;
+		onWriteBlocked();
 	}
 	return false;
 }
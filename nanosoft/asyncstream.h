@@ -3,8 +3,10 @@
 
 #include <nanosoft/asyncobject.h>
 #include <nanosoft/config.h>
+#include <nanosoft/blockspool.h>
 #include <nanosoft/error.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -16,6 +18,7 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_LIBZ
 #include <zlib.h>
@@ -30,6 +33,20 @@
 */
 typedef const char *compression_method_t;
 
+/**
+* Предустановленный словарь zlib для XMPP-станз
+*
+* Используется только если обе стороны договорились о словаре
+*/
+extern const char zlib_xmpp_dictionary[];
+
+/**
+* Размер словаря zlib_xmpp_dictionary
+*/
+extern const size_t zlib_xmpp_dictionary_size;
+
+class EasyTag;
+
 /**
 * Класс для асинхронной работы с потоками
 */
@@ -53,6 +70,89 @@ private:
 	*/
 	int flags;
 	
+	/**
+	* Запись заблокирована
+	*
+	* TRUE - последний put() не смог принять данные, был вызван
+	* onWriteBlocked() и ожидается onWritable()
+	*/
+	bool write_blocked;
+	
+	/**
+	* Нижний уровень буфера (в байтах)
+	*
+	* Заблокированная по верхнему уровню запись разблокируется, когда
+	* в буфере останется не больше low_watermark байт
+	*/
+	size_t low_watermark;
+	
+	/**
+	* Верхний уровень буфера (в байтах)
+	*
+	* Когда в буфере накапливается high_watermark байт или больше,
+	* вызывается onWriteBlocked(). 0 - уровни отключены
+	*/
+	size_t high_watermark;
+	
+	/**
+	* Режим отложенной записи (см. setDeferredFlush())
+	*/
+	bool deferred_flush;
+	
+	/**
+	* Режим прямой записи (см. setDirectWrite())
+	*/
+	bool direct_write;
+	
+	/**
+	* Получатель ретрансляции или NULL
+	*
+	* Обычный указатель (не ptr), чтобы два потока ретранслирующие друг
+	* в друга не удерживали друг друга счетчиками ссылок
+	*/
+	AsyncStream *relay_target;
+	
+	/**
+	* Источник ретрансляции в данный поток или NULL
+	*/
+	AsyncStream *relay_source;
+	
+	/**
+	* Канал (pipe) через который данные ретранслируются splice()
+	*/
+	int relay_pipe[2];
+	
+	/**
+	* Размер данных в канале, ещё не переданных получателю
+	*
+	* Пока канал не пуст, источник не читается (снимается EPOLLIN),
+	* а получатель ждет EPOLLOUT
+	*/
+	size_t relay_pending;
+	
+	/**
+	* Ретранслировать поступившие данные
+	*/
+	void handleRelay();
+	
+	/**
+	* Передать содержимое канала получателю
+	* @return TRUE канал пуст, FALSE получатель пока не может принять данные
+	*/
+	bool flushRelay();
+	
+	/**
+	* Разорвать ретрансляцию без передачи данных оставшихся в канале
+	*/
+	void detachRelay();
+	
+	/**
+	* Прервать ретрансляцию, получатель которой удален из демона
+	*
+	* Источник снова читается обычным образом, вызывается onRelayError()
+	*/
+	void breakRelay();
+	
 #ifdef HAVE_LIBZ
 	/**
 	* Флаг компрессии zlib
@@ -72,11 +172,133 @@ private:
 	*/
 	z_stream strm_rx;
 	
+	/**
+	* Размер окна компрессора (windowBits)
+	*/
+	int zlib_window_bits;
+	
+	/**
+	* Уровень памяти компрессора (memLevel)
+	*/
+	int zlib_mem_level;
+	
+	/**
+	* Предустановленный словарь или NULL
+	*
+	* Словарь не копируется, он должен существовать пока включена компрессия
+	*/
+	const char *zlib_dict;
+	
+	/**
+	* Размер предустановленного словаря
+	*/
+	size_t zlib_dict_len;
+	
+	/**
+	* Объем памяти выделенной zlib для данного потока (в байтах)
+	*/
+	size_t zlib_memory;
+	
+	/**
+	* Компрессор исходящего трафика "запаркован" (контекст освобожден)
+	*/
+	bool tx_parked;
+	
+	/**
+	* Декомпрессор входящего трафика "запаркован" (контекст освобожден)
+	*/
+	bool rx_parked;
+	
+	/**
+	* Сохраненное окно декомпрессора запаркованного потока
+	*/
+	char *rx_window;
+	
+	/**
+	* Размер сохраненного окна декомпрессора
+	*/
+	size_t rx_window_len;
+	
+	/**
+	* Число неиспользованных бит в последнем принятом байте запаркованного
+	* декомпрессора
+	*/
+	int rx_bits;
+	
+	/**
+	* Последний принятый байт сжатого потока
+	*/
+	unsigned char rx_last_byte;
+	
+	/**
+	* Функция выделения памяти для zlib с учетом объема
+	*/
+	static voidpf zlibAlloc(voidpf opaque, uInt items, uInt size);
+	
+	/**
+	* Функция освобождения памяти для zlib с учетом объема
+	*/
+	static void zlibFree(voidpf opaque, voidpf address);
+	
+	/**
+	* Инициализировать компрессор исходящего трафика
+	*
+	* @param raw TRUE - без заголовка zlib (продолжение запаркованного потока)
+	*/
+	bool initDeflate(bool raw);
+	
+	/**
+	* Инициализировать декомпрессор входящего трафика
+	*
+	* @param raw TRUE - без заголовка zlib (продолжение запаркованного потока)
+	*/
+	bool initInflate(bool raw);
+	
+	/**
+	* Восстановить запаркованный декомпрессор
+	*/
+	bool resumeInflate();
+	
+	/**
+	* Буфер распакованных данных
+	*
+	* Выделяется при поступлении сжатых данных и освобождается по окончании
+	* чтения из сокета (см. flushDecompressor()), при парковке или
+	* отключении компрессии
+	*/
+	char *rx_buf;
+	
+	/**
+	* Размер данных в буфере распакованных данных
+	*/
+	size_t rx_buf_len;
+	
+	/**
+	* Признак передачи буфера распакованных данных обработчику onRead()
+	*
+	* Пока обработчик работает с буфером, освобождать его нельзя
+	*/
+	bool rx_delivering;
+	
+	/**
+	* Освободить буфер распакованных данных, если он не используется
+	*/
+	void freeInflateBuffer();
+	
 	/**
 	* Обработка поступивших сжатых данных
+	*
+	* Распакованные данные накапливаются в буфере rx_buf и передаются
+	* обработчику onRead() когда буфер заполнится или по окончании
+	* чтения из сокета, см. flushInflate()
 	*/
 	void handleInflate(const char *data, size_t len);
 	
+	/**
+	* Передать накопленные распакованные данные обработчику onRead()
+	*/
+	void flushInflate();
+	
 	/**
 	* Записать данные со сжатием zlib deflate
 	*
@@ -141,6 +363,13 @@ private:
 	*/
 	void putInDecompressor(const char *data, size_t len);
 	
+	/**
+	* Передать обработчику onRead() данные накопленные декомпрессором
+	*
+	* Вызывается по окончании чтения из сокета
+	*/
+	void flushDecompressor();
+	
 	/**
 	* Передать данные обработчику onRead()
 	*/
@@ -154,6 +383,22 @@ private:
 	*/
 	void handleWrite();
 	
+	/**
+	* Действия после записи буфера в сокет
+	*
+	* Продолжает ретрансляцию в поток, снимает блокировку записи
+	* (onWritable()) и вызывает onEmpty(), если буфер пуст
+	*
+	* @param d демон
+	* @param empty TRUE буфер записан полностью
+	*/
+	void afterWrite(NetDaemon *d, bool empty);
+	
+	/**
+	* Отложенная запись отправила весь буфер
+	*/
+	virtual void onFlush();
+	
 	/**
 	* Обработка обрыва связи
 	*/
@@ -215,6 +460,41 @@ protected:
 	*/
 	virtual void onEmpty();
 	
+	/**
+	* Обработчик блокировки записи
+	*
+	* Вызывается один раз, когда put() не смог принять данные из-за квоты
+	* или нехватки буфера, либо когда буфер достиг верхнего уровня (данные
+	* при этом приняты). Производителю следует приостановиться (например
+	* перестать читать из источника) до вызова onWritable()
+	*/
+	virtual void onWriteBlocked();
+	
+	/**
+	* Обработчик разблокировки записи
+	*
+	* Вызывается после onWriteBlocked(), когда буфер освободился и можно
+	* повторить запись. Если заданы уровни буфера, то только когда буфер
+	* опустился до нижнего уровня
+	*/
+	virtual void onWritable();
+	
+	/**
+	* Обработчик обрыва ретрансляции
+	*
+	* Вызывается у источника, если получатель удален из демона до
+	* остановки ретрансляции. Данные, оставшиеся в канале, потеряны,
+	* дальше поток читается через onRead(). По умолчанию вызывает onError()
+	*/
+	virtual void onRelayError(const char *message);
+	
+	/**
+	* Установить демона
+	*
+	* При удалении из демона прерывает ретрансляцию в этот поток
+	*/
+	virtual void setDaemon(NetDaemon *pDaemon);
+	
 	/**
 	* Пир (peer) закрыл поток.
 	*
@@ -260,6 +540,34 @@ protected:
 	* @return TRUE данные приняты, FALSE данные не приняты - нет места
 	*/
 	bool putInBuffer(const char *data, size_t len);
+	
+	/**
+	* Передать данные в указанную полосу файлового буфера
+	*
+	* @param data указатель на данные
+	* @param len размер данных
+	* @param lane полоса NetDaemon::LANE_CONTROL или NetDaemon::LANE_BULK
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool putInBuffer(const char *data, size_t len, int lane);
+	
+	/**
+	* Обработать результат записи в файловый буфер
+	*
+	* @param daemon демон
+	* @param accepted TRUE данные приняты в буфер
+	* @return accepted
+	*/
+	bool handlePut(NetDaemon *daemon, bool accepted);
+	
+	/**
+	* Проверить возможность прямой записи в сокет
+	*
+	* @param daemon демон
+	* @param len размер данных
+	* @return TRUE можно писать напрямую
+	*/
+	bool canWriteDirect(NetDaemon *daemon, size_t len);
 public:
 	
 	/**
@@ -342,6 +650,54 @@ public:
 	*/
 	bool disableCompression();
 	
+	/**
+	* Установить параметры компрессора
+	*
+	* Меньшие значения экономят память ценой степени сжатия, действуют
+	* при следующем включении компрессии. Декомпрессор всегда использует
+	* размер окна, указанный пиром в заголовке zlib.
+	*
+	* @param windowBits размер окна (от 9 до 15)
+	* @param memLevel уровень памяти (от 1 до 9)
+	* @return TRUE - параметры приняты, FALSE - недопустимые параметры
+	*/
+	bool setCompressionParams(int windowBits, int memLevel);
+	
+	/**
+	* Установить предустановленный словарь компрессии
+	*
+	* Словарь должен быть установлен до включения компрессии и должен быть
+	* известен пиру (например zlib_xmpp_dictionary), иначе пир не сможет
+	* распаковать поток. Словарь не копируется.
+	*
+	* @param dict словарь или NULL чтобы отключить словарь
+	* @param len размер словаря
+	*/
+	void setCompressionDictionary(const char *dict, size_t len);
+	
+	/**
+	* Вернуть объем памяти занимаемый компрессией (в байтах)
+	*/
+	size_t getCompressionMemory();
+	
+	/**
+	* Запарковать компрессию простаивающего потока
+	*
+	* Освобождает контексты zlib, при поступлении новых данных контексты
+	* создаются заново прозрачно для пользователя. Компрессор паркуется
+	* всегда (с Z_FULL_FLUSH), декомпрессор только если пир остановился
+	* на границе блока deflate, при этом сохраняется только заполненная
+	* часть его окна.
+	*
+	* @return TRUE - запаркованы оба контекста, FALSE - не все
+	*/
+	bool parkCompression();
+	
+	/**
+	* Проверить запаркована ли компрессия
+	*/
+	bool isCompressionParked();
+	
 	/**
 	* Проверить поддерживается ли TLS
 	* @return TRUE - TLS поддерживается, FALSE - TLS не поддерживается
@@ -384,6 +740,171 @@ public:
 	*/
 	bool put(const char *data, size_t len);
 	
+	/**
+	* Вернуть статус блокировки записи
+	* @return TRUE запись заблокирована до вызова onWritable()
+	*/
+	bool isWriteBlocked() const { return write_blocked; }
+	
+	/**
+	* Включить/отключить режим отложенной записи
+	*
+	* В этом режиме put() не взводит EPOLLOUT, а данные, записанные за
+	* время обработки события, отправляются сразу после возврата из
+	* обработчика одним writev() на сегмент: меньше задержка и меньше
+	* пакетов. EPOLLOUT взводится только если сокет не принял всё сразу.
+	*
+	* Если данные ушли сразу, то всё, что обычно происходит по EPOLLOUT,
+	* выполняется в конце хода: onWritable() после onWriteBlocked()
+	* (уровни буфера), продолжение ретрансляции и onEmpty()
+	*/
+	void setDeferredFlush(bool enable) { deferred_flush = enable; }
+	
+	/**
+	* Вернуть статус режима отложенной записи
+	*/
+	bool isDeferredFlush() const { return deferred_flush; }
+	
+	/**
+	* Включить/отключить режим прямой записи
+	*
+	* В этом режиме, если очередь исходящих данных пуста, put() сначала
+	* пробует записать данные прямо в сокет, а в буфер NetDaemon попадает
+	* только то, что сокет не принял. Обычно это экономит копирование в
+	* блоки пула и лишний проход epoll. Запись выполняется только если
+	* весь остаток гарантированно поместится в буфер, так что put()
+	* по-прежнему либо принимает данные целиком, либо не принимает вовсе.
+	* При включенном TLS прямая запись не используется.
+	*
+	* NB: если данные ушли сразу, то onEmpty() не вызывается, т.к. событий
+	* EPOLLOUT не было
+	*/
+	void setDirectWrite(bool enable) { direct_write = enable; }
+	
+	/**
+	* Вернуть статус режима прямой записи
+	*/
+	bool isDirectWrite() const { return direct_write; }
+	
+	/**
+	* Установить уровни буфера
+	*
+	* Позволяет прокси-подобным объектам перестать читать источник, пока
+	* получатель медленный, и тем самым ограничить расход памяти без
+	* опроса getBufferedSize()
+	*
+	* @param low нижний уровень (в байтах), onWritable() при снижении до него
+	* @param high верхний уровень (в байтах), onWriteBlocked() при его
+	*   достижении, 0 - отключить уровни
+	* @return TRUE уровни установлены, FALSE неверные значения (low >= high)
+	*/
+	bool setWatermarks(size_t low, size_t high);
+	
+	/**
+	* Вернуть размер буферизованных данных (в байтах)
+	*/
+	size_t getBufferedSize();
+	
+	/**
+	* Записать данные в указанную полосу
+	*
+	* Объемные данные (NetDaemon::LANE_BULK) уступают срочным на границах
+	* сообщений. Если включено сжатие или TLS, то поток байт един и полоса
+	* игнорируется - данные пишутся как обычным put()
+	*
+	* @param data указатель на данные
+	* @param len размер данных
+	* @param lane полоса NetDaemon::LANE_CONTROL или NetDaemon::LANE_BULK
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool put(const char *data, size_t len, int lane);
+	
+	/**
+	* Записать фрагмент файла
+	*
+	* Фрагмент отправляется из файла напрямую через sendfile(), без
+	* копирования в буфер. Если включено сжатие или TLS, то файл
+	* читается и записывается как обычные данные через put()
+	*
+	* @param file_fd дескриптор файла
+	* @param offset смещение в файле
+	* @param len размер фрагмента
+	* @return TRUE фрагмент принят, FALSE фрагмент не принят
+	*/
+	bool putFile(int file_fd, off_t offset, size_t len);
+	
+	/**
+	* Записать данные из нескольких фрагментов
+	*
+	* Фрагменты попадают в буфер как одно сообщение без промежуточной
+	* склейки. Если включено сжатие или TLS, то фрагменты записываются
+	* по одному и при ошибке невозможно точно установить какая часть
+	* данных была записана
+	*
+	* @param iov массив фрагментов данных
+	* @param iovcnt число фрагментов
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool put(const struct iovec *iov, int iovcnt);
+	
+	/**
+	* Записать готовую цепочку блоков
+	*
+	* Блоки из пула демона (getDaemon()->getPool()), заполненные подряд
+	* с начала первого блока, ставятся в очередь без копирования. Поток
+	* всегда становится владельцем цепочки: если данные не приняты, то
+	* блоки возвращаются в пул. Если включено сжатие или TLS, то данные
+	* блоков записываются через put()
+	*
+	* @param blocks цепочка блоков
+	* @param len размер данных в цепочке
+	* @return TRUE цепочка принята, FALSE цепочка не принята
+	*/
+	bool putBlocks(nano_block_t *blocks, size_t len);
+	
+	/**
+	* Записать XML-тег/дерево
+	*
+	* Тег сериализуется прямо в блоки пула демона (размер вычисляется
+	* заранее) и ставится в очередь через putBlocks() без промежуточных
+	* строк. Если включено сжатие или TLS, или в пуле нет блоков, то тег
+	* сериализуется в строку и записывается через put()
+	*
+	* @param tag тег
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool putTag(const EasyTag &tag);
+	
+	/**
+	* Начать ретрансляцию входящих данных в другой поток
+	*
+	* Данные передаются из сокета в сокет через pipe и splice() без
+	* копирования в пространство пользователя, onRead() при этом не
+	* вызывается. Пока получатель не принимает данные, источник не
+	* читается. Для двусторонней ретрансляции вызовите для обоих потоков.
+	*
+	* Если на любой из сторон включено сжатие или TLS, то ретрансляция
+	* не начинается и функция возвращает FALSE - используйте обычную
+	* схему onRead() + put(). Включение сжатия или TLS останавливает
+	* ретрансляцию
+	*
+	* @param target получатель, должен обслуживаться тем же демоном
+	* @return TRUE ретрансляция начата, FALSE ретрансляция невозможна
+	*/
+	bool startRelay(AsyncStream *target);
+	
+	/**
+	* Остановить ретрансляцию
+	*
+	* Данные оставшиеся в канале передаются получателю через put()
+	*/
+	void stopRelay();
+	
+	/**
+	* Вернуть статус ретрансляции
+	*/
+	bool isRelayActive() const { return relay_target != 0; }
+	
 	/**
 	* Завершить чтение/запись
 	* @note только для сокетов
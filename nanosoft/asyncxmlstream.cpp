@@ -7,6 +7,10 @@ using namespace std;
 */
 AsyncXMLStream::AsyncXMLStream(int afd): AsyncStream(afd)
 {
+	setMaxStanzaSize(XMLSTREAM_MAX_STANZA_SIZE);
+	setMaxDepth(XMLSTREAM_MAX_DEPTH);
+	setMaxAttributes(XMLSTREAM_MAX_ATTRIBUTES);
+	setMaxChildren(XMLSTREAM_MAX_CHILDREN);
 }
 
 /**
@@ -22,21 +22,6 @@ protected:
 	*/
 	virtual void onRead(const char *data, size_t len);
 	
-	/**
-	* Обработчик открытия тега
-	*/
-	virtual void onStartElement(const std::string &name, const EasyRow &atts) = 0;
-	
-	/**
-	* Обработчик символьных данных
-	*/
-	virtual void onCharacterData(const std::string &cdata) = 0;
-	
-	/**
-	* Обработчик закрытия тега
-	*/
-	virtual void onEndElement(const std::string &name) = 0;
-	
 	/**
 	* Обработчик ошибок парсера
 	*/
@@ -52,6 +37,8 @@ protected:
 public:
 	/**
 	* Конструктор
+	*
+	* Ограничения станз берутся из config.h (XMLSTREAM_MAX_*)
 	*/
 	AsyncXMLStream(int afd);
 	
@@ -0,0 +1,169 @@
+
+#include <nanosoft/atom.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <new>
+
+/**
+* Запись пустой строки
+*/
+Atom::data_t Atom::empty_data = { 0, true, 0, { 0 } };
+
+/**
+* Таблица имен (открытая адресация)
+*/
+static Atom::data_t **atom_table = 0;
+
+/**
+* Размер таблицы (степень двойки)
+*/
+static size_t atom_capacity = 0;
+
+/**
+* Число имен в таблице
+*/
+static size_t atom_count = 0;
+
+/**
+* Словарь XMPP, добавляемый в таблицу при первом обращении
+*
+* Имена из сети в таблицу не добавляются, поэтому частые имена заносятся
+* заранее, чтобы разобранные теги сравнивались с ними по указателю
+*/
+static const char *atom_vocabulary[] = {
+	"stream:stream", "stream:features", "stream:error", "xmlns", "xmlns:stream",
+	"xml:lang", "version", "to", "from", "id", "type", "name", "code", "jid",
+	"message", "presence", "iq", "body", "subject", "thread", "error", "text",
+	"show", "status", "priority", "query", "item", "group", "subscription", "ask",
+	"x", "c", "node", "ver", "hash", "delay", "stamp", "ping", "vCard",
+	"starttls", "proceed", "failure", "success", "auth", "challenge", "response",
+	"mechanisms", "mechanism", "compression", "method", "compress", "compressed",
+	"bind", "session", "resource", "register", "enable", "enabled", "r", "a", "h",
+	"request", "received", "active", "composing", "paused",
+	"affiliation", "role", "nick", "action",
+	0
+};
+
+/**
+* TRUE - словарь уже добавлен в таблицу
+*/
+static bool atom_seeded = false;
+
+/**
+* Мьютекс таблицы имен
+*/
+static pthread_mutex_t atom_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+* Хеш строки (FNV-1a)
+*/
+static uint32_t atom_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+* Создать запись
+*/
+Atom::data_t* Atom::allocData(const char *s, size_t len, bool interned)
+{
+	data_t *d = static_cast<data_t *>(::operator new(sizeof(data_t) + len));
+	d->ref_count = 1;
+	d->interned = interned;
+	d->len = len;
+	memcpy(d->str, s, len);
+	d->str[len] = 0;
+	return d;
+}
+
+/**
+* Найти или добавить строку в таблицу имен
+*
+* Вызывается под мьютексом
+*
+* @param insert TRUE - добавить строку если её нет
+* @return запись или NULL если строки нет и её нельзя добавить
+*/
+Atom::data_t* Atom::intern(const char *s, size_t len, bool insert)
+{
+	if ( ! atom_seeded )
+	{
+		atom_seeded = true;
+		for(const char **v = atom_vocabulary; *v; v++) intern(*v, strlen(*v), true);
+	}
+	
+	uint32_t h = atom_hash(s, len);
+	if ( atom_capacity )
+	{
+		size_t mask = atom_capacity - 1;
+		for(size_t i = h & mask; atom_table[i]; i = (i + 1) & mask)
+		{
+			data_t *d = atom_table[i];
+			if ( d->len == len && memcmp(d->str, s, len) == 0 ) return d;
+		}
+	}
+	
+	if ( ! insert || atom_count >= ATOM_TABLE_LIMIT ) return 0;
+	
+	// поддерживаем заполнение таблицы не более половины
+	if ( (atom_count + 1) * 2 > atom_capacity )
+	{
+		size_t capacity = atom_capacity ? atom_capacity * 2 : 256;
+		data_t **table = static_cast<data_t **>(calloc(capacity, sizeof(data_t *)));
+		if ( table == 0 ) return 0;
+		for(size_t j = 0; j < atom_capacity; j++)
+		{
+			data_t *d = atom_table[j];
+			if ( d == 0 ) continue;
+			size_t i = atom_hash(d->str, d->len) & (capacity - 1);
+			while ( table[i] ) i = (i + 1) & (capacity - 1);
+			table[i] = d;
+		}
+		free(atom_table);
+		atom_table = table;
+		atom_capacity = capacity;
+	}
+	
+	data_t *d = allocData(s, len, true);
+	size_t i = h & (atom_capacity - 1);
+	while ( atom_table[i] ) i = (i + 1) & (atom_capacity - 1);
+	atom_table[i] = d;
+	atom_count++;
+	return d;
+}
+
+/**
+* Найти или создать запись для строки
+*
+* Если строки нет в таблице и её нельзя (или не нужно) туда добавить, то
+* создается отдельная запись со счетчиком ссылок
+*/
+Atom::data_t* Atom::lookup(const char *s, size_t len, bool insert)
+{
+	if ( len == 0 ) return &empty_data;
+	
+	pthread_mutex_lock(&atom_mutex);
+	data_t *d = intern(s, len, insert);
+	pthread_mutex_unlock(&atom_mutex);
+	
+	return d ? d : allocData(s, len, false);
+}
+
+/**
+* Вернуть число имен в таблице
+*/
+size_t Atom::getTableSize()
+{
+	pthread_mutex_lock(&atom_mutex);
+	size_t count = atom_count;
+	pthread_mutex_unlock(&atom_mutex);
+	return count;
+}
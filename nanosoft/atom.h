@@ -0,0 +1,224 @@
+#ifndef NANOSOFT_ATOM_H
+#define NANOSOFT_ATOM_H
+
+#include <nanosoft/config.h>
+
+#include <string.h>
+#include <string>
+
+/**
+ * Интернированное имя (атом)
+ *
+ * Все атомы с одинаковой строкой ссылаются на одну запись глобальной
+ * таблицы имен, поэтому сравнение атомов сводится к сравнению указателей,
+ * а копирование не выделяет память. Записи таблицы не удаляются и
+ * не изменяются, их можно разделять между потоками, сама таблица
+ * защищена мьютексом.
+ *
+ * В таблицу попадают имена, созданные приложением, и заранее заданный
+ * словарь XMPP. Имена из сети ищутся через find() и в таблицу не
+ * добавляются, иначе один клиент мог бы заполнить её мусором на всё
+ * время жизни процесса. Кроме того, таблица ограничена ATOM_TABLE_LIMIT
+ * именами. Строки, не попавшие в таблицу, хранятся в отдельной записи
+ * со счетчиком ссылок и сравниваются побайтно.
+ */
+class Atom
+{
+public:
+	
+	/**
+	 * Запись с именем (внутренняя структура)
+	 */
+	struct data_t
+	{
+		/**
+		 * Счетчик ссылок (только для записей вне таблицы)
+		 */
+		int ref_count;
+	
+		/**
+		 * TRUE - запись из таблицы имен
+		 */
+		bool interned;
+	
+		/**
+		 * Длина строки
+		 */
+		size_t len;
+	
+		/**
+		 * Строка, завершенная нулем
+		 */
+		char str[1];
+	};
+	
+private:
+	
+	/**
+	 * Запись пустой строки
+	 */
+	static data_t empty_data;
+	
+	/**
+	 * Указатель на запись
+	 */
+	data_t *p;
+	
+	/**
+	 * Найти или добавить строку в таблицу имен
+	 *
+	 * @param insert TRUE - добавить строку если её нет
+	 * @return запись или NULL если строки нет и её нельзя добавить
+	 */
+	static data_t* intern(const char *s, size_t len, bool insert);
+	
+	/**
+	 * Создать запись вне таблицы
+	 */
+	static data_t* allocData(const char *s, size_t len, bool interned);
+	
+	/**
+	 * Найти или создать запись для строки
+	 */
+	static data_t* lookup(const char *s, size_t len, bool insert);
+	
+	/**
+	 * Освободить ссылку на запись
+	 */
+	void release()
+	{
+		if ( ! p->interned && --p->ref_count == 0 ) ::operator delete(p);
+	}
+	
+public:
+	
+	/**
+	 * Конструктор
+	 *
+	 * Создает атом пустой строки
+	 */
+	Atom(): p(&empty_data) { }
+	
+	/**
+	 * Конструктор
+	 *
+	 * Интернирует строку
+	 */
+	explicit Atom(const char *s): p(lookup(s, strlen(s), true)) { }
+	
+	/**
+	 * Конструктор
+	 *
+	 * Интернирует строку
+	 */
+	explicit Atom(const char *s, size_t len): p(lookup(s, len, true)) { }
+	
+	/**
+	 * Конструктор
+	 *
+	 * Интернирует строку
+	 */
+	explicit Atom(const std::string &s): p(lookup(s.data(), s.length(), true)) { }
+	
+	/**
+	 * Конструктор копий
+	 */
+	Atom(const Atom &a): p(a.p)
+	{
+		if ( ! p->interned ) p->ref_count++;
+	}
+	
+	/**
+	 * Деструктор
+	 */
+	~Atom() { release(); }
+	
+	/**
+	 * Оператор присваивания
+	 */
+	Atom& operator = (const Atom &a)
+	{
+		if ( ! a.p->interned ) a.p->ref_count++;
+		release();
+		p = a.p;
+		return *this;
+	}
+	
+	/**
+	 * Найти атом без добавления строки в таблицу
+	 *
+	 * Для поиска по именам, пришедшим снаружи, чтобы не засорять ими
+	 * таблицу. Если строки нет в таблице, то возвращается атом вне
+	 * таблицы, который сравнивается побайтно
+	 */
+	static Atom find(const char *s)
+	{
+		return find(s, strlen(s));
+	}
+	
+	/**
+	 * Найти атом без добавления строки в таблицу
+	 */
+	static Atom find(const char *s, size_t len)
+	{
+		Atom a;
+		a.p = lookup(s, len, false);
+		return a;
+	}
+	
+	/**
+	 * Вернуть число имен в таблице
+	 */
+	static size_t getTableSize();
+	
+	/**
+	 * Вернуть строку
+	 */
+	const char* c_str() const { return p->str; }
+	
+	/**
+	 * Вернуть копию строки
+	 */
+	std::string str() const { return std::string(p->str, p->len); }
+	
+	/**
+	 * Вернуть длину строки
+	 */
+	size_t length() const { return p->len; }
+	
+	/**
+	 * Проверить пустая ли строка
+	 */
+	bool empty() const { return p->len == 0; }
+	
+	/**
+	 * Сравнить атомы
+	 *
+	 * Два интернированных атома сравниваются по указателю, строки вне
+	 * таблицы - побайтно
+	 */
+	bool operator == (const Atom &a) const
+	{
+		if ( p == a.p ) return true;
+		if ( p->interned && a.p->interned ) return false;
+		return p->len == a.p->len && memcmp(p->str, a.p->str, p->len) == 0;
+	}
+	
+	bool operator != (const Atom &a) const { return ! (*this == a); }
+	
+	/**
+	 * Сравнить со строкой
+	 */
+	bool operator == (const char *s) const { return strcmp(p->str, s) == 0; }
+	
+	bool operator != (const char *s) const { return strcmp(p->str, s) != 0; }
+	
+	/**
+	 * Сравнить со строкой
+	 */
+	bool operator == (const std::string &s) const { return s.length() == p->len && memcmp(p->str, s.data(), p->len) == 0; }
+	
+	bool operator != (const std::string &s) const { return ! (*this == s); }
+};
+
+#endif // NANOSOFT_ATOM_H
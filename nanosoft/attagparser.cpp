@@ -2,6 +2,58 @@
 #include <nanosoft/attagparser.h>
 #include <nanosoft/filestream.h>
 
+#include <pthread.h>
+
+namespace
+{
+	/**
+	* Ключ парсера, закрепленного за потоком
+	*/
+	pthread_key_t parser_key;
+	
+	pthread_once_t parser_key_once = PTHREAD_ONCE_INIT;
+	
+	void deleteParser(void *parser)
+	{
+		delete static_cast<ATTagParser *>(parser);
+	}
+	
+	void createParserKey()
+	{
+		pthread_key_create(&parser_key, deleteParser);
+	}
+	
+	/**
+	* Парсер текущего потока для функций parse_xml_*
+	*
+	* Забирает парсер потока на время разбора и возвращает его обратно.
+	* Если парсер потока уже занят (вложенный вызов), то создается
+	* временный парсер
+	*/
+	class PooledParser
+	{
+	private:
+		ATTagParser *parser;
+		
+	public:
+		PooledParser()
+		{
+			pthread_once(&parser_key_once, createParserKey);
+			parser = static_cast<ATTagParser *>(pthread_getspecific(parser_key));
+			if ( parser ) pthread_setspecific(parser_key, NULL);
+			else parser = new ATTagParser();
+		}
+		
+		~PooledParser()
+		{
+			if ( pthread_getspecific(parser_key) ) delete parser;
+			else pthread_setspecific(parser_key, parser);
+		}
+		
+		ATTagParser* operator -> () { return parser; }
+	};
+}
+
 /**
 * Конструктор парсера
 */
@@ -48,7 +100,7 @@ ATXmlTag * ATTagParser::parseFile(const std::string &path)
 */
 ATXmlTag * ATTagParser::parseStream(stream &s)
 {
-	depth = 0;
+	begin();
 	char buf[4096];
 	while ( 1 )
 	{
@@ -80,14 +132,28 @@ ATXmlTag * ATTagParser::parseStream(stream &s)
 */
 ATXmlTag * ATTagParser::parseString(const std::string &xml)
 {
-	depth = 0;
+	begin();
 	if ( parseXML(xml.c_str(), xml.length(), true) )
 	{
 		return fetchResult();
 	}
+	ATTagBuilder::reset();
 	return 0;
 }
 
+/**
+* Подготовиться к разбору нового документа
+*
+* Контекст парсера сбрасывается на месте, так что один ATTagParser
+* можно использовать для многих документов
+*/
+void ATTagParser::begin()
+{
+	XMLParser::reset();
+	ATTagBuilder::reset();
+	depth = 0;
+}
+
 
 /**
 * Обработчик открытия тега
@@ -130,8 +196,8 @@ void ATTagParser::onParseError(const char *message)
 */
 ATXmlTag * parse_xml_file(const char *path)
 {
-	ATTagParser parser;
-	return parser.parseFile(path);
+	PooledParser parser;
+	return parser->parseFile(path);
 }
 
 /**
@@ -141,8 +207,8 @@ ATXmlTag * parse_xml_file(const char *path)
 */
 ATXmlTag * parse_xml_file(const std::string &path)
 {
-	ATTagParser parser;
-	return parser.parseFile(path);
+	PooledParser parser;
+	return parser->parseFile(path);
 }
 
 /**
@@ -152,8 +218,8 @@ ATXmlTag * parse_xml_file(const std::string &path)
 */
 ATXmlTag * parse_xml_stream(stream &s)
 {
-	ATTagParser parser;
-	return parser.parseStream(s);
+	PooledParser parser;
+	return parser->parseStream(s);
 }
 
 /**
@@ -163,6 +229,6 @@ ATXmlTag * parse_xml_stream(stream &s)
 */
 ATXmlTag * parse_xml_string(const std::string &xml)
 {
-	ATTagParser parser;
-	return parser.parseString(xml);
+	PooledParser parser;
+	return parser->parseString(xml);
 }
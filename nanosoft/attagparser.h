@@ -69,12 +69,22 @@ protected:
 	*/
 	void onParseError(const char *message);
 private:
+	/**
+	* Подготовиться к разбору нового документа
+	*/
+	void begin();
+	
 	/**
 	* Глубина обрабатываемого тега
 	*/
 	int depth;
 };
 
+/**
+* Функции parse_xml_* используют парсер, закрепленный за текущим потоком,
+* и сбрасывают его между документами, а не создают каждый раз новый
+*/
+
 /**
 * Парсинг файла
 * @param path путь к файлу
@@ -0,0 +1,91 @@
+
+#include <nanosoft/easyarena.h>
+
+/**
+* Счетчик созданных арен
+*/
+int EasyArena::arena_created = 0;
+
+/**
+* Счетчик удаленных арен
+*/
+int EasyArena::arena_destroyed = 0;
+
+/**
+* Смещение области данных от начала блока (с выравниванием)
+*/
+#define EASYARENA_HEADER ((sizeof(block_t) + 15) & ~size_t(15))
+
+/**
+* Конструктор
+*/
+EasyArena::EasyArena(): blocks(0), free_blocks(0), pos(0), end(0), live(0), memory(0)
+{
+	arena_created++;
+}
+
+/**
+* Деструктор
+*/
+EasyArena::~EasyArena()
+{
+	arena_destroyed++;
+	reset();
+	while ( free_blocks )
+	{
+		block_t *b = free_blocks;
+		free_blocks = b->next;
+		::operator delete(b);
+	}
+}
+
+/**
+* Взять новый блок не меньше указанного размера
+*/
+void EasyArena::grow(size_t size)
+{
+	block_t *b;
+	if ( size <= EASYARENA_BLOCK_SIZE && free_blocks )
+	{
+		b = free_blocks;
+		free_blocks = b->next;
+	}
+	else
+	{
+		if ( size < EASYARENA_BLOCK_SIZE ) size = EASYARENA_BLOCK_SIZE;
+		b = static_cast<block_t *>(::operator new(EASYARENA_HEADER + size));
+		b->size = size;
+		memory += size;
+	}
+	
+	b->next = blocks;
+	blocks = b;
+	pos = reinterpret_cast<char *>(b) + EASYARENA_HEADER;
+	end = pos + b->size;
+}
+
+/**
+* Сбросить арену
+*
+* Блоки стандартного размера переносятся в список свободных,
+* увеличенные блоки освобождаются
+*/
+void EasyArena::reset()
+{
+	while ( blocks )
+	{
+		block_t *b = blocks;
+		blocks = b->next;
+		if ( b->size == EASYARENA_BLOCK_SIZE )
+		{
+			b->next = free_blocks;
+			free_blocks = b;
+		}
+		else
+		{
+			memory -= b->size;
+			::operator delete(b);
+		}
+	}
+	pos = end = 0;
+}
@@ -0,0 +1,216 @@
+#ifndef NANOSOFT_EASYARENA_H
+#define NANOSOFT_EASYARENA_H
+
+#include <nanosoft/config.h>
+#include <nanosoft/object.h>
+
+#include <stddef.h>
+#include <new>
+
+/**
+ * Арена для узлов XML-дерева (EasyNode)
+ *
+ * Простой линейный аллокатор: память выделяется последовательно из
+ * крупных блоков и не освобождается по отдельности. Каждый узел,
+ * созданный в арене, держит на неё ссылку, когда последний узел
+ * освобождается, арена целиком сбрасывается и блоки повторно используются
+ * для следующего дерева.
+ *
+ * Арена рассчитана на одно дерево (станзу) за раз и не является
+ * потокобезопасной, как и сам EasyNode.
+ */
+class EasyArena: public Object
+{
+private:
+	
+	/**
+	 * Заголовок блока памяти
+	 */
+	struct block_t
+	{
+		/**
+		 * Следующий блок в списке
+		 */
+		block_t *next;
+	
+		/**
+		 * Размер области данных
+		 */
+		size_t size;
+	};
+	
+	/**
+	 * Используемые блоки, первый из них текущий
+	 */
+	block_t *blocks;
+	
+	/**
+	 * Свободные блоки стандартного размера
+	 */
+	block_t *free_blocks;
+	
+	/**
+	 * Позиция следующего выделения в текущем блоке
+	 */
+	char *pos;
+	
+	/**
+	 * Конец текущего блока
+	 */
+	char *end;
+	
+	/**
+	 * Число живых узлов в арене
+	 */
+	int live;
+	
+	/**
+	 * Объем памяти, занятой блоками
+	 */
+	size_t memory;
+	
+	/**
+	 * Взять новый блок не меньше указанного размера
+	 */
+	void grow(size_t size);
+	
+	/**
+	 * Сбросить арену
+	 *
+	 * Блоки стандартного размера переносятся в список свободных,
+	 * увеличенные блоки освобождаются
+	 */
+	void reset();
+	
+public:
+	
+	/**
+	 * Счетчик созданных арен
+	 */
+	static int arena_created;
+	
+	/**
+	 * Счетчик удаленных арен
+	 */
+	static int arena_destroyed;
+	
+	/**
+	 * Конструктор
+	 */
+	EasyArena();
+	
+	/**
+	 * Деструктор
+	 */
+	virtual ~EasyArena();
+	
+	/**
+	 * Выделить память
+	 *
+	 * Память выравнивается по 16 байтам и освобождается только вместе
+	 * со сбросом арены
+	 */
+	void* alloc(size_t size)
+	{
+		size = (size + 15) & ~size_t(15);
+		if ( size_t(end - pos) < size ) grow(size);
+		void *p = pos;
+		pos += size;
+		return p;
+	}
+	
+	/**
+	 * Зарегистрировать узел в арене
+	 */
+	void attach()
+	{
+		live++;
+		lock();
+	}
+	
+	/**
+	 * Отменить регистрацию узла
+	 *
+	 * Когда освобождается последний узел, арена сбрасывается.
+	 * NOTE может удалить саму арену, если на неё больше нет ссылок
+	 */
+	void detach()
+	{
+		if ( --live == 0 ) reset();
+		release();
+	}
+	
+	/**
+	 * Проверить есть ли в арене живые узлы
+	 */
+	bool isBusy() const { return live > 0; }
+	
+	/**
+	 * Вернуть объем памяти, занятой блоками
+	 */
+	size_t getMemory() const { return memory; }
+};
+
+/**
+ * Аллокатор STL поверх EasyArena
+ *
+ * Без арены (NULL) работает как обычный std::allocator. Освобождение
+ * памяти в арене ничего не делает.
+ */
+template <class T>
+class EasyArenaAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	
+	template <class U>
+	struct rebind
+	{
+		typedef EasyArenaAllocator<U> other;
+	};
+	
+	/**
+	 * Арена или NULL
+	 */
+	EasyArena *arena;
+	
+	EasyArenaAllocator(EasyArena *a = NULL): arena(a) { }
+	
+	template <class U>
+	EasyArenaAllocator(const EasyArenaAllocator<U> &a): arena(a.arena) { }
+	
+	T* allocate(size_t n, const void * = 0)
+	{
+		if ( arena ) return static_cast<T *>(arena->alloc(n * sizeof(T)));
+		return static_cast<T *>(::operator new(n * sizeof(T)));
+	}
+	
+	void deallocate(T *p, size_t)
+	{
+		if ( arena == NULL ) ::operator delete(p);
+	}
+	
+	void construct(T *p, const T &value) { new (p) T(value); }
+	
+	void destroy(T *p) { p->~T(); }
+	
+	size_t max_size() const { return size_t(-1) / sizeof(T); }
+	
+	T* address(T &x) const { return &x; }
+	
+	const T* address(const T &x) const { return &x; }
+	
+	template <class U>
+	bool operator == (const EasyArenaAllocator<U> &a) const { return arena == a.arena; }
+	
+	template <class U>
+	bool operator != (const EasyArenaAllocator<U> &a) const { return arena != a.arena; }
+};
+
+#endif // NANOSOFT_EASYARENA_H
@@ -6,6 +6,113 @@
 
 using namespace nanosoft;
 
+/**
+* Размер порции экранирования при выводе в блоки
+*/
+#define EASYNODE_ESCAPE_CHUNK 256
+
+namespace
+{
+	/**
+	* Вывод в непрерывный буфер
+	*/
+	struct buffer_out_t
+	{
+		char *pos;
+		
+		void put(const char *data, size_t len)
+		{
+			memcpy(pos, data, len);
+			pos += len;
+		}
+		
+		void putEscaped(const char *data, size_t len)
+		{
+			pos += XMLWriter::escape(pos, data, len);
+		}
+	};
+	
+	/**
+	* Вывод в цепочку блоков пула
+	*/
+	struct blocks_out_t
+	{
+		nano_block_t *block;
+		size_t used;
+		
+		void put(const char *data, size_t len)
+		{
+			while ( len > 0 )
+			{
+				if ( used == BLOCKSPOOL_BLOCK_SIZE )
+				{
+					block = block->next;
+					used = 0;
+				}
+				size_t n = BLOCKSPOOL_BLOCK_SIZE - used;
+				if ( n > len ) n = len;
+				memcpy(block->data + used, data, n);
+				used += n;
+				data += n;
+				len -= n;
+			}
+		}
+		
+		void putEscaped(const char *data, size_t len)
+		{
+			char buf[XMLWRITER_ESCAPE_MAX(EASYNODE_ESCAPE_CHUNK)];
+			while ( len > 0 )
+			{
+				size_t n = len < EASYNODE_ESCAPE_CHUNK ? len : EASYNODE_ESCAPE_CHUNK;
+				put(buf, XMLWriter::escape(buf, data, n));
+				data += n;
+				len -= n;
+			}
+		}
+	};
+	
+	/**
+	* Записать узел/дерево
+	*
+	* Формат совпадает с serializedSize()
+	*/
+	template <class out_t>
+	void writeNode(const EasyNode *node, out_t &out)
+	{
+		if ( node->type == EASYNODE_CDATA )
+		{
+			out.put(node->text.data(), node->text.size());
+			return;
+		}
+		
+		out.put("<", 1);
+		out.put(node->name.c_str(), node->name.length());
+		for(EasyNode::attr_list_t::const_iterator it = node->attr.begin(); it != node->attr.end(); ++it)
+		{
+			out.put(" ", 1);
+			out.put(it->name.c_str(), it->name.length());
+			out.put("=\"", 2);
+			out.putEscaped(it->value.data(), it->value.size());
+			out.put("\"", 1);
+		}
+		
+		if ( node->first_child == NULL )
+		{
+			out.put(" />", 3);
+			return;
+		}
+		
+		out.put(">", 1);
+		for(const EasyNode *child = node->first_child; child; child = child->next)
+		{
+			writeNode(child, out);
+		}
+		out.put("</", 2);
+		out.put(node->name.c_str(), node->name.length());
+		out.put(">", 1);
+	}
+}
+
 /**
 * Счетчик созданных узлов
 */
@@ -21,7 +128,8 @@ int EasyNode::node_destroyed = 0;
 *
 * Создает пустой текстовый блок
 */
-EasyNode::EasyNode(): type(EASYNODE_CDATA), parent(NULL)
+EasyNode::EasyNode(): type(EASYNODE_CDATA), arena(NULL), parent(NULL),
+	first_child(NULL), last_child(NULL), next(NULL)
 {
 	node_created++;
 }
@@ -32,7 +140,8 @@ EasyNode::EasyNode(): type(EASYNODE_CDATA), parent(NULL)
 * Создает узел-тег с указанным именем
 */
 EasyNode::EasyNode(const std::string &tag_name): type(EASYNODE_TAG),
-	name(tag_name), parent(NULL)
+	arena(NULL), name(tag_name), parent(NULL),
+	first_child(NULL), last_child(NULL), next(NULL)
 {
 	node_created++;
 }
@@ -43,9 +152,53 @@ EasyNode::EasyNode(const std::string &tag_name): type(EASYNODE_TAG),
 * Создает узел-тег с указанным именем и атрибутами
 */
 EasyNode::EasyNode(const std::string &tag_name, const EasyRow &atts):
-	type(EASYNODE_TAG), name(tag_name), attr(atts), parent(NULL)
+	type(EASYNODE_TAG), arena(NULL), name(tag_name), parent(NULL),
+	first_child(NULL), last_child(NULL), next(NULL)
+{
+	node_created++;
+	setAttributes(atts);
+}
+
+/**
+* Конструктор
+*
+* Создает узел-тег с указанным (уже интернированным) именем и атрибутами
+* в формате expat: имя, значение, ..., NULL (atts может быть NULL).
+* Атрибуты приходят от парсера, поэтому их имена только ищутся в таблице
+* атомов, но не добавляются в неё
+*/
+EasyNode::EasyNode(const Atom &tag_name, const char **atts, EasyArena *a):
+	type(EASYNODE_TAG), arena(a), name(tag_name),
+	text(text_t::allocator_type(a)), attr(attr_list_t::allocator_type(a)),
+	parent(NULL), first_child(NULL), last_child(NULL), next(NULL)
+{
+	node_created++;
+	if ( arena ) arena->attach();
+	if ( atts )
+	{
+		int count = 0;
+		while ( atts[count * 2] ) count++;
+		attr.reserve(count);
+		for(int i = 0; i < count; i++)
+		{
+			const char *value = atts[i * 2 + 1];
+			attr.push_back(attr_t(Atom::find(atts[i * 2]), value, strlen(value), arena));
+		}
+	}
+}
+
+/**
+* Конструктор
+*
+* Создает текстовый блок в арене
+*/
+EasyNode::EasyNode(const char *data, size_t len, EasyArena *a):
+	type(EASYNODE_CDATA), arena(a), text(data, len, text_t::allocator_type(a)),
+	attr(attr_list_t::allocator_type(a)),
+	parent(NULL), first_child(NULL), last_child(NULL), next(NULL)
 {
 	node_created++;
+	if ( arena ) arena->attach();
 }
 
 /**
@@ -53,10 +206,16 @@ EasyNode::EasyNode(const std::string &tag_name, const EasyRow &atts):
 *
 * Создает копию узла (без дочених элементов)
 */
-EasyNode::EasyNode(const Ref &node): type(node->type), name(node->name),
-	text(node->text), attr(node->attr.copy()), parent(NULL)
+EasyNode::EasyNode(const Ref &node): type(node->type), arena(NULL), name(node->name),
+	text(node->text.data(), node->text.size()), parent(NULL),
+	first_child(NULL), last_child(NULL), next(NULL)
 {
 	node_created++;
+	attr.reserve(node->attr.size());
+	for(attr_list_t::const_iterator it = node->attr.begin(); it != node->attr.end(); ++it)
+	{
+		attr.push_back(attr_t(it->name, it->value.data(), it->value.size(), NULL));
+	}
 }
 
 /**
@@ -73,9 +232,25 @@ EasyNode::~EasyNode()
 */
 EasyNode::Ref EasyNode::cdata(const std::string &value)
 {
-	EasyNode *node = new EasyNode();
-	node->text = value;
-	return node;
+	return new EasyNode(value.data(), value.size(), NULL);
+}
+
+/**
+* Создать узел CDATA в арене (или в куче если арена NULL)
+*/
+EasyNode* EasyNode::cdata(const char *data, size_t len, EasyArena *a)
+{
+	if ( a == NULL ) return new EasyNode(data, len, NULL);
+	return new (a->alloc(sizeof(EasyNode))) EasyNode(data, len, a);
+}
+
+/**
+* Создать узел-тег в арене (или в куче если арена NULL)
+*/
+EasyNode* EasyNode::create(const Atom &tag_name, const char **atts, EasyArena *a)
+{
+	if ( a == NULL ) return new EasyNode(tag_name, atts);
+	return new (a->alloc(sizeof(EasyNode))) EasyNode(tag_name, atts, a);
 }
 
 /**
@@ -84,10 +259,9 @@ EasyNode::Ref EasyNode::cdata(const std::string &value)
 EasyNode::Ref EasyNode::copy(const Ref &tree)
 {
 	Ref node = new EasyNode(tree);
-	const_iterator end = tree->nodes.end();
-	for(const_iterator it = tree->nodes.begin(); it != end; ++it)
+	for(EasyNode *child = tree->first_child; child; child = child->next)
 	{
-		node->append(copy(*it));
+		node->append(copy(child));
 	}
 	return node;
 }
@@ -95,31 +269,61 @@ EasyNode::Ref EasyNode::copy(const Ref &tree)
 
 /**
 * Сериализовать в виде строки
+*
+* Память под строку выделяется один раз, по serializedSize()
 */
 std::string EasyNode::serialize() const
 {
-	if ( type == EASYNODE_CDATA ) return text;
+	std::string xml(serializedSize(), 0);
+	if ( ! xml.empty() ) serialize(&xml[0]);
+	return xml;
+}
+
+/**
+* Вернуть точный размер сериализованного узла/дерева
+*/
+size_t EasyNode::serializedSize() const
+{
+	if ( type == EASYNODE_CDATA ) return text.size();
 	
-	std::string xml = "<" + name;
-	for(attributes_t::const_iterator it = attr.begin(); it != attr.end(); ++it)
-	{
-		xml += " " + it->first + "=\"" + XMLWriter::escape(it->second) + "\"";
-	}
-    if( nodes.empty() )
+	// "<name" + ">" + "</name>" или "<name" + " />"
+	size_t size = first_child ? name.length() * 2 + 5 : name.length() + 4;
+	for(attr_list_t::const_iterator it = attr.begin(); it != attr.end(); ++it)
 	{
-		xml += " />";
+		// ' name="value"'
+		size += it->name.length() + 4 + XMLWriter::escapedSize(it->value.data(), it->value.size());
 	}
-	else
+	for(const EasyNode *child = first_child; child; child = child->next)
 	{
-		xml += ">";
-		for(const_iterator it = nodes.begin(); it != nodes.end(); ++it)
-		{
-			xml += (*it)->serialize();
-		}
-		xml += "</" + name + ">";
+		size += child->serializedSize();
 	}
-	
-	return xml;
+	return size;
+}
+
+/**
+* Сериализовать в буфер
+*
+* Буфер должен вмещать serializedSize() байт
+*
+* @return указатель на конец записанных данных
+*/
+char* EasyNode::serialize(char *buf) const
+{
+	buffer_out_t out = { buf };
+	writeNode(this, out);
+	return out.pos;
+}
+
+/**
+* Сериализовать в цепочку блоков
+*
+* Цепочка должна вмещать serializedSize() байт (BlocksPool::allocBySize),
+* блоки заполняются подряд с начала первого блока
+*/
+void EasyNode::serialize(nano_block_t *blocks) const
+{
+	blocks_out_t out = { blocks, 0 };
+	writeNode(this, out);
 }
 
 /**
@@ -129,16 +333,54 @@ std::string EasyNode::serialize() const
 */
 std::string EasyNode::cdata() const
 {
-	if ( type == EASYNODE_CDATA ) return text;
+	if ( type == EASYNODE_CDATA ) return std::string(text.data(), text.size());
 	
-	std::string result;
-	for(const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+	// обычный случай: тег с одним текстовым блоком
+	if ( first_child && first_child == last_child && first_child->type == EASYNODE_CDATA )
 	{
-		result += (*it)->cdata();
+		return std::string(first_child->text.data(), first_child->text.size());
 	}
+	
+	std::string result;
+	result.reserve(cdataSize());
+	cdata(result);
 	return result;
 }
 
+/**
+* Дописать CDATA в строку
+*
+* Соединяет все секции CDATA без промежуточных строк
+*/
+void EasyNode::cdata(std::string &out) const
+{
+	if ( type == EASYNODE_CDATA )
+	{
+		out.append(text.data(), text.size());
+		return;
+	}
+	
+	for(const EasyNode *child = first_child; child; child = child->next)
+	{
+		child->cdata(out);
+	}
+}
+
+/**
+* Вернуть суммарную длину секций CDATA
+*/
+size_t EasyNode::cdataSize() const
+{
+	if ( type == EASYNODE_CDATA ) return text.size();
+	
+	size_t size = 0;
+	for(const EasyNode *child = first_child; child; child = child->next)
+	{
+		size += child->cdataSize();
+	}
+	return size;
+}
+
 /**
 * Найти голову дерева
 */
@@ -154,11 +396,16 @@ EasyNode::Ref EasyNode::head()
 */
 void EasyNode::clear()
 {
-	for(iterator it = nodes.begin(); it != nodes.end(); ++it)
+	EasyNode *child = first_child;
+	first_child = last_child = NULL;
+	while ( child )
 	{
-		(*it)->parent = NULL;
+		EasyNode *next_child = child->next;
+		child->parent = NULL;
+		child->next = NULL;
+		child->release();
+		child = next_child;
 	}
-	nodes.clear();
 }
 
 /**
@@ -166,7 +413,17 @@ void EasyNode::clear()
 */
 void EasyNode::append(const std::string &value)
 {
-	append( cdata(value) );
+	append( cdata(value.data(), value.size(), arena) );
+}
+
+/**
+* Добавить секцию CDATA
+*
+* Текст размещается в арене узла
+*/
+void EasyNode::append(const char *data, size_t len)
+{
+	append( cdata(data, len, arena) );
 }
 
 /**
@@ -174,18 +431,15 @@ void EasyNode::append(const std::string &value)
 */
 void EasyNode::append(Ref tree)
 {
-	if ( tree->parent )
-	{
-		Ref node = copy(tree);
-		node->parent = this;
-		nodes.push_back(node);
-		return;
-	}
-	else
-	{
-		tree->parent = this;
-		nodes.push_back(tree);
-	}
+	if ( tree->parent ) tree = copy(tree);
+	
+	EasyNode *node = tree.getObject();
+	node->lock();
+	node->parent = this;
+	node->next = NULL;
+	if ( last_child ) last_child->next = node;
+	else first_child = node;
+	last_child = node;
 }
 
 /**
@@ -193,10 +447,14 @@ void EasyNode::append(Ref tree)
 */
 EasyNode* EasyNode::find(const char *name) const
 {
-	for(const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+	// имя ищется без добавления в таблицу; интернированные имена
+	// сравниваются по указателю, а имя вне таблицы - побайтно: имена
+	// разобранных тегов в таблицу не добавляются, поэтому отсутствие
+	// имени в таблице не значит, что тега нет
+	Atom key = Atom::find(name);
+	for(EasyNode *node = first_child; node; node = node->next)
 	{
-		EasyNode *node = it->getObject();
-		if ( node->type == EASYNODE_TAG && node->name == name ) return node;
+		if ( node->type == EASYNODE_TAG && node->name == key ) return node;
 	}
 	return NULL;
 }
@@ -218,7 +476,7 @@ EasyNode::Ref EasyNode::pickup(const char *path)
 		child = cur->find(name.c_str());
 		if ( child == NULL )
 		{
-			child = new EasyNode(name.c_str());
+			child = create(Atom(name), NULL, cur->arena);
 			cur->append(child);
 		}
 		cur = child;
@@ -229,9 +487,103 @@ EasyNode::Ref EasyNode::pickup(const char *path)
 	child = cur->find(path);
 	if ( child == 0 )
 	{
-		child = new EasyNode(path);
+		child = create(Atom(path), NULL, cur->arena);
 		cur->append(child);
 	}
 	
 	return child;
 }
+
+/**
+* Найти атрибут
+*
+* @return атрибут или NULL если его нет
+*/
+const EasyNode::attr_t* EasyNode::findAttribute(const char *name) const
+{
+	if ( attr.empty() ) return NULL;
+	Atom key = Atom::find(name);
+	for(attr_list_t::const_iterator it = attr.begin(); it != attr.end(); ++it)
+	{
+		if ( it->name == key ) return &*it;
+	}
+	return NULL;
+}
+
+/**
+* Установить значение атрибута
+*
+* Если атрибут уже есть, то сменить его значение
+*/
+void EasyNode::setAttribute(const Atom &name, const char *value, size_t len)
+{
+	for(attr_list_t::iterator it = attr.begin(); it != attr.end(); ++it)
+	{
+		if ( it->name == name )
+		{
+			it->value.assign(value, len);
+			return;
+		}
+	}
+	attr.push_back(attr_t(name, value, len, arena));
+}
+
+/**
+* Удалить атрибут
+*/
+void EasyNode::removeAttribute(const char *name)
+{
+	Atom key = Atom::find(name);
+	for(attr_list_t::iterator it = attr.begin(); it != attr.end(); ++it)
+	{
+		if ( it->name == key )
+		{
+			attr.erase(it);
+			return;
+		}
+	}
+}
+
+/**
+* Заменить все атрибуты значениями из EasyRow
+*/
+void EasyNode::setAttributes(const EasyRow &row)
+{
+	attr.clear();
+	for(EasyRow::const_iterator it = row.begin(); it != row.end(); ++it)
+	{
+		attr.push_back(attr_t(Atom(it->first), it->second.data(), it->second.size(), arena));
+	}
+}
+
+/**
+* Вернуть копию атрибутов в виде EasyRow
+*/
+EasyRow EasyNode::getAttributes() const
+{
+	EasyRow row;
+	for(attr_list_t::const_iterator it = attr.begin(); it != attr.end(); ++it)
+	{
+		row.set(it->name.c_str(), std::string(it->value.data(), it->value.size()));
+	}
+	return row;
+}
+
+/**
+* Обработка обнуления счетчика ссылок
+*
+* Узел из арены не удаляется, а только разрушается, память
+* возвращается вместе со сбросом арены
+*/
+void EasyNode::onFree()
+{
+	if ( arena == NULL )
+	{
+		delete this;
+		return;
+	}
+	
+	EasyArena *a = arena;
+	this->~EasyNode();
+	a->detach();
+}
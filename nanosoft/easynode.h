@@ -19,6 +19,9 @@
 
 #include <nanosoft/object.h>
 #include <nanosoft/easyrow.h>
+#include <nanosoft/atom.h>
+#include <nanosoft/easyarena.h>
+#include <nanosoft/blockspool.h>
 
 #include <string>
 #include <vector>
@@ -55,19 +58,36 @@ public:
 	typedef ptr<EasyNode> Ref;
 	
 	/**
-	 * Список потомков
+	 * Строка текстовых данных
 	 */
-	typedef std::vector<Ref> node_list_t;
+	typedef std::basic_string<char, std::char_traits<char>, EasyArenaAllocator<char> > text_t;
 	
 	/**
-	 * Итератор
+	 * Атрибут тега
 	 */
-	typedef node_list_t::iterator iterator;
+	struct attr_t
+	{
+		/**
+		 * Имя атрибута
+		 */
+		Atom name;
+		
+		/**
+		 * Значение атрибута
+		 */
+		text_t value;
+		
+		attr_t(const Atom &n, const char *v, size_t len, EasyArena *a):
+			name(n), value(v, len, text_t::allocator_type(a)) { }
+	};
 	
 	/**
-	 * Константный итератор
+	 * Список атрибутов
+	 *
+	 * У тега обычно лишь несколько атрибутов, поэтому они хранятся
+	 * в порядке добавления в коротком массиве и ищутся перебором
 	 */
-	typedef node_list_t::const_iterator const_iterator;
+	typedef std::vector<attr_t, EasyArenaAllocator<attr_t> > attr_list_t;
 	
 	/**
 	 * Тип узла
@@ -75,19 +95,29 @@ public:
 	int type;
 	
 	/**
-	 * Атрибуты тега
+	 * Арена, в которой размещен узел, или NULL если узел в куче
+	 *
+	 * Текст и атрибуты узла размещаются в той же арене
 	 */
-	EasyRow attr;
+	EasyArena *arena;
 	
 	/**
 	 * Имя тега
+	 *
+	 * Имена интернируются, поэтому сравнение имен при поиске сводится
+	 * к сравнению указателей
 	 */
-	std::string name;
+	Atom name;
 	
 	/**
 	 * Текстовые данные
 	 */
-	std::string text;
+	text_t text;
+	
+	/**
+	 * Атрибуты тега
+	 */
+	attr_list_t attr;
 	
 	/**
 	 * Ссылка на родителя
@@ -95,9 +125,22 @@ public:
 	EasyNode *parent;
 	
 	/**
-	 * Потомки узла
+	 * Первый потомок
+	 *
+	 * Потомки образуют односвязный список через next, родитель держит
+	 * ссылку (lock) на каждого потомка
+	 */
+	EasyNode *first_child;
+	
+	/**
+	 * Последний потомок
+	 */
+	EasyNode *last_child;
+	
+	/**
+	 * Следующий узел того же родителя
 	 */
-	node_list_t nodes;
+	EasyNode *next;
 	
 	/**
 	 * Счетчик созданных узлов
@@ -130,6 +173,24 @@ public:
 	 */
 	EasyNode(const std::string &tag_name, const EasyRow &atts);
 	
+	/**
+	 * Конструктор
+	 *
+	 * Создает узел-тег с указанным (уже интернированным) именем и атрибутами
+	 * в формате expat: имя, значение, ..., NULL (atts может быть NULL)
+	 *
+	 * NOTE если указана арена, то память под сам узел тоже должна быть
+	 *   выделена из неё, используйте create()
+	 */
+	EasyNode(const Atom &tag_name, const char **atts, EasyArena *a = NULL);
+	
+	/**
+	 * Конструктор
+	 *
+	 * Создает текстовый блок в арене, см. cdata()
+	 */
+	EasyNode(const char *data, size_t len, EasyArena *a);
+	
 	/**
 	 * Конструктор
 	 *
@@ -147,6 +208,16 @@ public:
 	 */
 	static Ref cdata(const std::string &value);
 	
+	/**
+	 * Создать узел CDATA в арене (или в куче если арена NULL)
+	 */
+	static EasyNode* cdata(const char *data, size_t len, EasyArena *a);
+	
+	/**
+	 * Создать узел-тег в арене (или в куче если арена NULL)
+	 */
+	static EasyNode* create(const Atom &tag_name, const char **atts, EasyArena *a);
+	
 	/**
 	 * Создать копию узла/дерева
 	 */
@@ -154,9 +225,33 @@ public:
 	
 	/**
 	 * Сериализовать в виде строки
+	 *
+	 * Память под строку выделяется один раз, по serializedSize()
 	 */
 	std::string serialize() const;
 	
+	/**
+	 * Вернуть точный размер сериализованного узла/дерева
+	 */
+	size_t serializedSize() const;
+	
+	/**
+	 * Сериализовать в буфер
+	 *
+	 * Буфер должен вмещать serializedSize() байт
+	 *
+	 * @return указатель на конец записанных данных
+	 */
+	char* serialize(char *buf) const;
+	
+	/**
+	 * Сериализовать в цепочку блоков
+	 *
+	 * Цепочка должна вмещать serializedSize() байт (BlocksPool::allocBySize),
+	 * блоки заполняются подряд с начала первого блока
+	 */
+	void serialize(nano_block_t *blocks) const;
+	
 	/**
 	 * Извлечь CDATA
 	 *
@@ -164,6 +259,18 @@ public:
 	 */
 	std::string cdata() const;
 	
+	/**
+	 * Дописать CDATA в строку
+	 *
+	 * Соединяет все секции CDATA без промежуточных строк
+	 */
+	void cdata(std::string &out) const;
+	
+	/**
+	 * Вернуть суммарную длину секций CDATA
+	 */
+	size_t cdataSize() const;
+	
 	/**
 	 * Найти голову дерева
 	 */
@@ -179,6 +286,13 @@ public:
 	 */
 	void append(const std::string &value);
 	
+	/**
+	 * Добавить секцию CDATA
+	 *
+	 * Текст размещается в арене узла
+	 */
+	void append(const char *data, size_t len);
+	
 	/**
 	 * Добавить узел/дерево
 	 */
@@ -195,6 +309,45 @@ public:
 	 * Если каких-то промежуточных узлов нет, то они создаются
 	 */
 	Ref pickup(const char *path);
+	
+	/**
+	 * Найти атрибут
+	 *
+	 * @return атрибут или NULL если его нет
+	 */
+	const attr_t* findAttribute(const char *name) const;
+	
+	/**
+	 * Установить значение атрибута
+	 *
+	 * Если атрибут уже есть, то сменить его значение
+	 */
+	void setAttribute(const Atom &name, const char *value, size_t len);
+	
+	/**
+	 * Удалить атрибут
+	 */
+	void removeAttribute(const char *name);
+	
+	/**
+	 * Заменить все атрибуты значениями из EasyRow
+	 */
+	void setAttributes(const EasyRow &row);
+	
+	/**
+	 * Вернуть копию атрибутов в виде EasyRow
+	 */
+	EasyRow getAttributes() const;
+	
+protected:
+	
+	/**
+	 * Обработка обнуления счетчика ссылок
+	 *
+	 * Узел из арены не удаляется, а только разрушается, память
+	 * возвращается вместе со сбросом арены
+	 */
+	virtual void onFree();
 };
 
 #endif // NANOSOFT_EASYNODE_H
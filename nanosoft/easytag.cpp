@@ -42,6 +42,18 @@ EasyTag::EasyTag(const std::string &tag_name, const EasyRow &atts):
 {
 }
 
+/**
+* Конструктор
+*
+* Создает тег с указанным (уже интернированным) именем и атрибутами
+* в формате expat (имя, значение, ..., NULL). Если указана арена,
+* то тег и все его потомки размещаются в ней
+*/
+EasyTag::EasyTag(const Atom &tag_name, const char **atts, EasyArena *arena):
+	tag(EasyNode::create(tag_name, atts, arena))
+{
+}
+
 /**
 * Деструктор
 */
@@ -62,16 +74,47 @@ void EasyTag::setAttributef(const char *name, const char *fmt, ...)
 	va_start(args, fmt);
 	int len = vasprintf(&value, fmt, args);
 	va_end(args);
-	tag->attr[name] = value;
+	if ( len < 0 ) return;
+	tag->setAttribute(Atom(name), value, len);
 	free(value);
 }
 
+/**
+* Вернуть значение атрибута
+*/
+std::string EasyTag::getAttribute(const std::string &name, const std::string &defval) const
+{
+	const EasyNode::attr_t *a = tag->findAttribute(name.c_str());
+	return a ? std::string(a->value.data(), a->value.size()) : defval;
+}
+
+/**
+* Вернуть значение атрибута
+*/
+const std::string EasyTag::getAttribute(const char *name, const char *defval) const
+{
+	const EasyNode::attr_t *a = tag->findAttribute(name);
+	return a ? std::string(a->value.data(), a->value.size()) : std::string(defval);
+}
+
 /**
 * Создать дочений тег и вернуть ссылку на него
 */
 EasyTag EasyTag::createTag(const std::string &name, const EasyRow &atts)
 {
-	EasyNode::Ref node = new EasyNode(name, atts);
+	EasyNode::Ref node = EasyNode::create(Atom(name), NULL, tag->arena);
+	node->setAttributes(atts);
+	tag->append(node);
+	return node;
+}
+
+/**
+* Создать дочений тег с интернированным именем и атрибутами в формате
+* expat (имя, значение, ..., NULL) и вернуть ссылку на него
+*/
+EasyTag EasyTag::createTag(const Atom &name, const char **atts)
+{
+	EasyNode::Ref node = EasyNode::create(name, atts, tag->arena);
 	tag->append(node);
 	return node;
 }
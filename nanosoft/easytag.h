@@ -80,6 +80,15 @@ public:
 	 */
 	EasyTag(const std::string &tag_name, const EasyRow &atts);
 	
+	/**
+	 * Конструктор
+	 *
+	 * Создает тег с указанным (уже интернированным) именем и атрибутами
+	 * в формате expat (имя, значение, ..., NULL). Если указана арена,
+	 * то тег и все его потомки размещаются в ней
+	 */
+	EasyTag(const Atom &tag_name, const char **atts, EasyArena *arena = NULL);
+	
 	/**
 	 * Деструктор
 	 */
@@ -103,52 +112,55 @@ public:
 	/**
 	 * Вернуть имя тега
 	 */
-	std::string name() const { return tag->name; }
+	std::string name() const { return tag->name.str(); }
 	
 	/**
 	 * Установить имя тега
 	 */
-	void setName(const char *name) { tag->name = name; }
+	void setName(const char *name) { tag->name = Atom(name); }
 	
 	/**
-	 * Вернуть ссылку атрибуты
+	 * Вернуть копию атрибутов
+	 *
+	 * Изменение копии не меняет тег, для этого есть setAttribute()
+	 * и setAttr()
 	 */
-	EasyRow& attr() { return tag->attr; }
+	EasyRow getAttributes() const { return tag->getAttributes(); }
 	
 	/**
-	 * Установить ссылку на атрибуты
+	 * Заменить атрибуты тега
 	 */
-	void setAttr(const EasyRow &attr) { tag->attr = attr; }
+	void setAttr(const EasyRow &attr) { tag->setAttributes(attr); }
 	
 	/**
 	 * Вернуть содержимое CDATA
 	 */
-	std::string text() const { return tag->text; }
+	std::string text() const { return std::string(tag->text.data(), tag->text.size()); }
 	
 	/**
 	 * Установить содержимое CDATA
 	 */
-	void setText(const std::string &text) { tag->text = text; }
+	void setText(const std::string &text) { tag->text.assign(text.data(), text.size()); }
 	
 	/**
 	 * Проверить существование атрибута
 	 */
-	bool hasAttribute(const std::string &name) const { return tag->attr.exists(name); }
+	bool hasAttribute(const std::string &name) const { return tag->findAttribute(name.c_str()) != NULL; }
 	
 	/**
 	 * Проверить существование атрибута
 	 */
-	bool hasAttribute(const char *name) const { return tag->attr.exists(name); }
+	bool hasAttribute(const char *name) const { return tag->findAttribute(name) != NULL; }
 	
 	/**
 	 * Вернуть значение атрибута
 	 */
-	std::string getAttribute(const std::string &name, const std::string &defval = "") const { return tag->attr.get(name, defval); }
+	std::string getAttribute(const std::string &name, const std::string &defval = "") const;
 	
 	/**
 	 * Вернуть значение атрибута
 	 */
-	const std::string getAttribute(const char *name, const char *defval = "") const { return tag->attr.get(name, defval); }
+	const std::string getAttribute(const char *name, const char *defval = "") const;
 	
 	/**
 	 * Установить значение атрибута
@@ -156,7 +168,7 @@ public:
 	 * Если атрибут уже есть, то сменить его значение
 	 * Если атрибута нет, то добавить атрибут с указанным значением
 	 */
-	void setAttribute(const std::string &name, const std::string &value) { tag->attr.set(name, value); }
+	void setAttribute(const std::string &name, const std::string &value) { tag->setAttribute(Atom(name), value.data(), value.size()); }
 	
 	/**
 	 * Установить значение атрибута
@@ -164,7 +176,7 @@ public:
 	 * Если атрибут уже есть, то сменить его значение
 	 * Если атрибута нет, то добавить атрибут с указанным значением
 	 */
-	void setAttribute(const char *name, const std::string &value) { tag->attr.set(name, value); }
+	void setAttribute(const char *name, const std::string &value) { tag->setAttribute(Atom(name), value.data(), value.size()); }
 	
 	/**
 	 * Установить значение атрибута
@@ -172,7 +184,7 @@ public:
 	 * Если атрибут уже есть, то сменить его значение
 	 * Если атрибута нет, то добавить атрибут с указанным значением
 	 */
-	void setAttribute(const char *name, const char *value) { tag->attr.set(name, value); }
+	void setAttribute(const char *name, const char *value) { tag->setAttribute(Atom(name), value, strlen(value)); }
 	
 	/**
 	 * Установить значение атрибута с форматированием в стиле printf()
@@ -187,18 +199,42 @@ public:
 	 *
 	 * Если атрибута нет, то ничего не делать - это не ошибка
 	 */
-	void removeAttribute(const std::string &name) { tag->attr.erase(name); }
+	void removeAttribute(const std::string &name) { tag->removeAttribute(name.c_str()); }
 	
 	/**
 	 * Сериализовать тег в строку
 	 */
 	std::string serialize() const { return tag->serialize(); }
 	
+	/**
+	 * Вернуть точный размер сериализованного тега
+	 */
+	size_t serializedSize() const { return tag->serializedSize(); }
+	
+	/**
+	 * Сериализовать тег в буфер размером не меньше serializedSize()
+	 *
+	 * @return указатель на конец записанных данных
+	 */
+	char* serialize(char *buf) const { return tag->serialize(buf); }
+	
+	/**
+	 * Сериализовать тег в цепочку блоков размером не меньше serializedSize()
+	 */
+	void serialize(nano_block_t *blocks) const { tag->serialize(blocks); }
+	
 	/**
 	 * Сериализовать тег в строку
 	 */
 	std::string cdata() const { return tag->cdata(); }
 	
+	/**
+	 * Дописать CDATA в строку
+	 *
+	 * Соединяет все секции CDATA без промежуточных строк
+	 */
+	void cdata(std::string &out) const { tag->cdata(out); }
+	
 	/**
 	 * Сбросить всех потомков
 	 */
@@ -209,11 +245,22 @@ public:
 	 */
 	EasyTag createTag(const std::string &name, const EasyRow &atts);
 	
+	/**
+	 * Создать дочений тег с интернированным именем и атрибутами в формате
+	 * expat (имя, значение, ..., NULL) и вернуть ссылку на него
+	 */
+	EasyTag createTag(const Atom &name, const char **atts);
+	
 	/**
 	 * Создать дочений текстовый блок и вернуть ссылку на него
 	 */
 	void createText(const std::string &text);
 	
+	/**
+	 * Создать дочений текстовый блок из буфера
+	 */
+	void createText(const char *text, size_t len) { tag->append(text, len); }
+	
 	/**
 	 * Добавить тег/дерево дочерним элементом
 	 */
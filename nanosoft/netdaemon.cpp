@@ -2,13 +2,21 @@
 #include <nanosoft/logger.h>
 #include <nanosoft/utils.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <new>
+#include <typeinfo>
 
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 
 void my_gnutls_log_func( int level, const char *message)
@@ -16,26 +24,86 @@ void my_gnutls_log_func( int level, const char *message)
 	printf("gnutls: level=%d %s", level, message);
 }
 
+/**
+* Монотонное время в микросекундах
+*/
+static inline int64_t monotime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+/**
+* Максимальная глубина стека, снимаемого сторожем
+*/
+#define WATCHDOG_FRAMES 32
+
+/**
+* Стек вызовов, снятый сторожем по SIGALRM
+*/
+static void *watchdog_frames[WATCHDOG_FRAMES];
+
+/**
+* Глубина снятого стека, 0 - стек не снимался
+*/
+static volatile sig_atomic_t watchdog_depth = 0;
+
+/**
+* Обработчик SIGALRM сторожа: обработчик события не уложился в порог
+*/
+static void watchdogSignal(int)
+{
+	watchdog_depth = backtrace(watchdog_frames, WATCHDOG_FRAMES);
+}
+
+/**
+* Верхняя граница интервала гистограммы, в который попадает заданная доля
+* обработчиков
+*
+* @param hist гистограмма
+* @param percent доля в процентах
+* @return граница в микросекундах
+*/
+static uint64_t histPercentile(const uint64_t *hist, int percent)
+{
+	uint64_t total = 0;
+	for(int i = 0; i < NetDaemon::STATS_BUCKETS; i++) total += hist[i];
+	if ( total == 0 ) return 0;
+	
+	uint64_t need = (total * percent + 99) / 100;
+	uint64_t sum = 0;
+	for(int i = 0; i < NetDaemon::STATS_BUCKETS; i++)
+	{
+		sum += hist[i];
+		if ( sum >= need ) return (uint64_t) 1 << i;
+	}
+	return (uint64_t) 1 << (NetDaemon::STATS_BUCKETS - 1);
+}
+
 /**
 * Конструктор демона
 * @param fd_limit максимальное число одновременных виртуальных потоков
 * @param buf_size размер файлового буфера в блоках
 */
-NetDaemon::NetDaemon(int fd_limit, int buf_size): sleep_time(200), timerCount(0), gtimer(0), count(0), active(0) {
+NetDaemon::NetDaemon(int fd_limit, int buf_size): sleep_time(200), timerCount(0), gtimer(0), count(0), active(0), active_weight(0), free_segments(0) {
 	limit = fd_limit;
-	epoll = epoll_create(fd_limit);
+	epoll = epoll_create(fd_limit > 0 ? fd_limit : 1);
 	
-	fds = new fd_info_t[fd_limit];
-	fd_info_t *fb, *fd_end = fds + fd_limit;
-	for(fb = fds; fb < fd_end; fb++)
-	{
-		fb->obj = 0;
-		fb->size = 0;
-		fb->offset = 0;
-		fb->quota = 0;
-		fb->first = 0;
-		fb->last = 0;
-	}
+	// страницы таблицы дескрипторов выделяются по мере надобности
+	page_count = 0;
+	page_alloc = 0;
+	pages = 0;
+	
+	watchdog_threshold = 0;
+	watchdog_backtrace = false;
+	
+	dispatching = false;
+	
+	output_size = 0;
+	stats_interval = 0;
+	stats_next = 0;
+	resetStats();
 	
 	bp = bp_pool(buf_size);
 	if ( ! bp )
@@ -66,13 +134,123 @@ NetDaemon::~NetDaemon()
 	int r = ::close(epoll);
 	if ( r < 0 ) stderror();
 	
-	delete [] fds;
+	waiters.clear();
+	for(size_t i = 0; i < page_count; i++)
+	{
+		fd_page_t *page = pages[i];
+		if ( page == 0 ) continue;
+		for(size_t j = 0; j < FDTABLE_PAGE_SIZE; j++)
+		{
+			cleanup(i * FDTABLE_PAGE_SIZE + j);
+		}
+		page->~fd_page_t();
+		free(page);
+	}
+	free(pages);
+	
+	while ( free_segments )
+	{
+		fd_segment_t *seg = free_segments;
+		free_segments = seg->next;
+		delete seg;
+	}
 	
 #ifdef HAVE_GNUTLS
 	gnutls_global_deinit();
 #endif // HAVE_GNUTLS
 }
 
+/**
+* Конструктор страницы таблицы дескрипторов
+*/
+NetDaemon::fd_page_t::fd_page_t()
+{
+	memset(output, 0, sizeof(output));
+	memset(generation, 0, sizeof(generation));
+	for(size_t i = 0; i < FDTABLE_PAGE_SIZE; i++)
+	{
+		fd_info_t *p = &info[i];
+		p->size = 0;
+		p->file_size = 0;
+		p->quota = 0;
+		p->weight = FDBUFFER_DEFAULT_WEIGHT;
+		p->waiting = false;
+		p->flush_pending = false;
+		for(int j = 0; j < 2; j++)
+		{
+			p->lanes[j].head = 0;
+			p->lanes[j].tail = 0;
+		}
+	}
+}
+
+/**
+* Найти или создать страницу файлового дескриптора
+*
+* @param fd файловый дескриптор
+* @return страница или NULL если fd < 0 или не хватило памяти
+*/
+NetDaemon::fd_page_t* NetDaemon::getPage(int fd)
+{
+	fd_page_t *page = findPage(fd);
+	if ( page || fd < 0 ) return page;
+	
+	size_t index = fd / FDTABLE_PAGE_SIZE;
+	if ( index >= page_count )
+	{
+		// расширить каталог страниц
+		size_t n = page_count ? page_count : 1;
+		while ( n <= index ) n *= 2;
+		fd_page_t **p = static_cast<fd_page_t **>(realloc(pages, n * sizeof(fd_page_t *)));
+		if ( p == 0 )
+		{
+			logger.unexpected("NetDaemon::getPage(%d): not enough memory", fd);
+			return 0;
+		}
+		for(size_t i = page_count; i < n; i++) p[i] = 0;
+		pages = p;
+		page_count = n;
+	}
+	
+	// страница выравнивается по строке кеша
+	void *mem;
+	if ( posix_memalign(&mem, 64, sizeof(fd_page_t)) != 0 )
+	{
+		logger.unexpected("NetDaemon::getPage(%d): not enough memory", fd);
+		return 0;
+	}
+	
+	page = new (mem) fd_page_t;
+	pages[index] = page;
+	page_alloc++;
+	
+	return page;
+}
+
+/**
+* Отметить появление или опустошение очереди дескриптора
+*
+* @param fd файловый дескриптор
+* @param fb указатель на описание файлового буфера
+* @param busy TRUE - в очереди появились данные, FALSE - очередь опустела
+*/
+void NetDaemon::setOutput(int fd, fd_info_t *fb, bool busy)
+{
+	fd_page_t *page = findPage(fd);
+	int i = fd % FDTABLE_PAGE_SIZE;
+	uint64_t bit = (uint64_t) 1 << (i % 64);
+	if ( busy )
+	{
+		active_weight += fb->weight;
+		page->output[i / 64] |= bit;
+	}
+	else
+	{
+		active_weight -= fb->weight;
+		page->output[i / 64] &= ~bit;
+	}
+}
+
 /**
 * Обработка системной ошибки
 */
@@ -161,15 +339,16 @@ bool NetDaemon::enableObject(ptr<AsyncObject> object)
 	}
 	
 	// проверяем корректность файлового дескриптора
-	if ( object->fd < 0 || object->fd >= limit )
+	if ( object->fd < 0 )
 	{
 		logger.unexpected("NetDaemon::enableObject(): wrong file descriptor");
 		return false;
 	}
 	
-	fd_info_t *fb = &fds[object->fd];
+	if ( getPage(object->fd) == 0 ) return false;
+	ptr<AsyncObject> *slot = findObject(object->fd);
 	
-	if ( fb->obj == 0 )
+	if ( *slot == 0 )
 	{
 		// принудительно выставить O_NONBLOCK
 		int flags = fcntl(object->fd, F_GETFL, 0);
@@ -185,9 +364,9 @@ bool NetDaemon::enableObject(ptr<AsyncObject> object)
 		
 		// добавить в epoll
 		struct epoll_event event;
-		event.data.fd = object->fd;
+		event.data.u64 = getHandle(object->fd);
 		event.events = object->getEventsMask();
-		if ( fb->size > 0 )
+		if ( hasOutput(object->fd) )
 		{
 			event.events |= EPOLLOUT; // TODO fb->size == 0 ?
 			logger.unexpected("NetDaemon::enableObject(%d), fb->size > 0\n", object->fd);
@@ -200,13 +379,13 @@ bool NetDaemon::enableObject(ptr<AsyncObject> object)
 		}
 		else
 		{
-			fb->obj = object;
+			*slot = object;
 			count ++;
 			return true;
 		}
 	}
 	
-	if ( fb->obj == object )
+	if ( *slot == object )
 	{
 		return true;
 	}
@@ -238,21 +417,21 @@ bool NetDaemon::disableObject(ptr<AsyncObject> object)
 	}
 	
 	// проверяем корректность файлового дескриптора
-	if ( object->fd < 0 || object->fd >= limit )
+	if ( object->fd < 0 )
 	{
 		logger.unexpected("NetDaemon::disableObject(): wrong file descriptor");
 		return false;
 	}
 	
-	fd_info_t *fb = &fds[object->fd];
+	ptr<AsyncObject> *slot = findObject(object->fd);
 	
-	if ( fb->obj == 0 )
+	if ( slot == 0 || *slot == 0 )
 	{
 		// объект в epoll не значится
 		return true;
 	}
 	
-	if ( fb->obj != object )
+	if ( *slot != object )
 	{
 		// что-то пошло не так...
 		logger.unexpected("NetDaemon::disableObject(%d), wrong object\n", object->fd);
@@ -267,7 +446,13 @@ bool NetDaemon::disableObject(ptr<AsyncObject> object)
 	}
 	else
 	{
-		fb->obj = 0;
+		// события прежней регистрации, уже полученные из epoll_wait(),
+		// не должны попасть к новому объекту с тем же дескриптором
+		findPage(object->fd)->generation[object->fd % FDTABLE_PAGE_SIZE]++;
+		
+		// диспетчер может ещё обращаться к объекту, см. retired
+		if ( dispatching ) retired.push_back(*slot);
+		*slot = 0;
 		cleanup(object->fd);
 		count--;
 		return true;
@@ -280,19 +465,20 @@ bool NetDaemon::disableObject(ptr<AsyncObject> object)
 bool NetDaemon::modifyObject(ptr<AsyncObject> object)
 {
 	// проверяем корректность файлового дескриптора
-	if ( object->fd < 0 || object->fd >= limit )
+	ptr<AsyncObject> *slot = findObject(object->fd);
+	if ( slot == 0 )
 	{
 		logger.unexpected("NetDaemon::modifyObject(): wrong descriptor/object");
 		return false;
 	}
 	
-	if ( fds[object->fd].obj != object )
+	if ( *slot != object )
 	{
 		fprintf(stderr, "NetDaemon::modifyObject(%d), wrong object\n", object->fd);
 		return false;
 	}
 	
-	return resetObject(object);
+	return resetObject(object.getObject());
 }
 
 /**
@@ -324,12 +510,12 @@ bool NetDaemon::removeObject(ptr<AsyncObject> object)
 /**
 * Возобновить работу с асинхронным объектом
 */
-bool NetDaemon::resetObject(ptr<AsyncObject> &object)
+bool NetDaemon::resetObject(AsyncObject *object)
 {
 	struct epoll_event event;
-	event.data.fd = object->fd;
+	event.data.u64 = getHandle(object->fd);
 	event.events = object->getEventsMask();
-	if ( fds[object->fd].size > 0 ) event.events |= EPOLLOUT;
+	if ( hasOutput(object->fd) ) event.events |= EPOLLOUT;
 	int r = epoll_ctl(epoll, EPOLL_CTL_MOD, object->fd, &event);
 	if ( r == -1 )
 	{
@@ -345,20 +531,71 @@ bool NetDaemon::resetObject(ptr<AsyncObject> &object)
 */
 void NetDaemon::doActiveAction(int wait_time)
 {
-	struct epoll_event event;
-	int r = epoll_wait(epoll, &event, 1, wait_time);
+	dispatching = true;
+	
+	// данные, записанные вне обработчиков (например таймерами)
+	flushTurn();
+	
+	struct epoll_event events[NETDAEMON_EPOLL_EVENTS];
+	int64_t start = monotime();
+	int r = epoll_wait(epoll, events, NETDAEMON_EPOLL_EVENTS, wait_time);
+	int64_t now = monotime();
+	stats.wait_time += now - start;
 	if ( r > 0 )
 	{
-		ptr<AsyncObject> obj = fds[event.data.fd].obj;
-		if ( obj != 0 )
+		stats.wakeups++;
+		stats.events += r;
+		if ( (uint64_t) r > stats.events_max ) stats.events_max = r;
+	}
+	for(int i = 0; i < r; i++)
+	{
+		int fd = static_cast<uint32_t>(events[i].data.u64);
+		uint32_t generation = events[i].data.u64 >> 32;
+		fd_page_t *page = findPage(fd);
+		if ( page == 0 ) continue;
+		
+		// предыдущий обработчик мог удалить объект, а дескриптор уже
+		// занят новым объектом - такое событие устарело
+		int j = fd % FDTABLE_PAGE_SIZE;
+		if ( page->generation[j] != generation )
 		{
-			obj->onEvent(event.events);
-			
-			// если объект ещё в epoll, то сбросить события
-			if ( fds[event.data.fd].obj == obj ) resetObject(obj);
+			stats.stale_events++;
+			continue;
 		}
+		
+		// удаленный в этой пачке объект живет до её конца (см. retired),
+		// поэтому ссылку на каждое событие не захватываем
+		AsyncObject *obj = page->objects[j].getObject();
+		if ( obj == 0 ) continue;
+		
+		// обработчик вызвал stop() - остаток пачки не обрабатываем, а
+		// возвращаем объекты в epoll (EPOLLONESHOT), чтобы их события
+		// не потерялись при следующем запуске
+		if ( ! active )
+		{
+			resetObject(obj);
+			continue;
+		}
+		
+		start = now;
+		watchdogStart();
+		obj->onEvent(events[i].events);
+		
+		// записать то, что обработчик отложил до конца хода
+		flushTurn();
+		
+		watchdogStop();
+		now = monotime();
+		statHandler(now - start);
+		if ( watchdog_threshold && now - start >= watchdog_threshold ) watchdogReport(obj, fd, now - start);
+		
+		// если объект ещё в epoll, то сбросить события
+		if ( page->generation[j] == generation ) resetObject(obj);
 	}
 	if ( r < 0 ) stderror();
+	
+	dispatching = false;
+	retired.clear();
 }
 
 /**
@@ -386,7 +623,16 @@ int NetDaemon::run()
 		if ( curr_ts >= next_ts )
 		{
 			// если пришло время сработать таймеру
+			statTimer((curr_ts - next_ts) * 1000);
 			processTimers(tv);
+			
+			if ( stats_interval > 0 && curr_ts >= stats_next )
+			{
+				dumpStats();
+				resetStats();
+				stats_next = curr_ts + stats_interval * 1000;
+			}
+			
 			gettimeofday(&tv, 0);
 			curr_ts = millitime(tv);
 			wait_ts = sleep_time - curr_ts % sleep_time;
@@ -412,7 +658,7 @@ int NetDaemon::run()
 			wait_ts = sleep_time - curr_ts % sleep_time;
 		}
 	}
-
+	
 	return 0;
 }
 
@@ -447,9 +693,15 @@ bool NetDaemon::callAt(time_t calltime, timer_callback_t callback, void *data)
 void NetDaemon::processTimers(const struct timeval &tv)
 {
 	timer t;
+	int64_t start;
 	if ( gtimer )
 	{
+		start = monotime();
+		watchdogStart();
 		gtimer(tv, gtimer_data);
+		watchdogStop();
+		start = monotime() - start;
+		if ( watchdog_threshold && start >= watchdog_threshold ) watchdogReport("global timer", -1, start);
 	}
 	onProcessTimer();
 	while ( timerCount > 0 )
@@ -459,7 +711,13 @@ void NetDaemon::processTimers(const struct timeval &tv)
 		{
 			timers.pop();
 			timerCount --;
+			statTimer(microtime(tv) - t.expires * 1000000ll);
+			start = monotime();
+			watchdogStart();
 			t.fire(tv);
+			watchdogStop();
+			start = monotime() - start;
+			if ( watchdog_threshold && start >= watchdog_threshold ) watchdogReport("timer", -1, start);
 		}
 		else return;
 	}
@@ -481,7 +739,8 @@ size_t NetDaemon::getFreeSize() const
 */
 size_t NetDaemon::getBufferedSize(int fd)
 {
-	return ( fd >= 0 && fd < limit ) ? fds[fd].size : 0;
+	fd_info_t *fb = findInfo(fd);
+	return fb ? fb->size : 0;
 }
 
 /**
@@ -491,7 +750,8 @@ size_t NetDaemon::getBufferedSize(int fd)
 */
 size_t NetDaemon::getQuota(int fd)
 {
-	return ( fd >= 0 && fd < limit ) ? fds[fd].quota : 0;
+	fd_info_t *fb = findInfo(fd);
+	return fb ? fb->quota : 0;
 }
 
 /**
@@ -502,103 +762,377 @@ size_t NetDaemon::getQuota(int fd)
 */
 bool NetDaemon::setQuota(int fd, size_t quota)
 {
-	if ( fd >= 0 && fd < limit )
+	fd_info_t *fb = getInfo(fd);
+	if ( fb )
 	{
-		fds[fd].quota = quota;
+		fb->quota = quota;
 		return true;
 	}
 	return false;
 }
 
 /**
-* Добавить данные в буфер (thread-unsafe)
-*
-* Если включена компрессия, то сначала сжать данные
-*
+* Вернуть вес файлового дескриптора
+* @param fd файловый дескриптор
+* @return вес дескриптора
+*/
+size_t NetDaemon::getWeight(int fd)
+{
+	fd_info_t *fb = findInfo(fd);
+	return fb ? fb->weight : FDBUFFER_DEFAULT_WEIGHT;
+}
+
+/**
+* Установить вес файлового дескриптора
 * @param fd файловый дескриптор
+* @param weight вес (не меньше 1)
+* @return TRUE вес установлен, FALSE вес не установлен
+*/
+bool NetDaemon::setWeight(int fd, size_t weight)
+{
+	fd_info_t *fb = weight > 0 ? getInfo(fd) : 0;
+	if ( fb )
+	{
+		if ( fb->size > 0 ) active_weight = active_weight - fb->weight + weight;
+		fb->weight = weight;
+		return true;
+	}
+	return false;
+}
+
+/**
+* Проверить справедливую долю дескриптора
+*
 * @param fb указатель на описание файлового буфера
-* @param data указатель на данные
-* @param len размер данных
-* @return TRUE данные приняты, FALSE данные не приняты - нет места
+* @param len размер добавляемых данных
+* @return TRUE данные укладываются в долю, FALSE превышение доли
 */
-bool NetDaemon::put(int fd, fd_info_t *fb, const char *data, size_t len)
+bool NetDaemon::checkFairShare(fd_info_t *fb, size_t len)
 {
-	if ( fb->quota != 0 && (fb->size + len) > fb->quota )
+	// размер данных в блоках пула
+	size_t size = fb->size - fb->file_size;
+	size_t blocks = (size + len + BLOCKSPOOL_BLOCK_SIZE - 1) / BLOCKSPOOL_BLOCK_SIZE;
+	
+	// резерв пула не может занять ни один дескриптор, даже с пустой
+	// очередью, иначе одна большая запись оставит остальных без буфера
+	size_t total = bp->getTotalCount();
+	if ( blocks * 100 > total * (100 - FDBUFFER_FAIR_THRESHOLD) ) return false;
+	
+	size_t free_count = bp->getFreeCount();
+	if ( free_count * 100 >= total * FDBUFFER_FAIR_THRESHOLD )
 	{
-		// превышение квоты
-		return false;
+		// нехватки нет
+		return true;
 	}
 	
-	nano_block_t *block;
+	// одна доля с весом по умолчанию резервируется для дескрипторов,
+	// у которых ещё нет данных в очереди. Пустая очередь ещё не учтена
+	// в active_weight, она претендует на свою долю как активная
+	size_t weight = size == 0 ? active_weight + fb->weight : active_weight;
+	if ( blocks * (weight + FDBUFFER_DEFAULT_WEIGHT) <= total * fb->weight ) return true;
 	
-	if ( fb->size > 0 )
+	// пустой очереди один блок гарантирован, даже если доля меньше блока
+	return size == 0 && blocks <= 1;
+}
+
+/**
+* Поставить дескриптор в очередь ожидания буфера
+*/
+void NetDaemon::waitBuffer(int fd)
+{
+	fd_info_t *fb = findInfo(fd);
+	if ( ! fb->waiting )
 	{
-		// смещение к свободной части последнего блока или 0, если последний
-		// блок заполнен полностью
-		size_t offset = (fb->offset + fb->size) % BLOCKSPOOL_BLOCK_SIZE;
-		
-		// размер свободной части последнего блока
-		size_t rest = offset > 0 ? BLOCKSPOOL_BLOCK_SIZE - offset : 0;
-		
-		// размер недостающей части, которую надо выделить из общего буфера
-		size_t need = len - rest;
+		fb->waiting = true;
+		waiters.push_back(fd);
+	}
+}
+
+/**
+* Разбудить дескрипторы ожидающие освобождения буфера
+*
+* Каждому ожидающему объекту доставляется EPOLLOUT, по которому он может
+* повторить запись
+*/
+void NetDaemon::wakeWaiters()
+{
+	std::vector<int> list;
+	list.swap(waiters);
+	for(size_t i = 0; i < list.size(); i++)
+	{
+		fd_info_t *fb = findInfo(list[i]);
+		if ( ! fb->waiting ) continue;
+		fb->waiting = false;
+		ptr<AsyncObject> *slot = findObject(list[i]);
+		if ( *slot == 0 ) continue;
 		
-		if ( len <= rest ) rest = len;
-		else
+		struct epoll_event event;
+		event.data.u64 = getHandle(list[i]);
+		event.events = (*slot)->getEventsMask() | EPOLLOUT;
+		int r = epoll_ctl(epoll, EPOLL_CTL_MOD, list[i], &event);
+		if ( r == -1 )
 		{
-			// выделить недостающие блоки
-			block = bp->allocBySize(need);
-			if ( block == 0 ) return false;
+			fprintf(stderr, "NetDaemon::wakeWaiters(%d), epoll_ctl(EPOLL_CTL_MOD) fault: %s\n", list[i], strerror(errno));
 		}
+	}
+}
+
+/**
+* Запланировать запись буфера в конце текущего хода цикла
+*
+* @param fd файловый дескриптор
+*/
+void NetDaemon::scheduleFlush(int fd)
+{
+	fd_info_t *fb = findInfo(fd);
+	if ( fb == 0 ) return;
+	
+	if ( ! fb->flush_pending )
+	{
+		fb->flush_pending = true;
+		flush_list.push_back(fd);
+	}
+}
+
+/**
+* Записать данные дескрипторов из очереди отложенной записи
+*/
+void NetDaemon::flushTurn()
+{
+	if ( flush_list.empty() ) return;
+	
+	std::vector<int> list;
+	list.swap(flush_list);
+	for(size_t i = 0; i < list.size(); i++)
+	{
+		fd_info_t *fb = findInfo(list[i]);
+		if ( ! fb->flush_pending ) continue;
+		fb->flush_pending = false;
+		ptr<AsyncObject> *slot = findObject(list[i]);
+		if ( *slot == 0 ) continue;
 		
-		// если последний блок заполнен не полностью, то дописать в него
-		if ( offset > 0 )
+		ptr<AsyncObject> obj = *slot;
+		if ( push(list[i]) )
 		{
-			memcpy(fb->last->data + offset, data, rest);
-			fb->size += rest;
-			data += rest;
-			len -= rest;
-			if ( len == 0 ) return true;
+			// всё записано и EPOLLOUT не будет, объект сам выполняет
+			// то, что обычно делает по EPOLLOUT
+			obj->onFlush();
+		}
+		else
+		{
+			// не удалось записать всё - ждем EPOLLOUT
+			resetObject(obj.getObject());
 		}
-		
-		fb->last->next = block;
-		fb->last = block;
 	}
-	else // fb->size == 0
+}
+
+/**
+* Выделить пустой сегмент
+*/
+NetDaemon::fd_segment_t* NetDaemon::allocSegment()
+{
+	fd_segment_t *seg = free_segments;
+	if ( seg ) free_segments = seg->next;
+	else seg = new fd_segment_t;
+	
+	seg->size = 0;
+	seg->offset = 0;
+	seg->first = 0;
+	seg->last = 0;
+	seg->file_fd = -1;
+	seg->file_offset = 0;
+	seg->started = false;
+	seg->next = 0;
+	return seg;
+}
+
+/**
+* Вернуть сегмент в список свободных вместе с его блоками
+*/
+void NetDaemon::freeSegment(fd_segment_t *seg)
+{
+	if ( seg->first )
 	{
-		block = bp->allocBySize(len);
-		if ( block == 0 )
+		seg->last->next = 0;
+		bp->free(seg->first);
+	}
+	if ( seg->file_fd >= 0 ) ::close(seg->file_fd);
+	seg->next = free_segments;
+	free_segments = seg;
+}
+
+/**
+* Дописать данные в сегмент
+*
+* Недостающие блоки выделяются одним вызовом, поэтому данные либо
+* записываются целиком, либо не записываются вовсе
+*
+* @param seg сегмент
+* @param iov массив фрагментов данных
+* @param iovcnt число фрагментов
+* @param len суммарный размер данных
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool NetDaemon::putInSegment(fd_segment_t *seg, const struct iovec *iov, int iovcnt, size_t len)
+{
+	// смещение к свободной части последнего блока или 0, если последний
+	// блок заполнен полностью или блоков нет
+	size_t offset = (seg->offset + seg->size) % BLOCKSPOOL_BLOCK_SIZE;
+	if ( seg->size == 0 ) offset = 0;
+	
+	// размер свободной части последнего блока
+	size_t rest = offset > 0 ? BLOCKSPOOL_BLOCK_SIZE - offset : 0;
+	
+	nano_block_t *block = 0;
+	if ( len > rest )
+	{
+		// выделить недостающие блоки
+		block = bp->allocBySize(len - rest);
+		if ( block == 0 ) return false;
+	}
+	
+	// блок и позиция в нем, куда пишем
+	nano_block_t *dst;
+	size_t pos;
+	if ( rest > 0 )
+	{
+		dst = seg->last;
+		pos = offset;
+	}
+	else
+	{
+		dst = block;
+		pos = 0;
+	}
+	
+	if ( seg->size == 0 )
+	{
+		seg->first = block;
+		seg->offset = 0;
+	}
+	else if ( block )
+	{
+		seg->last->next = block;
+	}
+	
+	for(int i = 0; i < iovcnt; i++)
+	{
+		const char *data = static_cast<const char *>(iov[i].iov_base);
+		size_t n = iov[i].iov_len;
+		while ( n > 0 )
 		{
-			// нет буфера
-			return false;
+			if ( pos == BLOCKSPOOL_BLOCK_SIZE )
+			{
+				dst = dst->next;
+				pos = 0;
+			}
+			size_t k = BLOCKSPOOL_BLOCK_SIZE - pos;
+			if ( k > n ) k = n;
+			memcpy(dst->data + pos, data, k);
+			pos += k;
+			data += k;
+			n -= k;
 		}
-		
-		fb->first = block;
-		fb->offset = 0;
 	}
 	
-	// записываем полные блоки
-	while ( len >= BLOCKSPOOL_BLOCK_SIZE )
+	seg->last = dst;
+	seg->size += len;
+	return true;
+}
+
+/**
+* Добавить сегмент в конец полосы
+*
+* @param fd файловый дескриптор
+* @param fb указатель на описание файлового буфера
+* @param l полоса
+* @param seg сегмент
+*/
+void NetDaemon::appendSegment(int fd, fd_info_t *fb, fd_lane_t *l, fd_segment_t *seg)
+{
+	if ( l->tail ) l->tail->next = seg;
+	else l->head = seg;
+	l->tail = seg;
+	if ( fb->size == 0 ) setOutput(fd, fb, true);
+	fb->size += seg->size;
+	output_size += seg->size;
+}
+
+/**
+* Добавить данные в буфер (thread-unsafe)
+*
+* Срочная полоса всегда дописывается в свой последний сегмент. Объемная
+* полоса дописывается в последний сегмент только если его запись ещё не
+* начата и он не превысил FDBUFFER_BULK_SEGMENT_SIZE, иначе данные
+* образуют новый сегмент, перед которым срочные данные могут вклиниться
+*
+* @param fd файловый дескриптор
+* @param fb указатель на описание файлового буфера
+* @param iov массив фрагментов данных
+* @param iovcnt число фрагментов
+* @param len суммарный размер данных
+* @param lane полоса
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool NetDaemon::put(int fd, fd_info_t *fb, const struct iovec *iov, int iovcnt, size_t len, int lane)
+{
+	if ( fb->quota != 0 && (fb->size - fb->file_size + len) > fb->quota )
 	{
-		memcpy(block->data, data, BLOCKSPOOL_BLOCK_SIZE);
-		data += BLOCKSPOOL_BLOCK_SIZE;
-		len -= BLOCKSPOOL_BLOCK_SIZE;
-		fb->size += BLOCKSPOOL_BLOCK_SIZE;
-		fb->last = block;
-		block = block->next;
+		// превышение квоты
+		return false;
 	}
 	
-	// если что-то осталось записываем частичный блок
-	if ( len > 0 )
+	if ( ! checkFairShare(fb, len) )
 	{
-		memcpy(block->data, data, len);
+		// превышение справедливой доли
+		return false;
+	}
+	
+	fd_lane_t *l = &fb->lanes[lane == LANE_BULK ? LANE_BULK : LANE_CONTROL];
+	fd_segment_t *seg = l->tail;
+	
+	if ( seg && seg->file_fd < 0 && ( lane != LANE_BULK || (! seg->started && seg->size < FDBUFFER_BULK_SEGMENT_SIZE) ) )
+	{
+		if ( ! putInSegment(seg, iov, iovcnt, len) ) return false;
+		if ( fb->size == 0 ) setOutput(fd, fb, true);
 		fb->size += len;
-		fb->last = block;
+		output_size += len;
+		return true;
 	}
 	
+	seg = allocSegment();
+	if ( ! putInSegment(seg, iov, iovcnt, len) )
+	{
+		freeSegment(seg);
+		return false;
+	}
+	
+	appendSegment(fd, fb, l, seg);
 	return true;
 }
 
+/**
+* Проверить, будут ли данные приняты в буфер
+*
+* @param fd файловый дескриптор
+* @param len размер данных
+* @return TRUE данные будут приняты, FALSE данные не будут приняты
+*/
+bool NetDaemon::canPut(int fd, size_t len)
+{
+	fd_info_t *fb = getInfo(fd);
+	if ( fb == 0 ) return false;
+	
+	if ( fb->quota != 0 && (fb->size - fb->file_size + len) > fb->quota )
+	{
+		return false;
+	}
+	
+	// с запасом на один неполный блок в начале
+	size_t blocks = (len + BLOCKSPOOL_BLOCK_SIZE - 1) / BLOCKSPOOL_BLOCK_SIZE + 1;
+	return checkFairShare(fb, len) && (size_t) bp->getFreeCount() >= blocks;
+}
+
 /**
 * Добавить данные в буфер (thread-safe)
 *
@@ -608,9 +1142,23 @@ bool NetDaemon::put(int fd, fd_info_t *fb, const char *data, size_t len)
 * @return TRUE данные приняты, FALSE данные не приняты - нет места
 */
 bool NetDaemon::put(int fd, const char *data, size_t len)
+{
+	return put(fd, data, len, LANE_CONTROL);
+}
+
+/**
+* Добавить данные в буфер указанной полосы (thread-safe)
+*
+* @param fd файловый дескриптор в который надо записать
+* @param data указатель на данные
+* @param len размер данных
+* @param lane полоса LANE_CONTROL или LANE_BULK
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool NetDaemon::put(int fd, const char *data, size_t len, int lane)
 {
 	// проверяем корректность файлового дескриптора
-	if ( fd < 0 || fd >= limit )
+	if ( fd < 0 )
 	{
 		// плохой дескриптор
 		fprintf(stderr, "StanzaBuffer[%d]: wrong descriptor\n", fd);
@@ -620,8 +1168,165 @@ bool NetDaemon::put(int fd, const char *data, size_t len)
 	// проверяем размер, зачем делать лишние движения если len = 0?
 	if ( len == 0 ) return true;
 	
+	struct iovec iov;
+	iov.iov_base = const_cast<char *>(data);
+	iov.iov_len = len;
+	return put(fd, &iov, 1, lane);
+}
+
+/**
+* Добавить в буфер данные из нескольких фрагментов (thread-safe)
+*
+* @param fd файловый дескриптор в который надо записать
+* @param iov массив фрагментов данных
+* @param iovcnt число фрагментов
+* @param lane полоса LANE_CONTROL или LANE_BULK
+* @return TRUE данные приняты, FALSE данные не приняты - нет места
+*/
+bool NetDaemon::put(int fd, const struct iovec *iov, int iovcnt, int lane)
+{
+	// проверяем корректность файлового дескриптора
+	if ( fd < 0 )
+	{
+		// плохой дескриптор
+		fprintf(stderr, "StanzaBuffer[%d]: wrong descriptor\n", fd);
+		return false;
+	}
+	
+	size_t len = 0;
+	for(int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+	
+	// проверяем размер, зачем делать лишние движения если len = 0?
+	if ( len == 0 ) return true;
+	
 	// находим описание файлового буфера
-	return put(fd, &fds[fd], data, len);
+	fd_info_t *fb = getInfo(fd);
+	if ( fb == 0 ) return false;
+	if ( put(fd, fb, iov, iovcnt, len, lane) ) return true;
+	
+	// данные не приняты, разбудить дескриптор когда освободится буфер
+	waitBuffer(fd);
+	return false;
+}
+
+/**
+* Добавить в буфер готовую цепочку блоков (thread-safe)
+*
+* @param fd файловый дескриптор в который надо записать
+* @param blocks цепочка блоков из пула демона
+* @param len размер данных в цепочке
+* @param lane полоса LANE_CONTROL или LANE_BULK
+* @return TRUE цепочка принята, FALSE цепочка не принята
+*/
+bool NetDaemon::putBlocks(int fd, nano_block_t *blocks, size_t len, int lane)
+{
+	// проверяем корректность файлового дескриптора
+	if ( fd < 0 )
+	{
+		// плохой дескриптор
+		fprintf(stderr, "StanzaBuffer[%d]: wrong descriptor\n", fd);
+		return false;
+	}
+	
+	// проверяем что размер соответствует цепочке
+	size_t count = 0;
+	nano_block_t *last = 0;
+	for(nano_block_t *block = blocks; block; block = block->next)
+	{
+		last = block;
+		count++;
+	}
+	if ( count != (len + BLOCKSPOOL_BLOCK_SIZE - 1) / BLOCKSPOOL_BLOCK_SIZE )
+	{
+		logger.unexpected("NetDaemon::putBlocks(%d): chain of %d blocks does not match size %d", fd, (int)count, (int)len);
+		return false;
+	}
+	
+	if ( len == 0 ) return true;
+	
+	fd_info_t *fb = getInfo(fd);
+	if ( fb == 0 ) return false;
+	if ( fb->quota != 0 && (fb->size - fb->file_size + len) > fb->quota )
+	{
+		// превышение квоты
+		waitBuffer(fd);
+		return false;
+	}
+	
+	// блоки цепочки уже взяты из общего пула, поэтому доля проверяется
+	// так же, как в put()
+	if ( ! checkFairShare(fb, len) )
+	{
+		// превышение справедливой доли
+		waitBuffer(fd);
+		return false;
+	}
+	
+	fd_segment_t *seg = allocSegment();
+	seg->first = blocks;
+	seg->last = last;
+	seg->size = len;
+	appendSegment(fd, fb, &fb->lanes[lane == LANE_BULK ? LANE_BULK : LANE_CONTROL], seg);
+	return true;
+}
+
+/**
+* Добавить в буфер фрагмент файла (thread-safe)
+*
+* @param fd файловый дескриптор в который надо записать
+* @param file_fd дескриптор файла
+* @param offset смещение в файле
+* @param len размер фрагмента
+* @return TRUE фрагмент принят, FALSE фрагмент не принят
+*/
+bool NetDaemon::putFile(int fd, int file_fd, off_t offset, size_t len)
+{
+	// проверяем корректность файлового дескриптора
+	if ( fd < 0 )
+	{
+		// плохой дескриптор
+		fprintf(stderr, "StanzaBuffer[%d]: wrong descriptor\n", fd);
+		return false;
+	}
+	
+	if ( len == 0 ) return true;
+	
+	fd_info_t *fb = getInfo(fd);
+	if ( fb == 0 ) return false;
+	
+	int dup_fd = dup(file_fd);
+	if ( dup_fd < 0 )
+	{
+		stderror();
+		return false;
+	}
+	
+	fd_segment_t *seg = allocSegment();
+	seg->file_fd = dup_fd;
+	seg->file_offset = offset;
+	seg->size = len;
+	appendSegment(fd, fb, &fb->lanes[LANE_BULK], seg);
+	fb->file_size += len;
+	return true;
+}
+
+/**
+* Выбрать полосу для записи
+*
+* Начатый объемный сегмент дописывается до конца, в остальных
+* случаях срочная полоса имеет приоритет над объемной
+*
+* @return полоса или NULL если писать нечего
+*/
+NetDaemon::fd_lane_t* NetDaemon::nextLane(fd_info_t *fb)
+{
+	fd_lane_t *bulk = &fb->lanes[LANE_BULK];
+	if ( bulk->head && bulk->head->started ) return bulk;
+	
+	fd_lane_t *control = &fb->lanes[LANE_CONTROL];
+	if ( control->head ) return control;
+	
+	return bulk->head ? bulk : 0;
 }
 
 /**
@@ -633,7 +1338,7 @@ bool NetDaemon::put(int fd, const char *data, size_t len)
 bool NetDaemon::push(int fd)
 {
 	// проверяем корректность файлового дескриптора
-	if ( fd < 0 || fd >= limit )
+	if ( fd < 0 )
 	{
 		// плохой дескриптор
 		fprintf(stderr, "StanzaBuffer[%d]: wrong descriptor\n", fd);
@@ -641,42 +1346,119 @@ bool NetDaemon::push(int fd)
 	}
 	
 	// находим описание файлового буфера
-	fd_info_t *fb = &fds[fd];
+	fd_info_t *fb = findInfo(fd);
+	
+	// дескриптор ещё ничего не буферизовал
+	if ( fb == 0 ) return true;
 	
 	// список освободившихся блоков
 	nano_block_t *unused = 0;
 	
-	while ( fb->size > 0 )
+	// была ли очередь непустой
+	bool busy = fb->size > 0;
+	
+	fd_lane_t *l;
+	while ( (l = nextLane(fb)) != 0 )
 	{
-		// размер не записанной части блока
-		size_t rest = BLOCKSPOOL_BLOCK_SIZE - fb->offset;
-		if ( rest > fb->size ) rest = fb->size;
+		fd_segment_t *seg = l->head;
+		
+		if ( seg->file_fd >= 0 )
+		{
+			// файловый сегмент отправляем без копирования
+			ssize_t r = sendfile(fd, seg->file_fd, &seg->file_offset, seg->size);
+			if ( r < 0 && errno != EINVAL && errno != ENOSYS ) break;
+			
+			// файл короче заявленного или не поддерживает sendfile(),
+			// остаток сегмента приходится отбросить
+			if ( r <= 0 )
+			{
+				logger.unexpected("NetDaemon::push(%d): sendfile() fault: %s", fd, r < 0 ? strerror(errno) : "unexpected end of file");
+				r = seg->size;
+			}
+			
+			seg->started = true;
+			seg->size -= r;
+			fb->size -= r;
+			output_size -= r;
+			fb->file_size -= r;
+			
+			if ( seg->size > 0 ) break;
+			
+			l->head = seg->next;
+			if ( l->head == 0 ) l->tail = 0;
+			freeSegment(seg);
+			continue;
+		}
+		
+		// собрать не записанные части блоков сегмента для одного writev()
+		struct iovec iov[FDBUFFER_WRITEV_BLOCKS];
+		int count = 0;
+		size_t total = 0;
+		size_t offset = seg->offset;
+		for(nano_block_t *block = seg->first; total < seg->size && count < FDBUFFER_WRITEV_BLOCKS; block = block->next)
+		{
+			size_t rest = BLOCKSPOOL_BLOCK_SIZE - offset;
+			if ( rest > seg->size - total ) rest = seg->size - total;
+			iov[count].iov_base = block->data + offset;
+			iov[count].iov_len = rest;
+			count++;
+			total += rest;
+			offset = 0;
+		}
 		
 		// попробовать записать
-		ssize_t r = write(fd, fb->first->data + fb->offset, rest);
+		ssize_t r = writev(fd, iov, count);
 		if ( r <= 0 ) break;
 		
+		seg->started = true;
 		fb->size -= r;
-		fb->offset += r;
+		output_size -= r;
 		
-		// если блок записан полностью,
-		if ( r == rest )
+		// освободить полностью записанные блоки
+		size_t done = r;
+		while ( done > 0 )
 		{
-			// добавить его в список освободившихся
-			nano_block_t *block = fb->first;
-			fb->first = block->next;
-			fb->offset = 0;
+			// размер не записанной части блока
+			size_t rest = BLOCKSPOOL_BLOCK_SIZE - seg->offset;
+			if ( rest > seg->size ) rest = seg->size;
+			
+			if ( done < rest )
+			{
+				seg->offset += done;
+				seg->size -= done;
+				break;
+			}
+			
+			// блок записан полностью, добавить его в список освободившихся
+			nano_block_t *block = seg->first;
+			seg->first = block->next;
+			seg->offset = 0;
+			seg->size -= rest;
+			done -= rest;
 			block->next = unused;
 			unused = block;
 		}
-		else
+		
+		// если сегмент записан полностью, то убрать его из полосы
+		if ( seg->size == 0 )
 		{
-			// иначе пора прерваться и вернуться в epoll
-			break;
+			l->head = seg->next;
+			if ( l->head == 0 ) l->tail = 0;
+			seg->first = 0;
+			freeSegment(seg);
 		}
+		
+		// если записали не всё, то пора прерваться и вернуться в epoll
+		if ( (size_t) r < total ) break;
 	}
 	
-	bp->free(unused);
+	if ( busy && fb->size == 0 ) setOutput(fd, fb, false);
+	
+	if ( unused )
+	{
+		bp->free(unused);
+		if ( ! waiters.empty() ) wakeWaiters();
+	}
 	
 	return fb->size <= 0;
 }
@@ -689,18 +1471,235 @@ bool NetDaemon::push(int fd)
 void NetDaemon::cleanup(int fd)
 {
 	// проверяем корректность файлового дескриптора
-	if ( fd < 0 || fd >= limit )
+	if ( fd < 0 )
 	{
 		// плохой дескриптор
 		fprintf(stderr, "StanzaBuffer[%d]: wrong descriptor\n", fd);
 		return;
 	}
 	
-	fd_info_t *p = &fds[fd];
-	free(p->first);
+	fd_info_t *p = findInfo(fd);
+	if ( p == 0 ) return;
+	if ( p->size > 0 ) setOutput(fd, p, false);
+	for(int i = 0; i < 2; i++)
+	{
+		fd_lane_t *l = &p->lanes[i];
+		while ( l->head )
+		{
+			fd_segment_t *seg = l->head;
+			l->head = seg->next;
+			freeSegment(seg);
+		}
+		l->tail = 0;
+	}
+	output_size -= p->size;
 	p->size = 0;
-	p->offset = 0;
+	p->file_size = 0;
 	p->quota = 0;
-	p->first = 0;
-	p->last = 0;
+	p->weight = FDBUFFER_DEFAULT_WEIGHT;
+	p->waiting = false;
+	p->flush_pending = false;
+	
+	if ( ! waiters.empty() ) wakeWaiters();
+}
+
+/**
+* Учесть время обработчика события в метриках
+*
+* @param time время обработчика в микросекундах
+*/
+void NetDaemon::statHandler(uint64_t time)
+{
+	stats.handler_time += time;
+	if ( time > stats.handler_max ) stats.handler_max = time;
+	
+	int bucket = 0;
+	while ( bucket < STATS_BUCKETS - 1 && ((uint64_t) 1 << bucket) <= time ) bucket++;
+	stats.handler_hist[bucket]++;
+}
+
+/**
+* Учесть опоздание таймера в метриках
+*
+* @param lag опоздание в микросекундах
+*/
+void NetDaemon::statTimer(int64_t lag)
+{
+	if ( lag < 0 ) lag = 0;
+	stats.timers++;
+	stats.timer_lag += lag;
+	if ( (uint64_t) lag > stats.timer_lag_max ) stats.timer_lag_max = lag;
+}
+
+/**
+* Получить снимок метрик цикла событий
+*
+* Счетчики копируются как есть, текущие значения (очереди, пул, таблица
+* дескрипторов) заполняются в момент вызова
+*
+* @param st куда записать метрики
+*/
+void NetDaemon::getStats(stats_t &st) const
+{
+	st = stats;
+	st.output_size = output_size;
+	st.pool_busy = bp ? bp->getBusyCount() : 0;
+	st.pool_total = bp ? bp->getTotalCount() : 0;
+	st.objects = count;
+	st.table_size = getTableSize();
+}
+
+/**
+* Сбросить накопленные метрики
+*/
+void NetDaemon::resetStats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+/**
+* Записать метрики в лог
+*/
+void NetDaemon::dumpStats()
+{
+	stats_t st;
+	getStats(st);
+	
+	uint64_t total = st.wait_time + st.handler_time;
+	logger.information("NetDaemon stats: busy %d%%, wait %lldms, handlers %lldms, "
+		"events %lld (%.1f per wakeup, max %lld, stale %lld), "
+		"handler p50 <%lldus p99 <%lldus max %lldus, "
+		"timers %lld (avg lag %lldus, max %lldus), "
+		"output %lld bytes, pool %d/%d blocks, objects %d, table %d",
+		(int) (total ? st.handler_time * 100 / total : 0),
+		(long long) (st.wait_time / 1000), (long long) (st.handler_time / 1000),
+		(long long) st.events, st.wakeups ? (double) st.events / st.wakeups : 0.0,
+		(long long) st.events_max, (long long) st.stale_events,
+		(long long) histPercentile(st.handler_hist, 50), (long long) histPercentile(st.handler_hist, 99),
+		(long long) st.handler_max,
+		(long long) st.timers, (long long) (st.timers ? st.timer_lag / st.timers : 0), (long long) st.timer_lag_max,
+		(long long) st.output_size, (int) st.pool_busy, (int) st.pool_total,
+		(int) st.objects, (int) st.table_size);
+}
+
+/**
+* Установить период записи метрик в лог
+*
+* @param interval период в секундах, 0 - не записывать
+*/
+void NetDaemon::setStatsInterval(int interval)
+{
+	stats_interval = interval;
+	stats_next = millitime() + interval * 1000ll;
+}
+
+/**
+* Включить сторож медленных обработчиков
+*
+* @param threshold порог в миллисекундах, 0 - выключить сторож
+* @param backtrace снимать ли стек вызовов медленного обработчика
+*/
+void NetDaemon::setWatchdog(int threshold, bool backtrace)
+{
+	watchdog_threshold = threshold > 0 ? threshold * 1000ll : 0;
+	bool sample = watchdog_threshold && backtrace;
+	if ( sample == watchdog_backtrace ) return;
+	
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	if ( sample )
+	{
+		// первый вызов backtrace() может выделять память,
+		// делаем его заранее, а не в обработчике сигнала
+		void *frame;
+		::backtrace(&frame, 1);
+		sa.sa_handler = watchdogSignal;
+		sa.sa_flags = SA_RESTART;
+	}
+	else
+	{
+		struct itimerval it;
+		memset(&it, 0, sizeof(it));
+		setitimer(ITIMER_REAL, &it, 0);
+		sa.sa_handler = SIG_DFL;
+	}
+	if ( sigaction(SIGALRM, &sa, 0) != 0 )
+	{
+		stderror();
+		return;
+	}
+	watchdog_backtrace = sample;
+}
+
+/**
+* Взвести сторож перед вызовом обработчика
+*
+* Если снятие стека не включено, то ничего не делает
+*/
+void NetDaemon::watchdogStart()
+{
+	if ( ! watchdog_backtrace ) return;
+	
+	watchdog_depth = 0;
+	struct itimerval it;
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = watchdog_threshold / 1000000;
+	it.it_value.tv_usec = watchdog_threshold % 1000000;
+	setitimer(ITIMER_REAL, &it, 0);
+}
+
+/**
+* Снять сторож после завершения обработчика
+*/
+void NetDaemon::watchdogStop()
+{
+	if ( ! watchdog_backtrace ) return;
+	
+	struct itimerval it;
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_REAL, &it, 0);
+}
+
+/**
+* Записать в лог медленный обработчик события объекта
+*
+* @param object объект
+* @param fd файловый дескриптор
+* @param time время обработчика в микросекундах
+*/
+void NetDaemon::watchdogReport(AsyncObject *object, int fd, int64_t time)
+{
+	int status;
+	const char *mangled = typeid(*object).name();
+	char *name = abi::__cxa_demangle(mangled, 0, 0, &status);
+	watchdogReport(name ? name : mangled, fd, time);
+	free(name);
+}
+
+/**
+* Записать в лог медленный обработчик
+*
+* Вместе с именем, дескриптором и временем пишет стек вызовов, если он
+* был снят по сигналу сторожа
+*
+* @param name имя обработчика (тип объекта или таймер)
+* @param fd файловый дескриптор объекта или -1
+* @param time время обработчика в микросекундах
+*/
+void NetDaemon::watchdogReport(const char *name, int fd, int64_t time)
+{
+	logger.warning("NetDaemon: slow handler %s, fd %d, %lldus", name, fd, (long long) time);
+	
+	int depth = watchdog_depth;
+	watchdog_depth = 0;
+	if ( depth > 0 )
+	{
+		char **symbols = backtrace_symbols(watchdog_frames, depth);
+		if ( symbols )
+		{
+			for(int i = 0; i < depth; i++) logger.warning("  #%d %s", i, symbols[i]);
+			free(symbols);
+		}
+	}
 }
@@ -8,6 +8,9 @@
 #include <nanosoft/processmanager.h>
 
 #include <queue>
+#include <vector>
+
+#include <sys/uio.h>
 
 #ifdef HAVE_GNUTLS
 #include <gnutls/gnutls.h>
@@ -23,8 +26,105 @@ typedef void (*timer_callback_t) (const timeval &tv, void *data);
 */
 class NetDaemon: public ProcessManager
 {
-private:
+public:
+	/**
+	* Число интервалов гистограммы времени обработчиков
+	*
+	* Интервал 0 - меньше 1мкс, интервал k - от 2^(k-1) до 2^k мкс,
+	* последний интервал включает всё что больше
+	*/
+	enum { STATS_BUCKETS = 24 };
+	
+	/**
+	* Метрики цикла событий
+	*
+	* Счетчики накапливаются с момента создания демона или последнего
+	* вызова resetStats(), время указано в микросекундах
+	*/
+	struct stats_t
+	{
+		/**
+		* Время проведенное в epoll_wait()
+		*/
+		uint64_t wait_time;
+		
+		/**
+		* Время проведенное в обработчиках событий (включая отложенную запись)
+		*/
+		uint64_t handler_time;
+		
+		/**
+		* Максимальное время одного обработчика
+		*/
+		uint64_t handler_max;
+		
+		/**
+		* Гистограмма времени обработчиков
+		*/
+		uint64_t handler_hist[STATS_BUCKETS];
+		
+		/**
+		* Число возвратов из epoll_wait() с событиями
+		*/
+		uint64_t wakeups;
+		
+		/**
+		* Число доставленных событий
+		*/
+		uint64_t events;
+		
+		/**
+		* Число отброшенных устаревших событий
+		*/
+		uint64_t stale_events;
+		
+		/**
+		* Максимальное число событий за одно пробуждение
+		*/
+		uint64_t events_max;
+		
+		/**
+		* Число сработавших таймеров (включая периодический)
+		*/
+		uint64_t timers;
+		
+		/**
+		* Суммарное опоздание таймеров относительно назначенного времени
+		*/
+		uint64_t timer_lag;
+		
+		/**
+		* Максимальное опоздание таймера
+		*/
+		uint64_t timer_lag_max;
+		
+		/**
+		* Объем данных в очередях на запись (в байтах)
+		*/
+		size_t output_size;
+		
+		/**
+		* Число занятых блоков пула
+		*/
+		size_t pool_busy;
+		
+		/**
+		* Общее число блоков пула
+		*/
+		size_t pool_total;
+		
+		/**
+		* Число подконтрольных объектов
+		*/
+		size_t objects;
+		
+		/**
+		* Число записей в таблице дескрипторов
+		*/
+		size_t table_size;
+	};
 	
+private:
 	/**
 	* Файловый дескриптор epoll
 	*/
@@ -110,7 +210,7 @@ private:
 	void *gtimer_data;
 	
 	/**
-	* Максимальное число обслуживаемых объектов
+	* Ожидаемое число обслуживаемых объектов (подсказка для epoll_create)
 	*/
 	size_t limit;
 	
@@ -130,24 +230,162 @@ private:
 	int timerCount;
 	
 	/**
-	* Структура описывающая файловый дескриптор
+	* Накопленные метрики цикла событий
 	*/
-	struct fd_info_t
+	stats_t stats;
+	
+	/**
+	* Суммарный объем данных в очередях на запись (в байтах)
+	*/
+	size_t output_size;
+	
+	/**
+	* Период записи метрик в лог (в секундах), 0 - не записывать
+	*/
+	int stats_interval;
+	
+	/**
+	* Время следующей записи метрик в лог (в миллисекундах)
+	*/
+	int64_t stats_next;
+	
+	/**
+	* Учесть время обработчика события в метриках
+	*/
+	void statHandler(uint64_t time);
+	
+	/**
+	* Учесть опоздание таймера в метриках
+	*/
+	void statTimer(int64_t lag);
+	
+	/**
+	* Порог медленного обработчика (в микросекундах), 0 - сторож выключен
+	*/
+	int64_t watchdog_threshold;
+	
+	/**
+	* Снимать ли стек вызовов медленного обработчика
+	*/
+	bool watchdog_backtrace;
+	
+	/**
+	* Взвести сторож перед вызовом обработчика
+	*/
+	void watchdogStart();
+	
+	/**
+	* Снять сторож после завершения обработчика
+	*/
+	void watchdogStop();
+	
+	/**
+	* Записать в лог медленный обработчик
+	*
+	* @param name имя обработчика (тип объекта или таймер)
+	* @param fd файловый дескриптор объекта или -1
+	* @param time время обработчика в микросекундах
+	*/
+	void watchdogReport(const char *name, int fd, int64_t time);
+	
+	/**
+	* Записать в лог медленный обработчик события объекта
+	*/
+	void watchdogReport(AsyncObject *object, int fd, int64_t time);
+	
+	/**
+	* Сегмент очереди исходящих данных
+	*
+	* Сегмент - это непрерывная цепочка блоков, которая записывается в
+	* файл/сокет целиком, прежде чем очередь может переключиться на другую
+	* полосу. Границы сегментов - это границы сообщений, на которых
+	* срочные данные могут обогнать объемные
+	*/
+	struct fd_segment_t
 	{
 		/**
-		* Указатель на объект
+		* Размер не записанных данных сегмента (в байтах)
 		*/
-		ptr<AsyncObject> obj;
+		size_t size;
 		
 		/**
-		* Размер буферизованных данных (в байтах)
+		* Смещение в первом блоке к началу не записанных данных
+		*/
+		size_t offset;
+		
+		/**
+		* Указатель на первый блок данных
+		*/
+		nano_block_t *first;
+		
+		/**
+		* Указатель на последний блок данных
+		*/
+		nano_block_t *last;
+		
+		/**
+		* Файл, данные которого отправляет сегмент, или -1 если сегмент
+		* состоит из блоков памяти
+		*
+		* Файловый сегмент владеет дескриптором (копией от dup) и закрывает
+		* его при освобождении
+		*/
+		int file_fd;
+		
+		/**
+		* Смещение в файле к началу не записанных данных
+		*/
+		off_t file_offset;
+		
+		/**
+		* Запись сегмента уже начата
+		*
+		* Начатый сегмент нельзя ни дополнять, ни прерывать другой полосой
+		*/
+		bool started;
+		
+		/**
+		* Следующий сегмент полосы
+		*/
+		fd_segment_t *next;
+	};
+	
+	/**
+	* Полоса (очередь сегментов) исходящих данных
+	*/
+	struct fd_lane_t
+	{
+		/**
+		* Первый сегмент полосы
+		*/
+		fd_segment_t *head;
+		
+		/**
+		* Последний сегмент полосы
+		*/
+		fd_segment_t *tail;
+	};
+	
+	/**
+	* Состояние исходящего буфера файлового дескриптора
+	*
+	* Холодные данные: нужны только при записи, объект дескриптора хранится
+	* отдельно в fd_page_t::objects
+	*/
+	struct fd_info_t
+	{
+		/**
+		* Размер буферизованных данных во всех полосах (в байтах)
 		*/
 		size_t size;
 		
 		/**
-		* Смещение в блоке к началу не записанных данных
+		* Размер данных в файловых сегментах (в байтах)
+		*
+		* Входит в size, но не занимает блоков пула, поэтому не учитывается
+		* в квоте и справедливой доле
 		*/
-		size_t offset;
+		size_t file_size;
 		
 		/**
 		* Размер квоты для файлового дескриптора (в байтах)
@@ -155,16 +393,103 @@ private:
 		size_t quota;
 		
 		/**
-		* Указатель на первый блок данных
+		* Полосы исходящих данных
 		*/
-		nano_block_t *first;
+		fd_lane_t lanes[2];
 		
 		/**
-		* Указатель на последний блок данных
+		* Вес дескриптора при справедливом разделении буфера
 		*/
-		nano_block_t *last;
+		size_t weight;
+		
+		/**
+		* Дескриптор ждет освобождения буфера
+		*
+		* Выставляется когда put() не смог принять данные, при освобождении
+		* блоков объекту будет доставлено событие EPOLLOUT
+		*/
+		bool waiting;
+		
+		/**
+		* Дескриптор стоит в очереди отложенной записи
+		*/
+		bool flush_pending;
+	};
+	
+	/**
+	* Страница таблицы файловых дескрипторов
+	*
+	* Хранит данные в виде структуры массивов: диспетчеризация события
+	* читает только плотный массив объектов и битовую карту непустых
+	* очередей, не затрагивая состояния буферов
+	*/
+	struct fd_page_t
+	{
+		/**
+		* Объекты дескрипторов
+		*/
+		ptr<AsyncObject> objects[FDTABLE_PAGE_SIZE];
+		
+		/**
+		* Поколения регистраций дескрипторов
+		*
+		* Увеличивается при отключении объекта от epoll, вместе с номером
+		* дескриптора передается в epoll_event.data и позволяет отличить
+		* устаревшие события после переиспользования дескриптора
+		*/
+		uint32_t generation[FDTABLE_PAGE_SIZE];
+		
+		/**
+		* Битовая карта дескрипторов с непустой очередью
+		*/
+		uint64_t output[(FDTABLE_PAGE_SIZE + 63) / 64];
+		
+		/**
+		* Состояние буферов дескрипторов
+		*/
+		fd_info_t info[FDTABLE_PAGE_SIZE];
+		
+		/**
+		* Конструктор
+		*/
+		fd_page_t();
 	};
 	
+	/**
+	* Суммарный вес дескрипторов с непустой очередью
+	*/
+	size_t active_weight;
+	
+	/**
+	* Дескрипторы ожидающие освобождения буфера
+	*/
+	std::vector<int> waiters;
+	
+	/**
+	* Дескрипторы, данные которых надо записать в конце текущего хода
+	*/
+	std::vector<int> flush_list;
+	
+	/**
+	* Объекты, удаленные во время разбора пачки событий
+	*
+	* Диспетчер вызывает обработчики по указателю из таблицы, не захватывая
+	* ссылку на каждое событие. Обработчик может удалить свой или соседний
+	* объект, поэтому ссылка таблицы на удаленный объект освобождается
+	* только в конце пачки
+	*/
+	std::vector< ptr<AsyncObject> > retired;
+	
+	/**
+	* TRUE - идет разбор пачки событий (см. retired)
+	*/
+	bool dispatching;
+	
+	/**
+	* Список свободных (переиспользуемых) сегментов
+	*/
+	fd_segment_t *free_segments;
+	
 	/**
 	 * Пул блоков
 	 */
@@ -173,10 +498,95 @@ private:
 	/**
 	* Таблица файловых дескрипторов
 	*
-	* хранит указатели на первый блок данных дескриптора или NULL
-	* если нет буферизованных данных
+	* хранит объект дескриптора и его очереди исходящих данных, разбита на
+	* страницы по FDTABLE_PAGE_SIZE записей, которые выделяются при первом
+	* обращении к дескриптору из страницы
+	*/
+	fd_page_t **pages;
+	
+	/**
+	* Размер каталога страниц
+	*/
+	size_t page_count;
+	
+	/**
+	* Число выделенных страниц
+	*/
+	size_t page_alloc;
+	
+	/**
+	* Найти страницу файлового дескриптора
+	* @return страница или NULL если она ещё не выделена
+	*/
+	fd_page_t* findPage(int fd) const
+	{
+		if ( fd < 0 ) return 0;
+		size_t index = fd / FDTABLE_PAGE_SIZE;
+		return index < page_count ? pages[index] : 0;
+	}
+	
+	/**
+	* Найти или создать страницу файлового дескриптора
+	*/
+	fd_page_t* getPage(int fd);
+	
+	/**
+	* Найти объект файлового дескриптора
+	* @return ячейка объекта или NULL если страница ещё не выделена
+	*/
+	ptr<AsyncObject>* findObject(int fd) const
+	{
+		fd_page_t *page = findPage(fd);
+		return page ? &page->objects[fd % FDTABLE_PAGE_SIZE] : 0;
+	}
+	
+	/**
+	* Найти состояние буфера файлового дескриптора
+	* @return описание или NULL если страница ещё не выделена
+	*/
+	fd_info_t* findInfo(int fd) const
+	{
+		fd_page_t *page = findPage(fd);
+		return page ? &page->info[fd % FDTABLE_PAGE_SIZE] : 0;
+	}
+	
+	/**
+	* Найти или создать состояние буфера файлового дескриптора
+	*/
+	fd_info_t* getInfo(int fd)
+	{
+		fd_page_t *page = getPage(fd);
+		return page ? &page->info[fd % FDTABLE_PAGE_SIZE] : 0;
+	}
+	
+	/**
+	* Вернуть идентификатор регистрации дескриптора для epoll_event.data
+	*
+	* Старшие 32 бита - поколение, младшие - номер дескриптора
+	*/
+	uint64_t getHandle(int fd) const
+	{
+		fd_page_t *page = findPage(fd);
+		uint64_t generation = page ? page->generation[fd % FDTABLE_PAGE_SIZE] : 0;
+		return (generation << 32) | static_cast<uint32_t>(fd);
+	}
+	
+	/**
+	* Проверить есть ли у дескриптора данные в очереди
 	*/
-	fd_info_t *fds;
+	bool hasOutput(int fd) const
+	{
+		fd_page_t *page = findPage(fd);
+		int i = fd % FDTABLE_PAGE_SIZE;
+		return page && (page->output[i / 64] & ((uint64_t) 1 << (i % 64)));
+	}
+	
+	/**
+	* Отметить появление или опустошение очереди дескриптора
+	*
+	* Обновляет битовую карту страницы и суммарный вес активных дескрипторов
+	*/
+	void setOutput(int fd, fd_info_t *fb, bool busy);
 	
 	/**
 	* Действие активного цикла
@@ -186,7 +596,7 @@ private:
 	/**
 	* Возобновить работу с асинхронным объектом
 	*/
-	bool resetObject(ptr<AsyncObject> &object);
+	bool resetObject(AsyncObject *object);
 	
 	/**
 	* Установить таймер
@@ -207,11 +617,84 @@ private:
 	*
 	* @param fd файловый дескриптор
 	* @param fb указатель на описание файлового буфера
-	* @param data указатель на данные
-	* @param len размер данных
+	* @param iov массив фрагментов данных
+	* @param iovcnt число фрагментов
+	* @param len суммарный размер данных
+	* @param lane полоса
 	* @return TRUE данные приняты, FALSE данные не приняты - нет места
 	*/
-	bool put(int fd, fd_info_t *fb, const char *data, size_t len);
+	bool put(int fd, fd_info_t *fb, const struct iovec *iov, int iovcnt, size_t len, int lane);
+	
+	/**
+	* Дописать данные в сегмент
+	*
+	* @param seg сегмент
+	* @param iov массив фрагментов данных
+	* @param iovcnt число фрагментов
+	* @param len суммарный размер данных
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool putInSegment(fd_segment_t *seg, const struct iovec *iov, int iovcnt, size_t len);
+	
+	/**
+	* Добавить сегмент в конец полосы
+	*/
+	void appendSegment(int fd, fd_info_t *fb, fd_lane_t *l, fd_segment_t *seg);
+	
+	/**
+	* Проверить справедливую долю дескриптора
+	*
+	* Дескриптор никогда не занимает резерв FDBUFFER_FAIR_THRESHOLD пула.
+	* Пока пул не испытывает нехватки, других ограничений нет. При нехватке
+	* дескриптор может занимать не более weight / active_weight от пула,
+	* причем одна доля резервируется для ещё не активных дескрипторов.
+	* Пустая очередь ограничена той же долей, но один блок принимается
+	* всегда, чтобы никакой дескриптор не остался совсем без буфера
+	*
+	* @param fb указатель на описание файлового буфера
+	* @param len размер добавляемых данных
+	* @return TRUE данные укладываются в долю, FALSE превышение доли
+	*/
+	bool checkFairShare(fd_info_t *fb, size_t len);
+	
+	/**
+	* Поставить дескриптор в очередь ожидания буфера
+	*/
+	void waitBuffer(int fd);
+	
+	/**
+	* Разбудить дескрипторы ожидающие освобождения буфера
+	*/
+	void wakeWaiters();
+	
+	/**
+	* Записать данные дескрипторов из очереди отложенной записи
+	*
+	* Вызывается в конце хода цикла (после обработчика события). EPOLLOUT
+	* взводится только для тех дескрипторов, которые не смогли записать
+	* всё сразу
+	*/
+	void flushTurn();
+	
+	/**
+	* Выделить пустой сегмент
+	*/
+	fd_segment_t* allocSegment();
+	
+	/**
+	* Вернуть сегмент в список свободных вместе с его блоками
+	*/
+	void freeSegment(fd_segment_t *seg);
+	
+	/**
+	* Выбрать полосу для записи
+	*
+	* Начатый объемный сегмент дописывается до конца, в остальных
+	* случаях срочная полоса имеет приоритет над объемной
+	*
+	* @return полоса или NULL если писать нечего
+	*/
+	fd_lane_t* nextLane(fd_info_t *fb);
 	
 	/**
 	* Обработка системной ошибки
@@ -220,6 +703,20 @@ private:
 	
 public:
 	
+	/**
+	* Полосы исходящих данных
+	*
+	* LANE_CONTROL - срочные данные (по умолчанию): управляющие сообщения,
+	* presence, ping и т.п.
+	*
+	* LANE_BULK - объемные данные (передача файлов и т.п.). Объемные данные
+	* уступают срочным на границах сообщений, т.е. между вызовами put()
+	*/
+	enum {
+		LANE_CONTROL = 0,
+		LANE_BULK = 1
+	};
+	
 	/**
 	* Конструктор демона
 	* @param fd_limit максимальное число одновременных виртуальных потоков
@@ -257,10 +754,23 @@ public:
 	int getObjectCount() const;
 	
 	/**
-	* Вернуть максимальное число подконтрольных объектов
+	* Вернуть ожидаемое число подконтрольных объектов
+	*
+	* Значение, переданное в конструктор, используется только как подсказка
+	* для epoll_create(). Таблица дескрипторов растет по мере надобности
 	*/
 	int getObjectLimit() const { return limit; }
 	
+	/**
+	* Вернуть число записей в таблице дескрипторов
+	*/
+	size_t getTableSize() const { return page_alloc * FDTABLE_PAGE_SIZE; }
+	
+	/**
+	* Вернуть объем памяти, занятой таблицей дескрипторов (в байтах)
+	*/
+	size_t getTableMemory() const { return page_alloc * sizeof(fd_page_t) + page_count * sizeof(fd_page_t *); }
+	
 	/**
 	* Вернуть размер буфера в блоках
 	*/
@@ -316,7 +826,9 @@ public:
 	 * Остановить демона
 	 *
 	 * Функция run() возвращает управление, но состояние сохраняется и run()
-	 * может быть запущена снова
+	 * может быть запущена снова. Если stop() вызвана из обработчика, то
+	 * оставшиеся события текущей пачки epoll_wait() не обрабатываются и
+	 * будут доставлены при следующем запуске
 	 */
 	void stop();
 	
@@ -361,6 +873,7 @@ public:
 	{
 		gtimer = reinterpret_cast<timer_callback_t>(callback);
 		gtimer_data = data;
+		return true;
 	}
 	
 	/**
@@ -391,6 +904,39 @@ public:
 	*/
 	bool setQuota(int fd, size_t quota);
 	
+	/**
+	* Вернуть вес файлового дескриптора
+	* @param fd файловый дескриптор
+	* @return вес дескриптора
+	*/
+	size_t getWeight(int fd);
+	
+	/**
+	* Установить вес файлового дескриптора
+	*
+	* При нехватке буфера дескрипторы делят пул пропорционально весам,
+	* так что медленный получатель не может занять весь пул и лишить буфера
+	* остальных. Вес сбрасывается в FDBUFFER_DEFAULT_WEIGHT при cleanup()
+	*
+	* @param fd файловый дескриптор
+	* @param weight вес (не меньше 1)
+	* @return TRUE вес установлен, FALSE вес не установлен
+	*/
+	bool setWeight(int fd, size_t weight);
+	
+	/**
+	* Проверить, будут ли данные приняты в буфер
+	*
+	* Учитывает квоту, справедливую долю и число свободных блоков пула.
+	* Если функция вернула TRUE, то put() того же или меньшего размера
+	* в той же полосе будет принят (пока не было других вызовов put())
+	*
+	* @param fd файловый дескриптор
+	* @param len размер данных
+	* @return TRUE данные будут приняты, FALSE данные не будут приняты
+	*/
+	bool canPut(int fd, size_t len);
+	
 	/**
 	* Добавить данные в буфер (thread-safe)
 	*
@@ -401,6 +947,82 @@ public:
 	*/
 	bool put(int fd, const char *data, size_t len);
 	
+	/**
+	* Добавить данные в буфер указанной полосы (thread-safe)
+	*
+	* Данные одного вызова образуют одно сообщение, которое записывается
+	* целиком, срочные данные не вклиниваются внутрь сообщения
+	*
+	* @param fd файловый дескриптор в который надо записать
+	* @param data указатель на данные
+	* @param len размер данных
+	* @param lane полоса LANE_CONTROL или LANE_BULK
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool put(int fd, const char *data, size_t len, int lane);
+	
+	/**
+	* Добавить в буфер данные из нескольких фрагментов (thread-safe)
+	*
+	* Фрагменты копируются в блоки пула подряд, как одно сообщение, без
+	* предварительной склейки в один буфер. Данные либо принимаются
+	* целиком, либо не принимаются вовсе
+	*
+	* @param fd файловый дескриптор в который надо записать
+	* @param iov массив фрагментов данных
+	* @param iovcnt число фрагментов
+	* @param lane полоса LANE_CONTROL или LANE_BULK
+	* @return TRUE данные приняты, FALSE данные не приняты - нет места
+	*/
+	bool put(int fd, const struct iovec *iov, int iovcnt, int lane);
+	
+	/**
+	* Добавить в буфер готовую цепочку блоков (thread-safe)
+	*
+	* Цепочка добавляется без копирования, как отдельный сегмент. Блоки
+	* должны быть выделены из пула демона (getPool()) и заполнены подряд
+	* с начала первого блока: все блоки кроме последнего полностью.
+	* В случае успеха демон становится владельцем цепочки и сам вернет
+	* блоки в пул, в случае неудачи цепочка остается у вызывающего.
+	* Квота и справедливая доля пула проверяются так же, как в put()
+	*
+	* @param fd файловый дескриптор в который надо записать
+	* @param blocks цепочка блоков
+	* @param len размер данных в цепочке
+	* @param lane полоса LANE_CONTROL или LANE_BULK
+	* @return TRUE цепочка принята, FALSE цепочка не принята
+	*/
+	bool putBlocks(int fd, nano_block_t *blocks, size_t len, int lane);
+	
+	/**
+	* Добавить в буфер фрагмент файла (thread-safe)
+	*
+	* Фрагмент ставится в объемную полосу после уже накопленных данных и
+	* отправляется через sendfile() без копирования в пространство
+	* пользователя и без блоков пула. Дескриптор файла дублируется,
+	* вызывающий может сразу закрыть свой. Если файл окажется короче
+	* заявленного, то остаток фрагмента отбрасывается
+	*
+	* @param fd файловый дескриптор в который надо записать
+	* @param file_fd дескриптор файла (обычного файла, поддерживающего mmap)
+	* @param offset смещение в файле
+	* @param len размер фрагмента
+	* @return TRUE фрагмент принят, FALSE фрагмент не принят
+	*/
+	bool putFile(int fd, int file_fd, off_t offset, size_t len);
+	
+	/**
+	* Запланировать запись буфера в конце текущего хода цикла
+	*
+	* Вместо немедленного взведения EPOLLOUT данные, накопленные за время
+	* обработки события, будут записаны сразу после возврата из
+	* обработчика, одним writev() на сегмент. Если вызвано вне обработчика,
+	* то запись произойдет перед следующим epoll_wait()
+	*
+	* @param fd файловый дескриптор
+	*/
+	void scheduleFlush(int fd);
+	
 	/**
 	* Записать данные из буфера в файл/сокет
 	*
@@ -415,6 +1037,50 @@ public:
 	* @param fd файловый дескриптор
 	*/
 	void cleanup(int fd);
+	
+	/**
+	* Получить снимок метрик цикла событий
+	*/
+	void getStats(stats_t &st) const;
+	
+	/**
+	* Сбросить накопленные метрики
+	*/
+	void resetStats();
+	
+	/**
+	* Записать метрики в лог
+	*/
+	void dumpStats();
+	
+	/**
+	* Установить период записи метрик в лог
+	*
+	* После каждой записи счетчики сбрасываются, т.е. в логе видны
+	* значения за последний период
+	*
+	* @param interval период в секундах, 0 - не записывать
+	*/
+	void setStatsInterval(int interval);
+	
+	/**
+	* Включить сторож медленных обработчиков
+	*
+	* Если обработчик события (onEvent) или таймера работал дольше порога,
+	* в лог пишется тип объекта, дескриптор и время работы. Медленный
+	* обработчик задерживает все остальные соединения демона
+	*
+	* При backtrace = TRUE на время каждого обработчика взводится
+	* ITIMER_REAL, и если обработчик не уложился в порог, по SIGALRM
+	* снимается стек вызовов - место, где обработчик находился в этот момент.
+	* Это стоит двух системных вызовов на событие, занимает SIGALRM и может
+	* прервать блокирующий вызов внутри обработчика (EINTR), поэтому
+	* предназначено для разовой диагностики
+	*
+	* @param threshold порог в миллисекундах, 0 - выключить сторож
+	* @param backtrace снимать ли стек вызовов медленного обработчика
+	*/
+	void setWatchdog(int threshold, bool backtrace = false);
 };
 
 #endif // NANOSOFT_NETDAEMON_H
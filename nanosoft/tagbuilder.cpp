@@ -47,8 +47,14 @@ ATXmlTag *ATTagBuilder::fetchResult() {
 */
 void ATTagBuilder::reset()
 {
+	// незавершенные теги еще не вставлены в родителей, удаляем каждый
+	for(tags_stack_t::iterator it = stack.begin(); it != stack.end(); ++it)
+	{
+		delete *it;
+	}
+	stack.clear();
+	
 	if ( presult ) {
-		stack.clear();
 		delete presult;
 		presult = 0;
 	}
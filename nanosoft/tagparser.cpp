@@ -25,6 +25,27 @@ TagParser::~TagParser()
 {
 }
 
+/**
+* Подготовиться к разбору нового документа
+*/
+void TagParser::begin()
+{
+	reset();
+	depth = 0;
+	error.clear();
+	text.clear();
+}
+
+/**
+* Добавить накопленный текст в текущий тег
+*/
+void TagParser::flushText()
+{
+	if ( text.empty() ) return;
+	cur.createText(text.data(), text.size());
+	text.clear();
+}
+
 /**
 * Парсинг буфера
 *
@@ -32,6 +53,7 @@ TagParser::~TagParser()
 */
 EasyTag TagParser::parse(void *buf, size_t buf_len)
 {
+	begin();
 	if ( parseXML(buf, buf_len, true) )
 	{
 		return tag;
@@ -65,6 +87,7 @@ EasyTag TagParser::parseStream(stream &s)
 	char buf[4096];
 	size_t ret;
 	
+	begin();
 	do
 	{
 		ret = s.read(buf, sizeof(buf));
@@ -85,6 +108,7 @@ EasyTag TagParser::parseStream(stream &s)
 */
 EasyTag TagParser::parseString(const std::string &text)
 {
+	begin();
 	if ( parseXML(text.c_str(), text.length(), true) )
 	{
 		return tag;
@@ -96,35 +120,38 @@ EasyTag TagParser::parseString(const std::string &text)
 /**
 * Обработчик открытия тега
 */
-void TagParser::onStartElement(const std::string &name, const EasyRow &atts)
+void TagParser::onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts)
 {
+	if ( depth > 0 ) flushText();
 	depth ++;
 	if ( depth == 1 )
 	{
-		cur = tag = EasyTag(name, atts);
+		// имена из разбираемого текста не добавляются в таблицу атомов
+		cur = tag = EasyTag(Atom::find(name.data, name.len), atts.atts);
 	}
 	else
 	{
-		cur = cur.createTag(name, atts);
+		cur = cur.createTag(Atom::find(name.data, name.len), atts.atts);
 	}
 }
 
 /**
 * Обработчик символьных данных
 */
-void TagParser::onCharacterData(const std::string &cdata)
+void TagParser::onCharacterDataRaw(const xml_chars_t &cdata)
 {
 	if ( depth > 0 )
 	{
-		cur.createText(cdata);
+		text.append(cdata.data, cdata.len);
 	}
 }
 
 /**
 * Обработчик закрытия тега
 */
-void TagParser::onEndElement(const std::string &name)
+void TagParser::onEndElementRaw(const xml_chars_t &name)
 {
+	flushText();
 	if ( depth == 1 )
 	{
 		// ok
@@ -41,6 +41,14 @@ private:
 	 */
 	EasyTag cur;
 	
+	/**
+	 * Накопленный текст текущего тега
+	 *
+	 * Куски текста от парсера собираются здесь и попадают в дерево
+	 * одним текстовым узлом
+	 */
+	std::string text;
+	
 	/**
 	 * Сообщение об ошибке
 	 */
@@ -56,6 +64,16 @@ private:
 	 */
 	TagParser& operator = (const TagParser &) { return *this; }
 	
+	/**
+	 * Подготовиться к разбору нового документа
+	 */
+	void begin();
+	
+	/**
+	 * Добавить накопленный текст в текущий тег
+	 */
+	void flushText();
+	
 public:
 	
 	/**
@@ -71,6 +89,8 @@ public:
 	/**
 	 * Парсинг буфера
 	 *
+	 * Парсер можно использовать повторно, перед каждым документом
+	 * контекст сбрасывается на месте (см. XMLParser::reset()).
 	 * В случае ошибки возвращается CDATA с сообщением об ошибке
 	 */
 	EasyTag parse(void *buf, size_t buf_len);
@@ -108,17 +128,17 @@ protected:
 	/**
 	 * Обработчик открытия тега
 	 */
-	virtual void onStartElement(const std::string &name, const EasyRow &atts);
+	virtual void onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts);
 	
 	/**
 	 * Обработчик символьных данных
 	 */
-	virtual void onCharacterData(const std::string &cdata);
+	virtual void onCharacterDataRaw(const xml_chars_t &cdata);
 	
 	/**
 	 * Обработчик закрытия тега
 	 */
-	virtual void onEndElement(const std::string &name);
+	virtual void onEndElementRaw(const xml_chars_t &name);
 	
 	/**
 	 * Обработчик ошибок парсера
@@ -4,8 +4,12 @@
 /**
 * Конструктор
 */
-TagStream::TagStream(): depth(0)
+TagStream::TagStream(): depth(0), arena_mode(false)
 {
+	setMaxStanzaSize(XMLSTREAM_MAX_STANZA_SIZE);
+	setMaxDepth(XMLSTREAM_MAX_DEPTH);
+	setMaxAttributes(XMLSTREAM_MAX_ATTRIBUTES);
+	setMaxChildren(XMLSTREAM_MAX_CHILDREN);
 }
 
 /**
@@ -15,41 +19,73 @@ TagStream::~TagStream()
 {
 }
 
+/**
+* Вернуть арену для новой станзы
+*
+* Если предыдущая станза еще кем-то используется, то её арена
+* остается за ней, а для новой станзы создается новая арена
+*/
+EasyArena* TagStream::stanzaArena()
+{
+	if ( ! arena_mode ) return NULL;
+	if ( arena.getObject() == NULL || arena->isBusy() ) arena = new EasyArena();
+	return arena.getObject();
+}
+
+/**
+* Добавить накопленный текст в текущий тег
+*/
+void TagStream::flushText()
+{
+	if ( text.empty() ) return;
+	cur.createText(text.data(), text.size());
+	if ( text.capacity() > TAGSTREAM_TEXT_BUFFER ) std::string().swap(text);
+	else text.clear();
+}
+
 /**
 * Обработчик открытия тега
 */
-void TagStream::onStartElement(const std::string &name, const EasyRow &atts)
+void TagStream::onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts)
 {
+	// текст вне станзы не накапливается, остаток мог остаться только
+	// после сброса парсера посреди станзы
+	if ( depth > 1 ) flushText();
+	else text.clear();
+	
 	depth ++;
 	switch ( depth )
 	{
 	case 1:
-		onStartStream(name, atts);
+		onStartStream(name.str(), atts.toRow());
 		break;
 	case 2: // начало станзы
-		cur = tag = EasyTag(name, atts);
+		// имена из сети не добавляются в таблицу атомов
+		cur = tag = EasyTag(Atom::find(name.data, name.len), atts.atts, stanzaArena());
 		break;
 	default: // добавить тег в станзу
-		cur = cur.createTag(name, atts);
+		cur = cur.createTag(Atom::find(name.data, name.len), atts.atts);
 	}
 }
 
 /**
 * Обработчик символьных данных
 */
-void TagStream::onCharacterData(const std::string &cdata)
+void TagStream::onCharacterDataRaw(const xml_chars_t &cdata)
 {
 	if ( depth > 1 )
 	{
-		cur.createText(cdata);
+		text.append(cdata.data, cdata.len);
 	}
 }
 
 /**
 * Обработчик закрытия тега
 */
-void TagStream::onEndElement(const std::string &name)
+void TagStream::onEndElementRaw(const xml_chars_t &name)
 {
+	if ( depth > 1 ) flushText();
+	
 	switch (depth)
 	{
 	case 1:
@@ -57,6 +93,8 @@ void TagStream::onEndElement(const std::string &name)
 		break;
 	case 2: {
 		onStanza(tag);
+		// отпускаем станзу, чтобы её арена могла быть сброшена
+		cur = tag = idle;
 		break;
 	}
 	default:
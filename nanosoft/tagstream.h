@@ -37,10 +37,49 @@ private:
 	 */
 	EasyTag cur;
 	
+	/**
+	 * Пустой тег, которым заменяется станза после обработки
+	 */
+	EasyTag idle;
+	
+	/**
+	 * Накопленный текст текущего тега
+	 *
+	 * Expat отдает текст кусками (на границах буфера, на сущностях),
+	 * куски собираются здесь и попадают в станзу одним текстовым узлом
+	 */
+	std::string text;
+	
+	/**
+	 * Добавить накопленный текст в текущий тег
+	 */
+	void flushText();
+	
+	/**
+	 * TRUE - размещать станзы в арене
+	 */
+	bool arena_mode;
+	
+	/**
+	 * Арена текущей станзы
+	 */
+	ptr<EasyArena> arena;
+	
+	/**
+	 * Вернуть арену для новой станзы
+	 *
+	 * Если предыдущая станза еще кем-то используется, то её арена
+	 * остается за ней, а для новой станзы создается новая арена
+	 */
+	EasyArena* stanzaArena();
+	
 public:
 	
 	/**
 	 * Конструктор
+	 *
+	 * Ограничения станз берутся из config.h (XMLSTREAM_MAX_*), их можно
+	 * изменить через XMLParser::setMaxStanzaSize() и т.п.
 	 */
 	TagStream();
 	
@@ -49,22 +88,32 @@ public:
 	 */
 	virtual ~TagStream();
 	
+	/**
+	 * Включить/выключить размещение станз в арене
+	 *
+	 * В режиме арены все узлы и текст станзы выделяются из одной арены,
+	 * которая сбрасывается целиком, когда станза больше никому не нужна.
+	 * Ссылка на любой узел станзы удерживает всю арену, поэтому для
+	 * долгого хранения части станзы лучше сделать копию (EasyTag::copy())
+	 */
+	void setArenaMode(bool enable) { arena_mode = enable; }
+	
 protected:
 	
 	/**
 	 * Обработчик открытия тега
 	 */
-	virtual void onStartElement(const std::string &name, const EasyRow &atts);
+	virtual void onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts);
 	
 	/**
 	 * Обработчик символьных данных
 	 */
-	virtual void onCharacterData(const std::string &cdata);
+	virtual void onCharacterDataRaw(const xml_chars_t &cdata);
 	
 	/**
 	 * Обработчик закрытия тега
 	 */
-	virtual void onEndElement(const std::string &name);
+	virtual void onEndElementRaw(const xml_chars_t &name);
 	
 	/**
 	 * Событие: начало потока
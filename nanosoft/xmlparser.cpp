@@ -1,12 +1,48 @@
 
 #include <nanosoft/xmlparser.h>
+#include <nanosoft/xmltokenizer.h>
 
 #include <stdio.h>
 
 /**
 * Конструктор
 */
-XMLParser::XMLParser(): parser(NULL), parsing(false), need_close(false), need_reset(false)
+xml_atts_t::xml_atts_t(const XML_Char **a): atts(a), count(0)
+{
+	while ( atts[count * 2] ) count++;
+}
+
+/**
+* Найти значение атрибута
+* @return значение или NULL если атрибута нет
+*/
+const XML_Char* xml_atts_t::get(const char *name) const
+{
+	for(int i = 0; i < count; i++)
+	{
+		if ( strcmp(atts[i * 2], name) == 0 ) return atts[i * 2 + 1];
+	}
+	return 0;
+}
+
+/**
+* Скопировать атрибуты в EasyRow
+*/
+EasyRow xml_atts_t::toRow() const
+{
+	EasyRow row;
+	for(int i = 0; i < count; i++)
+	{
+		row[ atts[i * 2] ] = atts[i * 2 + 1];
+	}
+	return row;
+}
+
+/**
+* Конструктор
+*/
+XMLParser::XMLParser(): engine(ENGINE_EXPAT), parser(NULL), tokenizer(NULL), parsing(false), need_close(false), need_reset(false),
+	max_stanza_size(0), max_depth(0), max_attributes(0), max_children(0), limit_error(NULL)
 {
 	if ( ! init() )
 	{
@@ -27,14 +63,7 @@ XMLParser::~XMLParser()
 */
 void XMLParser::startElementCallback(void *user_data, const XML_Char *name, const XML_Char **atts)
 {
-	EasyRow attributes;
-	
-	for(int i = 0; atts[i]; i += 2)
-	{
-		attributes[ atts[i] ] = atts[i + 1];
-	}
-	
-	static_cast<XMLParser *>(user_data)->onStartElement(name, attributes);
+	static_cast<XMLParser *>(user_data)->dispatchStartElement(xml_chars_t(name, strlen(name)), xml_atts_t(atts));
 }
 
 /**
@@ -42,7 +71,7 @@ void XMLParser::startElementCallback(void *user_data, const XML_Char *name, cons
 */
 void XMLParser::characterDataCallback(void *user_data, const XML_Char *s, int len)
 {
-	static_cast<XMLParser *>(user_data)->onCharacterData(std::string(s, len));
+	static_cast<XMLParser *>(user_data)->dispatchCharacterData(xml_chars_t(s, len));
 }
 
 /**
@@ -50,7 +79,162 @@ void XMLParser::characterDataCallback(void *user_data, const XML_Char *s, int le
 */
 void XMLParser::endElementCallback(void *user_data, const XML_Char *name)
 {
-	static_cast<XMLParser *>(user_data)->onEndElement(name);
+	static_cast<XMLParser *>(user_data)->dispatchEndElement(xml_chars_t(name, strlen(name)));
+}
+
+/**
+* Сбросить счетчики ограничений
+*/
+void XMLParser::resetLimits()
+{
+	level = 0;
+	stanza_size = 0;
+	unparsed = 0;
+	limit_error = NULL;
+}
+
+/**
+* Прервать парсинг из-за нарушения ограничения
+*
+* Остаток куска отбрасывается, события больше не передаются,
+* parseXML() вернет FALSE и вызовет onParseError(message)
+*/
+void XMLParser::stopByLimit(const char *message)
+{
+	limit_error = message;
+	if ( parser ) XML_StopParser(parser, XML_FALSE);
+}
+
+/**
+* Проверить ограничение числа атрибутов тега
+*
+* Токенизатор вызывает проверку по мере разбора атрибутов, чтобы не
+* разбирать огромный тег целиком ради того, чтобы отвергнуть его
+*/
+bool XMLParser::checkAttributes(int count)
+{
+	if ( max_attributes && count > max_attributes )
+	{
+		stopByLimit("too many attributes");
+		return false;
+	}
+	return true;
+}
+
+/**
+* Открытие тега: проверить ограничения и вызвать onStartElementRaw()
+*/
+void XMLParser::dispatchStartElement(const xml_chars_t &name, const xml_atts_t &atts)
+{
+	// expat может выдать еще пару событий после XML_StopParser()
+	if ( limit_error ) return;
+	
+	unparsed = 0;
+	level++;
+	
+	if ( ! checkAttributes(atts.count) ) return;
+	
+	// корневой тег (поток) не ограничивается, станзы начинаются с level 2
+	if ( level >= 2 )
+	{
+		if ( level == 2 ) stanza_size = 0;
+		
+		if ( max_depth && level - 1 > max_depth )
+		{
+			stopByLimit("stanza is too deep");
+			return;
+		}
+		
+		if ( max_children )
+		{
+			if ( (int) children.size() <= level ) children.resize(level + 1);
+			children[level] = 0;
+			if ( level > 2 && ++children[level - 1] > max_children )
+			{
+				stopByLimit("too many children");
+				return;
+			}
+		}
+		
+		if ( max_stanza_size )
+		{
+			stanza_size += name.len;
+			for(int i = 0; i < atts.count; i++)
+			{
+				stanza_size += strlen(atts.name(i)) + strlen(atts.value(i));
+			}
+			if ( stanza_size > max_stanza_size )
+			{
+				stopByLimit("stanza is too large");
+				return;
+			}
+		}
+	}
+	
+	onStartElementRaw(name, atts);
+}
+
+/**
+* Символьные данные: проверить ограничения и вызвать onCharacterDataRaw()
+*/
+void XMLParser::dispatchCharacterData(const xml_chars_t &cdata)
+{
+	if ( limit_error ) return;
+	
+	unparsed = 0;
+	if ( max_stanza_size && level >= 2 )
+	{
+		stanza_size += cdata.len;
+		if ( stanza_size > max_stanza_size )
+		{
+			stopByLimit("stanza is too large");
+			return;
+		}
+	}
+	
+	onCharacterDataRaw(cdata);
+}
+
+/**
+* Закрытие тега: вызвать onEndElementRaw()
+*/
+void XMLParser::dispatchEndElement(const xml_chars_t &name)
+{
+	if ( limit_error ) return;
+	
+	unparsed = 0;
+	onEndElementRaw(name);
+	level--;
+}
+
+/**
+* Обработчик открытия тега без копирования
+*
+* Адаптер для классов, реализующих onStartElement()
+*/
+void XMLParser::onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts)
+{
+	onStartElement(name.str(), atts.toRow());
+}
+
+/**
+* Обработчик символьных данных без копирования
+*
+* Адаптер для классов, реализующих onCharacterData()
+*/
+void XMLParser::onCharacterDataRaw(const xml_chars_t &cdata)
+{
+	onCharacterData(cdata.str());
+}
+
+/**
+* Обработчик закрытия тега без копирования
+*
+* Адаптер для классов, реализующих onEndElement()
+*/
+void XMLParser::onEndElementRaw(const xml_chars_t &name)
+{
+	onEndElement(name.str());
 }
 
 /**
@@ -63,25 +247,69 @@ bool XMLParser::init()
 {
 	// если мы в обработчике, то парсер инициализирован
 	// если парсер иниализирован, то вернуть FALSE
-	if ( parser ) return false;
+	if ( parser || tokenizer ) return false;
+	
+	resetLimits();
+	
+	if ( engine == ENGINE_NATIVE )
+	{
+		tokenizer = new XMLTokenizer(this);
+		return true;
+	}
 	
 	parser = XML_ParserCreate((XML_Char *) "UTF-8");
 	if ( parser )
 	{
-		XML_SetUserData(parser, (void*) this);
-		XML_SetElementHandler(parser, startElementCallback, endElementCallback);
-		XML_SetCharacterDataHandler(parser, characterDataCallback);
-		XML_SetDefaultHandler(parser, NULL);
+		setHandlers();
 		return true;
 	}
 	
 	return false;
 }
 
+/**
+* Назначить обработчики парсеру expat
+*/
+void XMLParser::setHandlers()
+{
+	XML_SetUserData(parser, (void*) this);
+	XML_SetElementHandler(parser, startElementCallback, endElementCallback);
+	XML_SetCharacterDataHandler(parser, characterDataCallback);
+	XML_SetDefaultHandler(parser, NULL);
+}
+
+/**
+* Сбросить контекст на месте
+*
+* Парсер expat сбрасывается через XML_ParserReset() без освобождения
+* памяти, если контекста нет, то он создается
+*/
+bool XMLParser::restart()
+{
+	resetLimits();
+	
+	if ( tokenizer )
+	{
+		tokenizer->reset();
+		return true;
+	}
+	
+	// XML_ParserReset() сбрасывает и обработчики
+	if ( parser && XML_ParserReset(parser, (XML_Char *) "UTF-8") )
+	{
+		setHandlers();
+		return true;
+	}
+	
+	close();
+	return init();
+}
+
 /**
 * Сброс парсера
 *
-* Закрывает текущий контекст и открывает новый. Можно вызывать из
+* Сбрасывает текущий контекст для разбора нового документа, память
+* парсера при этом используется повторно. Можно вызывать из
 * обработчиков событий, тогда парсинг прерывается и сброс будет
 * осуществлен по выходу из парсинга
 */
@@ -95,8 +323,7 @@ bool XMLParser::reset()
 		return true;
 	}
 	
-	close();
-	return init();
+	return restart();
 }
 
 /**
@@ -119,6 +346,27 @@ void XMLParser::close()
 		XML_ParserFree(parser);
 		parser = NULL;
 	}
+	
+	if ( tokenizer )
+	{
+		delete tokenizer;
+		tokenizer = NULL;
+	}
+}
+
+/**
+* Выбрать движок разбора XML
+*
+* Закрывает текущий контекст и открывает новый на выбранном движке.
+* Нельзя вызывать из обработчиков событий - вернет FALSE
+*/
+bool XMLParser::setEngine(engine_t e)
+{
+	if ( parsing ) return false;
+	
+	engine = e;
+	close();
+	return init();
 }
 
 /**
@@ -132,26 +380,59 @@ void XMLParser::close()
 bool XMLParser::parseXML(const void *data, size_t len, bool isFinal)
 {
 	// если парсер не инициализирован, то вернуть FALSE
-	if ( ! parser ) return false;
+	if ( ! parser && ! tokenizer ) return false;
 	
 	// если парсер вызыван из обработчика (рекурсия), то вернуть FALSE
 	if ( parsing ) return false;
 	
+	// после нарушения ограничения контекст непригоден до сброса
+	if ( limit_error )
+	{
+		onParseError(limit_error);
+		return false;
+	}
+	
+	if ( max_stanza_size ) unparsed += len;
+	
 	parsing = true;
-	int r = XML_Parse(parser, (const char*)data, len, isFinal);
+	bool r;
+	const char *message = 0;
+	if ( tokenizer )
+	{
+		r = tokenizer->parse((const char*)data, len, isFinal);
+		if ( ! r ) message = tokenizer->getErrorString();
+	}
+	else
+	{
+		r = XML_Parse(parser, (const char*)data, len, isFinal) != 0;
+		if ( ! r ) message = XML_ErrorString(XML_GetErrorCode(parser));
+	}
 	parsing = false;
 	
-	if ( need_close )
+	if ( limit_error )
 	{
-		XML_ParserFree(parser);
-		parser = NULL;
+		r = false;
+		message = limit_error;
+	}
+	else if ( max_stanza_size && unparsed > max_stanza_size )
+	{
+		// парсер копит лексему, которая уже больше станзы
+		limit_error = "stanza is too large";
+		r = false;
+		message = limit_error;
 	}
 	
-	if ( need_reset ) return init();
+	if ( need_close )
+	{
+		bool reinit = need_reset;
+		need_close = need_reset = false;
+		if ( reinit ) return restart();
+		close();
+	}
 	
-	if ( !r )
+	if ( ! r )
 	{
-		onParseError( XML_ErrorString(XML_GetErrorCode(parser)) );
+		onParseError(message);
 		return false;
 	}
 	
@@ -4,20 +4,129 @@
 #include <nanosoft/easyrow.h>
 
 #include <expat.h>
+#include <string.h>
 #include <string>
+#include <vector>
+
+class XMLTokenizer;
+
+/**
+ * Строка в буфере парсера
+ *
+ * Не владеет данными, действительна только во время вызова обработчика
+ */
+struct xml_chars_t
+{
+	/**
+	 * Указатель на начало строки
+	 */
+	const XML_Char *data;
+	
+	/**
+	 * Длина строки
+	 */
+	size_t len;
+	
+	xml_chars_t(const XML_Char *s, size_t l): data(s), len(l) { }
+	
+	/**
+	 * Скопировать в std::string
+	 */
+	std::string str() const { return std::string(data, len); }
+	
+	/**
+	 * Сравнить со строкой, завершенной нулем
+	 */
+	bool operator == (const char *s) const { return strncmp(data, s, len) == 0 && s[len] == 0; }
+	
+	bool operator != (const char *s) const { return ! (*this == s); }
+};
+
+/**
+ * Атрибуты тега в буфере парсера
+ *
+ * Обертка над массивом atts expat'а: имена и значения чередуются, строки
+ * завершены нулем. Не владеет данными, действительна только во время
+ * вызова обработчика
+ */
+struct xml_atts_t
+{
+	/**
+	 * Массив expat'а: имя, значение, имя, значение...
+	 */
+	const XML_Char **atts;
+	
+	/**
+	 * Число атрибутов
+	 */
+	int count;
+	
+	xml_atts_t(const XML_Char **a);
+	
+	/**
+	 * Имя i-го атрибута
+	 */
+	const XML_Char* name(int i) const { return atts[i * 2]; }
+	
+	/**
+	 * Значение i-го атрибута
+	 */
+	const XML_Char* value(int i) const { return atts[i * 2 + 1]; }
+	
+	/**
+	 * Найти значение атрибута
+	 * @return значение или NULL если атрибута нет
+	 */
+	const XML_Char* get(const char *name) const;
+	
+	/**
+	 * Скопировать атрибуты в EasyRow
+	 */
+	EasyRow toRow() const;
+};
 
 /**
  * XML парсер
  */
 class XMLParser
 {
+public:
+	
+	/**
+	 * Движок разбора XML
+	 */
+	enum engine_t
+	{
+		/**
+		 * Библиотека expat (по умолчанию)
+		 */
+		ENGINE_EXPAT,
+		
+		/**
+		 * Собственный токенизатор (XMLTokenizer)
+		 */
+		ENGINE_NATIVE
+	};
+	
 private:
 	
+	friend class XMLTokenizer;
+	
+	/**
+	 * Выбранный движок
+	 */
+	engine_t engine;
+	
 	/**
 	 * Парсер expat
 	 */
 	XML_Parser parser;
 	
+	/**
+	 * Собственный токенизатор
+	 */
+	XMLTokenizer *tokenizer;
+	
 	/**
 	 * Признак парсинга
 	 * TRUE - парсер в состоянии обработка куска файла, т.е. мы находимся
@@ -40,6 +149,54 @@ private:
 	 */
 	bool need_reset;
 	
+	/**
+	 * Максимальный размер станзы в байтах, 0 - без ограничений
+	 */
+	size_t max_stanza_size;
+	
+	/**
+	 * Максимальная глубина станзы, 0 - без ограничений
+	 */
+	int max_depth;
+	
+	/**
+	 * Максимальное число атрибутов тега, 0 - без ограничений
+	 */
+	int max_attributes;
+	
+	/**
+	 * Максимальное число дочерних тегов, 0 - без ограничений
+	 */
+	int max_children;
+	
+	/**
+	 * Глубина текущего тега (корневой тег - 1)
+	 */
+	int level;
+	
+	/**
+	 * Размер текущей станзы
+	 */
+	size_t stanza_size;
+	
+	/**
+	 * Число байт, поданных парсеру после последнего события
+	 *
+	 * Ограничивает лексему, которую парсер копит целиком (длинный
+	 * тег или значение атрибута), до того как она станет событием
+	 */
+	size_t unparsed;
+	
+	/**
+	 * Число дочерних тегов открытых тегов по уровням
+	 */
+	std::vector<int> children;
+	
+	/**
+	 * Нарушенное ограничение или NULL
+	 */
+	const char *limit_error;
+	
 	/**
 	 * Конструктор копий запрещен
 	 */
@@ -50,6 +207,59 @@ private:
 	 */
 	XMLParser& operator = (const XMLParser &) { return *this; }
 	
+	/**
+	 * Назначить обработчики парсеру expat
+	 */
+	void setHandlers();
+	
+	/**
+	 * Сбросить контекст на месте
+	 *
+	 * Парсер expat сбрасывается через XML_ParserReset() без освобождения
+	 * памяти, если контекста нет, то он создается
+	 */
+	bool restart();
+	
+	/**
+	 * Сбросить счетчики ограничений
+	 */
+	void resetLimits();
+	
+	/**
+	 * Прервать парсинг из-за нарушения ограничения
+	 *
+	 * Остаток куска отбрасывается, события больше не передаются,
+	 * parseXML() вернет FALSE и вызовет onParseError(message)
+	 */
+	void stopByLimit(const char *message);
+	
+	/**
+	 * TRUE - парсинг надо прервать (парсер закрыт или нарушено ограничение)
+	 */
+	bool isStopped() const { return need_close || limit_error; }
+	
+	/**
+	 * Проверить ограничение числа атрибутов тега
+	 *
+	 * @return TRUE - ограничение не нарушено, FALSE - парсинг прерван
+	 */
+	bool checkAttributes(int count);
+	
+	/**
+	 * Открытие тега: проверить ограничения и вызвать onStartElementRaw()
+	 */
+	void dispatchStartElement(const xml_chars_t &name, const xml_atts_t &atts);
+	
+	/**
+	 * Символьные данные: проверить ограничения и вызвать onCharacterDataRaw()
+	 */
+	void dispatchCharacterData(const xml_chars_t &cdata);
+	
+	/**
+	 * Закрытие тега: вызвать onEndElementRaw()
+	 */
+	void dispatchEndElement(const xml_chars_t &name);
+	
 public:
 	
 	/**
@@ -79,20 +289,46 @@ protected:
 	 */
 	static void endElementCallback(void *user_data, const XML_Char *name);
 	
+	/**
+	 * Обработчик открытия тега без копирования
+	 *
+	 * Имя и атрибуты указывают в буфер парсера и действительны только во
+	 * время вызова. По умолчанию копирует их и вызывает onStartElement()
+	 */
+	virtual void onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts);
+	
+	/**
+	 * Обработчик символьных данных без копирования
+	 *
+	 * По умолчанию копирует данные и вызывает onCharacterData()
+	 */
+	virtual void onCharacterDataRaw(const xml_chars_t &cdata);
+	
+	/**
+	 * Обработчик закрытия тега без копирования
+	 *
+	 * По умолчанию копирует имя и вызывает onEndElement()
+	 */
+	virtual void onEndElementRaw(const xml_chars_t &name);
+	
 	/**
 	 * Обработчик открытия тега
+	 *
+	 * Вызывается из onStartElementRaw(), каждый вызов выделяет память под
+	 * имя и атрибуты. Классам, которым важна скорость, лучше перекрыть
+	 * onStartElementRaw()
 	 */
-	virtual void onStartElement(const std::string &name, const EasyRow &atts) = 0;
+	virtual void onStartElement(const std::string &name, const EasyRow &atts) { }
 	
 	/**
 	 * Обработчик символьных данных
 	 */
-	virtual void onCharacterData(const std::string &cdata) = 0;
+	virtual void onCharacterData(const std::string &cdata) { }
 	
 	/**
 	 * Обработчик закрытия тега
 	 */
-	virtual void onEndElement(const std::string &name) = 0;
+	virtual void onEndElement(const std::string &name) { }
 	
 	/**
 	 * Обработчик ошибок парсера
@@ -112,7 +348,8 @@ public:
 	/**
 	 * Сброс парсера
 	 *
-	 * Закрывает текущий контекст и открывает новый. Можно вызывать из
+	 * Сбрасывает текущий контекст для разбора нового документа, память
+	 * парсера при этом используется повторно. Можно вызывать из
 	 * обработчиков событий, тогда парсинг прерывается и сброс будет
 	 * осуществлен по выходу из парсинга
 	 */
@@ -125,6 +362,45 @@ public:
 	 */
 	void close();
 	
+	/**
+	 * Выбрать движок разбора XML
+	 *
+	 * Закрывает текущий контекст и открывает новый на выбранном движке.
+	 * Нельзя вызывать из обработчиков событий - вернет FALSE
+	 */
+	bool setEngine(engine_t e);
+	
+	/**
+	 * Вернуть выбранный движок
+	 */
+	engine_t getEngine() const { return engine; }
+	
+	/**
+	 * Ограничить размер станзы в байтах
+	 *
+	 * Станзами считаются дочерние теги корневого тега (потока), в размер
+	 * входят имена тегов, атрибуты и текст. Ограничение действует и на
+	 * незавершенную лексему, которую парсер накапливает в буфере.
+	 * Нарушение любого ограничения прерывает парсинг, как ошибка XML:
+	 * вызывается onParseError(). 0 - без ограничений (по умолчанию)
+	 */
+	void setMaxStanzaSize(size_t size) { max_stanza_size = size; }
+	
+	/**
+	 * Ограничить глубину вложенности тегов в станзе (сама станза - 1)
+	 */
+	void setMaxDepth(int depth) { max_depth = depth; }
+	
+	/**
+	 * Ограничить число атрибутов тега
+	 */
+	void setMaxAttributes(int count) { max_attributes = count; }
+	
+	/**
+	 * Ограничить число дочерних тегов у тегов станзы
+	 */
+	void setMaxChildren(int count) { max_children = count; }
+	
 	/**
 	 * Парсинг XML
 	 *
@@ -0,0 +1,1047 @@
+
+#include <nanosoft/xmltokenizer.h>
+#include <nanosoft/xmlparser.h>
+
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define XMLTOKENIZER_SIMD
+#include <immintrin.h>
+#endif
+
+namespace
+{
+	/**
+	* Сообщения об ошибках (как в expat)
+	*/
+	const char *ERR_INVALID_TOKEN = "not well-formed (invalid token)";
+	const char *ERR_SYNTAX = "syntax error";
+	const char *ERR_MISMATCHED_TAG = "mismatched tag";
+	const char *ERR_DUPLICATE_ATTRIBUTE = "duplicate attribute";
+	const char *ERR_JUNK_AFTER_ROOT = "junk after document element";
+	const char *ERR_UNDEFINED_ENTITY = "undefined entity";
+	const char *ERR_BAD_CHAR_REF = "reference to invalid character number";
+	const char *ERR_MISPLACED_XML_PI = "XML or text declaration not at start of entity";
+	const char *ERR_UNCLOSED_TOKEN = "unclosed token";
+	const char *ERR_NO_ELEMENTS = "no element found";
+	const char *ERR_DTD = "DTD is not supported";
+	
+	/**
+	* Классы ASCII-символов имен: 1 - символ имени, 3 - может начинать имя
+	*/
+	unsigned char name_chars[128];
+	
+	/**
+	* Заполнить таблицу символов имен
+	*/
+	bool initNameChars()
+	{
+		for(int c = 'a'; c <= 'z'; c++) name_chars[c] = 3;
+		for(int c = 'A'; c <= 'Z'; c++) name_chars[c] = 3;
+		for(int c = '0'; c <= '9'; c++) name_chars[c] = 1;
+		name_chars['_'] = 3;
+		name_chars[':'] = 3;
+		name_chars['-'] = 1;
+		name_chars['.'] = 1;
+		return true;
+	}
+	
+	bool name_chars_ready = initNameChars();
+	
+	inline bool isSpace(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+	}
+	
+	/**
+	* Порядок имен атрибутов для поиска повторов
+	*/
+	bool nameLess(const char *a, const char *b)
+	{
+		return strcmp(a, b) < 0;
+	}
+	
+	/**
+	* Проверить допустимость символа в XML
+	*/
+	inline bool isXmlChar(uint32_t c)
+	{
+		if ( c < 0x20 ) return c == 0x9 || c == 0xA || c == 0xD;
+		if ( c < 0xD800 ) return true;
+		if ( c < 0xE000 ) return false;
+		if ( c < 0xFFFE ) return true;
+		return c >= 0x10000 && c <= 0x10FFFF;
+	}
+	
+	/**
+	* Проверить последовательность UTF-8
+	*
+	* Отвергает избыточные записи, суррогаты, U+FFFE/U+FFFF и символы за
+	* пределами U+10FFFF
+	*
+	* @return длина символа, 0 - неверная последовательность, -1 - символ
+	*   не поместился в буфер
+	*/
+	int utf8Char(const char *s, const char *end)
+	{
+		const unsigned char *p = reinterpret_cast<const unsigned char *>(s);
+		unsigned char c = p[0];
+		int len;
+		unsigned char lo = 0x80, hi = 0xBF;
+		if ( c < 0xC2 ) return 0;
+		if ( c < 0xE0 ) len = 2;
+		else if ( c < 0xF0 )
+		{
+			len = 3;
+			if ( c == 0xE0 ) lo = 0xA0;
+			else if ( c == 0xED ) hi = 0x9F;
+		}
+		else if ( c < 0xF5 )
+		{
+			len = 4;
+			if ( c == 0xF0 ) lo = 0x90;
+			else if ( c == 0xF4 ) hi = 0x8F;
+		}
+		else return 0;
+	
+		for(int i = 1; i < len; i++)
+		{
+			if ( s + i >= end ) return -1;
+			unsigned char lo_i = i == 1 ? lo : 0x80;
+			unsigned char hi_i = i == 1 ? hi : 0xBF;
+			if ( p[i] < lo_i || p[i] > hi_i ) return 0;
+		}
+	
+		// U+FFFE, U+FFFF
+		if ( c == 0xEF && p[1] == 0xBF && p[2] >= 0xBE ) return 0;
+		return len;
+	}
+	
+	/**
+	* Записать символ в UTF-8
+	*
+	* @return длина записи
+	*/
+	size_t putUtf8(uint32_t c, char *buf)
+	{
+		if ( c < 0x80 )
+		{
+			buf[0] = char(c);
+			return 1;
+		}
+		if ( c < 0x800 )
+		{
+			buf[0] = char(0xC0 | (c >> 6));
+			buf[1] = char(0x80 | (c & 0x3F));
+			return 2;
+		}
+		if ( c < 0x10000 )
+		{
+			buf[0] = char(0xE0 | (c >> 12));
+			buf[1] = char(0x80 | ((c >> 6) & 0x3F));
+			buf[2] = char(0x80 | (c & 0x3F));
+			return 3;
+		}
+		buf[0] = char(0xF0 | (c >> 18));
+		buf[1] = char(0x80 | ((c >> 12) & 0x3F));
+		buf[2] = char(0x80 | ((c >> 6) & 0x3F));
+		buf[3] = char(0x80 | (c & 0x3F));
+		return 4;
+	}
+	
+	/**
+	* Сравнить начало буфера со строкой
+	*
+	* @return 1 - совпадает, 0 - не совпадает, -1 - буфер короче строки,
+	*   но совпадает с её началом
+	*/
+	int match(const char *p, const char *end, const char *s)
+	{
+		for(; *s; p++, s++)
+		{
+			if ( p == end ) return -1;
+			if ( *p != *s ) return 0;
+		}
+		return 1;
+	}
+	
+	/**
+	* Проверить требует ли символ текста особой обработки:
+	* '<', '&', ']', '\r', управляющие и не-ASCII символы
+	*/
+	inline bool isTextSpecial(unsigned char c)
+	{
+		return c == '<' || c == '&' || c == ']' || c >= 0x80 || (c < 0x20 && c != '\t' && c != '\n');
+	}
+	
+	/**
+	* Проверить требует ли символ значения атрибута особой обработки:
+	* кавычки, '<', '&', пробельные, управляющие и не-ASCII символы
+	*/
+	inline bool isValueSpecial(unsigned char c)
+	{
+		return c == '"' || c == '\'' || c == '<' || c == '&' || c < 0x20 || c >= 0x80;
+	}
+	
+	/**
+	* Найти первый особый символ (скалярная версия)
+	*
+	* @return позиция символа или len если таких символов нет
+	*/
+	template <bool VALUE>
+	size_t scanScalar(const char *s, size_t len)
+	{
+		for(size_t i = 0; i < len; i++)
+		{
+			unsigned char c = s[i];
+			if ( VALUE ? isValueSpecial(c) : isTextSpecial(c) ) return i;
+		}
+		return len;
+	}
+	
+#ifdef XMLTOKENIZER_SIMD
+	/**
+	* Найти первый особый символ, по 16 байт за шаг
+	*
+	* Управляющие и не-ASCII символы ловятся одним знаковым сравнением
+	* с 0x20: байты >= 0x80 отрицательны
+	*/
+	template <bool VALUE>
+	size_t scanSSE2(const char *s, size_t len)
+	{
+		const __m128i lt = _mm_set1_epi8('<');
+		const __m128i amp = _mm_set1_epi8('&');
+		const __m128i space = _mm_set1_epi8(0x20);
+		const __m128i a = _mm_set1_epi8(VALUE ? '"' : ']');
+		const __m128i b = _mm_set1_epi8(VALUE ? '\'' : '\t');
+		const __m128i nl = _mm_set1_epi8('\n');
+		size_t i = 0;
+		for(; i + 16 <= len; i += 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+			__m128i ctl = _mm_cmplt_epi8(v, space);
+			__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp));
+			if ( VALUE )
+			{
+				m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+			}
+			else
+			{
+				m = _mm_or_si128(m, _mm_cmpeq_epi8(v, a));
+				ctl = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b), _mm_cmpeq_epi8(v, nl)), ctl);
+			}
+			int mask = _mm_movemask_epi8(_mm_or_si128(m, ctl));
+			if ( mask ) return i + __builtin_ctz(mask);
+		}
+		return i + scanScalar<VALUE>(s + i, len - i);
+	}
+	
+	/**
+	* Найти первый особый символ, по 32 байта за шаг
+	*/
+	template <bool VALUE>
+	__attribute__((target("avx2")))
+	size_t scanAVX2(const char *s, size_t len)
+	{
+		const __m256i lt = _mm256_set1_epi8('<');
+		const __m256i amp = _mm256_set1_epi8('&');
+		const __m256i space = _mm256_set1_epi8(0x20);
+		const __m256i a = _mm256_set1_epi8(VALUE ? '"' : ']');
+		const __m256i b = _mm256_set1_epi8(VALUE ? '\'' : '\t');
+		const __m256i nl = _mm256_set1_epi8('\n');
+		size_t i = 0;
+		for(; i + 32 <= len; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+			__m256i ctl = _mm256_cmpgt_epi8(space, v);
+			__m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, amp));
+			if ( VALUE )
+			{
+				m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b)));
+			}
+			else
+			{
+				m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, a));
+				ctl = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b), _mm256_cmpeq_epi8(v, nl)), ctl);
+			}
+			unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(m, ctl));
+			if ( mask ) return i + __builtin_ctz(mask);
+		}
+		return i + scanSSE2<VALUE>(s + i, len - i);
+	}
+#endif
+	
+	size_t scanTextAuto(const char *s, size_t len);
+	size_t scanValueAuto(const char *s, size_t len);
+	
+	/**
+	* Поиск особых символов текста, реализация выбирается при первом вызове
+	*/
+	size_t (*scanText)(const char *s, size_t len) = scanTextAuto;
+	
+	/**
+	* Поиск особых символов значения атрибута
+	*/
+	size_t (*scanValue)(const char *s, size_t len) = scanValueAuto;
+	
+	/**
+	* Выбрать реализацию поиска под текущий процессор
+	*/
+	void selectScanners()
+	{
+#ifdef XMLTOKENIZER_SIMD
+		bool avx2 = __builtin_cpu_supports("avx2");
+		scanText = avx2 ? scanAVX2<false> : scanSSE2<false>;
+		scanValue = avx2 ? scanAVX2<true> : scanSSE2<true>;
+#else
+		scanText = scanScalar<false>;
+		scanValue = scanScalar<true>;
+#endif
+	}
+	
+	size_t scanTextAuto(const char *s, size_t len)
+	{
+		selectScanners();
+		return scanText(s, len);
+	}
+	
+	size_t scanValueAuto(const char *s, size_t len)
+	{
+		selectScanners();
+		return scanValue(s, len);
+	}
+}
+
+/**
+* Конструктор
+*/
+XMLTokenizer::XMLTokenizer(XMLParser *parser): owner(parser), state(STATE_PROLOG),
+	at_start(true), bom_checked(false), scan_pos(0), scan_quote(0), error(0)
+{
+}
+
+/**
+* Сбросить токенизатор для разбора нового документа
+*
+* Выделенные буферы сохраняются
+*/
+void XMLTokenizer::reset()
+{
+	state = STATE_PROLOG;
+	at_start = true;
+	bom_checked = false;
+	error = 0;
+	pending.clear();
+	scan_pos = 0;
+	scan_quote = 0;
+	names.clear();
+	stack.clear();
+}
+
+/**
+* Передать текст обработчику
+*/
+void XMLTokenizer::characterData(const char *s, size_t len)
+{
+	if ( len ) owner->dispatchCharacterData(xml_chars_t(s, len));
+}
+
+/**
+* Проверить, мог ли в pending появиться конец незавершенной лексемы
+*
+* Хвост всегда начинается с незавершенной лексемы, которая тянется до его
+* конца. Разметка заканчивается на '>' (для тега - вне кавычек, для
+* комментария, CDATA и инструкции обработки - на "-->", "]]>" и "?>"),
+* ссылка на сущность - на первом символе, отличном от буквы, цифры и '#'.
+* Короткие хвосты (\r, часть UTF-8 или "]]>" в тексте) разбираются сразу.
+* Если разметка оказалась ошибочной раньше своего конца, то ошибка
+* обнаружится позже, когда придет '>' или последний кусок
+*/
+bool XMLTokenizer::mayComplete()
+{
+	const char *s = pending.data();
+	size_t len = pending.size();
+	if ( len < 16 ) return true;
+	
+	char kind;
+	if ( s[0] == '&' ) kind = '&';
+	else if ( s[0] != '<' ) return true;
+	else if ( s[1] == '?' ) kind = '?';
+	else if ( s[1] != '!' ) kind = '<';
+	else if ( memcmp(s, "<!--", 4) == 0 ) kind = '-';
+	else if ( memcmp(s, "<![CDATA[", 9) == 0 ) kind = ']';
+	else kind = '>';
+	
+	for(size_t i = scan_pos > 0 ? scan_pos : 1; i < len; i++)
+	{
+		char c = s[i];
+		if ( kind == '&' )
+		{
+			if ( (c < '0' || c > '9') && ((c | 0x20) < 'a' || (c | 0x20) > 'z') && c != '#' ) return true;
+			continue;
+		}
+		if ( kind == '<' && (c == '"' || c == '\'') )
+		{
+			if ( scan_quote == 0 ) scan_quote = c;
+			else if ( scan_quote == c ) scan_quote = 0;
+			continue;
+		}
+		if ( c != '>' || scan_quote ) continue;
+		if ( kind == '-' && (i < 6 || s[i - 1] != '-' || s[i - 2] != '-') ) continue;
+		if ( kind == ']' && (s[i - 1] != ']' || s[i - 2] != ']') ) continue;
+		if ( kind == '?' && s[i - 1] != '?' ) continue;
+		return true;
+	}
+	
+	scan_pos = len;
+	return false;
+}
+
+/**
+* Разобрать кусок XML
+*/
+bool XMLTokenizer::parse(const char *data, size_t len, bool isFinal)
+{
+	if ( error ) return false;
+	
+	// без хвоста разбираем прямо буфер вызывающего, иначе дописываем
+	// кусок к хвосту
+	const char *p, *end;
+	if ( pending.empty() )
+	{
+		p = data;
+		end = data + len;
+	}
+	else
+	{
+		pending.append(data, len);
+		
+		// лексема ещё не могла закончиться - не разбираем её заново
+		if ( ! isFinal && ! mayComplete() ) return true;
+		
+		p = pending.data();
+		end = p + pending.size();
+	}
+	const char *start = p;
+	
+	// после разбора хвост начинается с новой лексемы
+	scan_pos = 0;
+	scan_quote = 0;
+	
+	if ( tokenize(p, end, isFinal) == TOKEN_ERROR ) return false;
+	
+	// парсер закрыт из обработчика или нарушено ограничение - остаток
+	// не нужен
+	if ( owner->isStopped() )
+	{
+		pending.clear();
+		return true;
+	}
+	
+	if ( isFinal )
+	{
+		if ( p < end ) fail(ERR_UNCLOSED_TOKEN);
+		else if ( state != STATE_EPILOG ) fail(ERR_NO_ELEMENTS);
+		pending.clear();
+		return error == 0;
+	}
+	
+	if ( start == pending.data() ) pending.erase(0, p - start);
+	else pending.assign(p, end - p);
+	return true;
+}
+
+/**
+* Разобрать лексемы куска
+*/
+XMLTokenizer::result_t XMLTokenizer::tokenize(const char *&p, const char *end, bool isFinal)
+{
+	if ( ! bom_checked && p < end )
+	{
+		int m = match(p, end, "\xEF\xBB\xBF");
+		if ( m < 0 && ! isFinal ) return TOKEN_PARTIAL;
+		if ( m > 0 ) p += 3;
+		bom_checked = true;
+	}
+	
+	while ( p < end && ! owner->isStopped() )
+	{
+		result_t r;
+		if ( *p == '<' ) r = parseMarkup(p, end);
+		else if ( state == STATE_CONTENT ) r = parseText(p, end, isFinal);
+		else r = parseSpace(p, end);
+		if ( r != TOKEN_OK ) return r;
+		at_start = false;
+	}
+	
+	return TOKEN_OK;
+}
+
+/**
+* Пропустить пробелы вне корневого элемента
+*/
+XMLTokenizer::result_t XMLTokenizer::parseSpace(const char *&p, const char *end)
+{
+	while ( p < end && isSpace(*p) ) p++;
+	if ( p < end && *p != '<' ) return fail(state == STATE_PROLOG ? ERR_SYNTAX : ERR_JUNK_AFTER_ROOT);
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать текст внутри корневого элемента
+*
+* Текст отдается обработчику кусками между особыми символами прямо из
+* буфера, ссылки на сущности и переводы строк \r, \r\n передаются
+* отдельными кусками
+*/
+XMLTokenizer::result_t XMLTokenizer::parseText(const char *&p, const char *end, bool isFinal)
+{
+	static const char newline = '\n';
+	const char *s = p;
+	const char *run = p;
+	
+	while ( true )
+	{
+		s += scanText(s, end - s);
+		if ( s == end ) break;
+	
+		unsigned char c = *s;
+		if ( c == '<' ) break;
+	
+		if ( c >= 0x80 )
+		{
+			int n = utf8Char(s, end);
+			if ( n == 0 || (n < 0 && isFinal) ) return fail(ERR_INVALID_TOKEN);
+			if ( n < 0 ) break;
+			s += n;
+			continue;
+		}
+	
+		if ( c == ']' )
+		{
+			// "]]>" в тексте запрещено
+			int m = match(s, end, "]]>");
+			if ( m > 0 ) return fail(ERR_INVALID_TOKEN);
+			if ( m < 0 && ! isFinal ) break;
+			s++;
+			continue;
+		}
+	
+		if ( c == '&' )
+		{
+			char buf[4];
+			size_t len;
+			const char *r = s;
+			result_t result = parseReference(r, end, buf, len);
+			if ( result == TOKEN_ERROR ) return result;
+			if ( result == TOKEN_PARTIAL ) break;
+			characterData(run, s - run);
+			if ( ! owner->isStopped() ) characterData(buf, len);
+			p = run = s = r;
+			if ( owner->isStopped() ) return TOKEN_OK;
+			continue;
+		}
+	
+		if ( c == '\r' )
+		{
+			// \r и \r\n заменяются на \n
+			if ( s + 1 == end && ! isFinal ) break;
+			characterData(run, s - run);
+			if ( ! owner->isStopped() ) characterData(&newline, 1);
+			s += (s + 1 < end && s[1] == '\n') ? 2 : 1;
+			p = run = s;
+			if ( owner->isStopped() ) return TOKEN_OK;
+			continue;
+		}
+	
+		return fail(ERR_INVALID_TOKEN);
+	}
+	
+	characterData(run, s - run);
+	p = s;
+	return s == end || *s == '<' ? TOKEN_OK : TOKEN_PARTIAL;
+}
+
+/**
+* Разобрать ссылку на сущность или символ
+*/
+XMLTokenizer::result_t XMLTokenizer::parseReference(const char *&p, const char *end, char *buf, size_t &len)
+{
+	const char *s = p + 1;
+	if ( s == end ) return TOKEN_PARTIAL;
+	
+	if ( *s == '#' )
+	{
+		s++;
+		uint32_t base = 10;
+		if ( s < end && *s == 'x' )
+		{
+			base = 16;
+			s++;
+		}
+		const char *digits = s;
+		uint32_t code = 0;
+		for(; s < end; s++)
+		{
+			uint32_t d;
+			char c = *s;
+			if ( c >= '0' && c <= '9' ) d = c - '0';
+			else if ( base == 16 && c >= 'a' && c <= 'f' ) d = c - 'a' + 10;
+			else if ( base == 16 && c >= 'A' && c <= 'F' ) d = c - 'A' + 10;
+			else break;
+			// не даем переполниться, такой символ все равно недопустим
+			if ( code <= 0x10FFFF ) code = code * base + d;
+		}
+		if ( s == end ) return TOKEN_PARTIAL;
+		if ( *s != ';' || s == digits ) return fail(ERR_INVALID_TOKEN);
+		if ( ! isXmlChar(code) ) return fail(ERR_BAD_CHAR_REF);
+		len = putUtf8(code, buf);
+		p = s + 1;
+		return TOKEN_OK;
+	}
+	
+	const char *name = s;
+	result_t r = parseName(s, end);
+	if ( r != TOKEN_OK ) return r;
+	if ( *s != ';' ) return fail(ERR_INVALID_TOKEN);
+	
+	size_t name_len = s - name;
+	char c;
+	if ( name_len == 2 && name[0] == 'l' && name[1] == 't' ) c = '<';
+	else if ( name_len == 2 && name[0] == 'g' && name[1] == 't' ) c = '>';
+	else if ( name_len == 3 && memcmp(name, "amp", 3) == 0 ) c = '&';
+	else if ( name_len == 4 && memcmp(name, "quot", 4) == 0 ) c = '"';
+	else if ( name_len == 4 && memcmp(name, "apos", 4) == 0 ) c = '\'';
+	else return fail(ERR_UNDEFINED_ENTITY);
+	
+	buf[0] = c;
+	len = 1;
+	p = s + 1;
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать имя
+*
+* Имя должно заканчиваться до конца буфера, иначе оно может продолжиться
+* в следующем куске
+*/
+XMLTokenizer::result_t XMLTokenizer::parseName(const char *&p, const char *end)
+{
+	const char *s = p;
+	while ( s < end )
+	{
+		unsigned char c = *s;
+		if ( c < 0x80 )
+		{
+			if ( ! name_chars[c] ) break;
+			if ( s == p && name_chars[c] != 3 ) return fail(ERR_INVALID_TOKEN);
+			s++;
+		}
+		else
+		{
+			int n = utf8Char(reinterpret_cast<const char *>(s), end);
+			if ( n == 0 ) return fail(ERR_INVALID_TOKEN);
+			if ( n < 0 ) return TOKEN_PARTIAL;
+			s += n;
+		}
+	}
+	if ( s == end ) return TOKEN_PARTIAL;
+	if ( s == p ) return fail(ERR_INVALID_TOKEN);
+	p = s;
+	return TOKEN_OK;
+}
+
+/**
+* Проверить символы комментария, CDATA и т.п.
+*/
+XMLTokenizer::result_t XMLTokenizer::checkChars(const char *p, const char *end)
+{
+	while ( p < end )
+	{
+		unsigned char c = *p;
+		if ( c >= 0x80 )
+		{
+			int n = utf8Char(p, end);
+			if ( n <= 0 ) return fail(ERR_INVALID_TOKEN);
+			p += n;
+			continue;
+		}
+		if ( c < 0x20 && ! isSpace(c) ) return fail(ERR_INVALID_TOKEN);
+		p++;
+	}
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать разметку, начинающуюся с '<'
+*/
+XMLTokenizer::result_t XMLTokenizer::parseMarkup(const char *&p, const char *end)
+{
+	if ( end - p < 2 ) return TOKEN_PARTIAL;
+	
+	switch ( p[1] )
+	{
+	case '/':
+		return parseEndTag(p, end);
+	case '?':
+		return parsePI(p, end);
+	case '!':
+	{
+		int comment = match(p, end, "<!--");
+		if ( comment > 0 ) return parseComment(p, end);
+		int cdata = match(p, end, "<![CDATA[");
+		if ( cdata > 0 ) return parseCDATA(p, end);
+		int doctype = match(p, end, "<!DOCTYPE");
+		if ( doctype > 0 ) return fail(ERR_DTD);
+		if ( comment < 0 || cdata < 0 || doctype < 0 ) return TOKEN_PARTIAL;
+		return fail(ERR_INVALID_TOKEN);
+	}
+	default:
+		return parseStartTag(p, end);
+	}
+}
+
+/**
+* Разобрать открывающий тег
+*
+* Имя тега передается обработчику прямо из буфера, имена и значения
+* атрибутов копируются в scratch, т.к. значения нужно раскодировать,
+* а строки завершить нулем
+*/
+XMLTokenizer::result_t XMLTokenizer::parseStartTag(const char *&p, const char *end)
+{
+	const char *s = p + 1;
+	const char *name = s;
+	result_t r = parseName(s, end);
+	if ( r != TOKEN_OK ) return r;
+	size_t name_len = s - name;
+	
+	scratch.clear();
+	offsets.clear();
+	bool empty;
+	while ( true )
+	{
+		const char *space = s;
+		while ( s < end && isSpace(*s) ) s++;
+		if ( s == end ) return TOKEN_PARTIAL;
+	
+		if ( *s == '>' )
+		{
+			s++;
+			empty = false;
+			break;
+		}
+	
+		if ( *s == '/' )
+		{
+			if ( s + 1 == end ) return TOKEN_PARTIAL;
+			if ( s[1] != '>' ) return fail(ERR_INVALID_TOKEN);
+			s += 2;
+			empty = true;
+			break;
+		}
+	
+		// атрибуты отделяются пробелами
+		if ( s == space ) return fail(ERR_INVALID_TOKEN);
+	
+		// лишний атрибут прерывает разбор сразу, не дожидаясь конца тега
+		if ( ! owner->checkAttributes(offsets.size() / 2 + 1) ) return TOKEN_OK;
+	
+		const char *attr = s;
+		r = parseName(s, end);
+		if ( r != TOKEN_OK ) return r;
+		offsets.push_back(scratch.size());
+		scratch.insert(scratch.end(), attr, s);
+		scratch.push_back(0);
+	
+		while ( s < end && isSpace(*s) ) s++;
+		if ( s == end ) return TOKEN_PARTIAL;
+		if ( *s != '=' ) return fail(ERR_INVALID_TOKEN);
+		s++;
+		while ( s < end && isSpace(*s) ) s++;
+		if ( s == end ) return TOKEN_PARTIAL;
+		if ( *s != '"' && *s != '\'' ) return fail(ERR_INVALID_TOKEN);
+		char quote = *s++;
+	
+		offsets.push_back(scratch.size());
+		r = parseValue(s, end, quote);
+		if ( r != TOKEN_OK ) return r;
+	}
+	
+	// повторяющиеся атрибуты: после сортировки имен одинаковые стоят
+	// рядом, так что тег с множеством атрибутов проверяется за n log n
+	atts.clear();
+	for(size_t i = 0; i < offsets.size(); i += 2) atts.push_back(&scratch[offsets[i]]);
+	if ( atts.size() > 1 )
+	{
+		std::sort(atts.begin(), atts.end(), nameLess);
+		for(size_t i = 1; i < atts.size(); i++)
+		{
+			if ( strcmp(atts[i - 1], atts[i]) == 0 ) return fail(ERR_DUPLICATE_ATTRIBUTE);
+		}
+	}
+	
+	if ( state == STATE_EPILOG ) return fail(ERR_JUNK_AFTER_ROOT);
+	state = STATE_CONTENT;
+	
+	atts.clear();
+	for(size_t i = 0; i < offsets.size(); i++) atts.push_back(&scratch[offsets[i]]);
+	atts.push_back(0);
+	
+	p = s;
+	owner->dispatchStartElement(xml_chars_t(name, name_len), xml_atts_t(&atts[0]));
+	
+	if ( empty )
+	{
+		if ( stack.empty() ) state = STATE_EPILOG;
+		if ( ! owner->isStopped() ) owner->dispatchEndElement(xml_chars_t(name, name_len));
+	}
+	else
+	{
+		stack.push_back(names.size());
+		names.append(name, name_len);
+	}
+	
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать значение атрибута в scratch
+*
+* Сущности раскрываются, пробельные символы (и \r\n) заменяются пробелом
+*/
+XMLTokenizer::result_t XMLTokenizer::parseValue(const char *&p, const char *end, char quote)
+{
+	const char *s = p;
+	const char *run = p;
+	
+	while ( true )
+	{
+		s += scanValue(s, end - s);
+		if ( s == end ) return TOKEN_PARTIAL;
+	
+		unsigned char c = *s;
+		if ( c == '"' || c == '\'' )
+		{
+			if ( c != quote )
+			{
+				s++;
+				continue;
+			}
+			scratch.insert(scratch.end(), run, s);
+			scratch.push_back(0);
+			p = s + 1;
+			return TOKEN_OK;
+		}
+	
+		if ( c >= 0x80 )
+		{
+			int n = utf8Char(s, end);
+			if ( n == 0 ) return fail(ERR_INVALID_TOKEN);
+			if ( n < 0 ) return TOKEN_PARTIAL;
+			s += n;
+			continue;
+		}
+	
+		if ( c == '<' ) return fail(ERR_INVALID_TOKEN);
+	
+		scratch.insert(scratch.end(), run, s);
+		if ( c == '&' )
+		{
+			char buf[4];
+			size_t len;
+			result_t r = parseReference(s, end, buf, len);
+			if ( r != TOKEN_OK ) return r;
+			scratch.insert(scratch.end(), buf, buf + len);
+		}
+		else if ( isSpace(c) )
+		{
+			if ( c == '\r' )
+			{
+				if ( s + 1 == end ) return TOKEN_PARTIAL;
+				if ( s[1] == '\n' ) s++;
+			}
+			scratch.push_back(' ');
+			s++;
+		}
+		else return fail(ERR_INVALID_TOKEN);
+		run = s;
+	}
+}
+
+/**
+* Разобрать закрывающий тег
+*/
+XMLTokenizer::result_t XMLTokenizer::parseEndTag(const char *&p, const char *end)
+{
+	const char *s = p + 2;
+	const char *name = s;
+	result_t r = parseName(s, end);
+	if ( r != TOKEN_OK ) return r;
+	size_t name_len = s - name;
+	
+	while ( s < end && isSpace(*s) ) s++;
+	if ( s == end ) return TOKEN_PARTIAL;
+	if ( *s != '>' ) return fail(ERR_INVALID_TOKEN);
+	s++;
+	
+	if ( state != STATE_CONTENT ) return fail(state == STATE_PROLOG ? ERR_SYNTAX : ERR_JUNK_AFTER_ROOT);
+	
+	size_t top = stack.back();
+	if ( names.size() - top != name_len || memcmp(names.data() + top, name, name_len) != 0 )
+	{
+		return fail(ERR_MISMATCHED_TAG);
+	}
+	names.resize(top);
+	stack.pop_back();
+	if ( stack.empty() ) state = STATE_EPILOG;
+	
+	p = s;
+	owner->dispatchEndElement(xml_chars_t(name, name_len));
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать комментарий
+*
+* Комментарий пропускается, внутри запрещено "--"
+*/
+XMLTokenizer::result_t XMLTokenizer::parseComment(const char *&p, const char *end)
+{
+	const char *s = p + 4;
+	const char *q = s;
+	while ( true )
+	{
+		q = static_cast<const char *>(memchr(q, '-', end - q));
+		if ( q == 0 || q + 1 == end ) return TOKEN_PARTIAL;
+		if ( q[1] == '-' ) break;
+		q++;
+	}
+	if ( q + 2 == end ) return TOKEN_PARTIAL;
+	if ( q[2] != '>' ) return fail(ERR_INVALID_TOKEN);
+	
+	result_t r = checkChars(s, q);
+	if ( r != TOKEN_OK ) return r;
+	p = q + 3;
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать секцию CDATA
+*
+* Содержимое передается как символьные данные, \r и \r\n заменяются на \n
+*/
+XMLTokenizer::result_t XMLTokenizer::parseCDATA(const char *&p, const char *end)
+{
+	static const char newline = '\n';
+	
+	if ( state != STATE_CONTENT ) return fail(state == STATE_PROLOG ? ERR_SYNTAX : ERR_JUNK_AFTER_ROOT);
+	
+	const char *s = p + 9;
+	const char *q = s;
+	while ( true )
+	{
+		q = static_cast<const char *>(memchr(q, ']', end - q));
+		if ( q == 0 ) return TOKEN_PARTIAL;
+		int m = match(q, end, "]]>");
+		if ( m < 0 ) return TOKEN_PARTIAL;
+		if ( m > 0 ) break;
+		q++;
+	}
+	
+	result_t r = checkChars(s, q);
+	if ( r != TOKEN_OK ) return r;
+	p = q + 3;
+	
+	const char *run = s;
+	while ( s < q && ! owner->isStopped() )
+	{
+		const char *cr = static_cast<const char *>(memchr(s, '\r', q - s));
+		if ( cr == 0 ) break;
+		characterData(run, cr - run);
+		if ( ! owner->isStopped() ) characterData(&newline, 1);
+		s = cr + ((cr + 1 < q && cr[1] == '\n') ? 2 : 1);
+		run = s;
+	}
+	if ( ! owner->isStopped() ) characterData(run, q - run);
+	return TOKEN_OK;
+}
+
+/**
+* Разобрать инструкцию обработки или XML-декларацию
+*
+* Инструкции обработки пропускаются, XML-декларация допустима только
+* в самом начале документа
+*/
+XMLTokenizer::result_t XMLTokenizer::parsePI(const char *&p, const char *end)
+{
+	const char *s = p + 2;
+	const char *target = s;
+	result_t r = parseName(s, end);
+	if ( r != TOKEN_OK ) return r;
+	size_t target_len = s - target;
+	
+	const char *q = s;
+	while ( true )
+	{
+		q = static_cast<const char *>(memchr(q, '?', end - q));
+		if ( q == 0 || q + 1 == end ) return TOKEN_PARTIAL;
+		if ( q[1] == '>' ) break;
+		q++;
+	}
+	
+	// после имени - пробел или сразу "?>"
+	if ( s < q && ! isSpace(*s) ) return fail(ERR_INVALID_TOKEN);
+	
+	r = checkChars(s, q);
+	if ( r != TOKEN_OK ) return r;
+	
+	if ( target_len == 3 && (target[0] | 0x20) == 'x' && (target[1] | 0x20) == 'm' && (target[2] | 0x20) == 'l' )
+	{
+		if ( ! at_start || memcmp(target, "xml", 3) != 0 ) return fail(ERR_MISPLACED_XML_PI);
+		r = checkDeclaration(s, q);
+		if ( r != TOKEN_OK ) return r;
+	}
+	
+	p = q + 2;
+	return TOKEN_OK;
+}
+
+/**
+* Проверить XML-декларацию
+*
+* Проверяется только синтаксис: version, затем необязательные encoding
+* и standalone. Кодировка всегда UTF-8, как и у expat в XMLParser
+*/
+XMLTokenizer::result_t XMLTokenizer::checkDeclaration(const char *p, const char *end)
+{
+	static const char *names[] = { "version", "encoding", "standalone" };
+	int next = 0;
+	while ( true )
+	{
+		const char *space = p;
+		while ( p < end && isSpace(*p) ) p++;
+		if ( p == end ) break;
+		if ( p == space ) return fail(ERR_SYNTAX);
+	
+		const char *name = p;
+		while ( p < end && name_chars[(unsigned char) *p] ) p++;
+		size_t len = p - name;
+		int i = next;
+		while ( i < 3 && (strlen(names[i]) != len || memcmp(names[i], name, len) != 0) ) i++;
+		if ( i == 3 || (next == 0 && i != 0) ) return fail(ERR_SYNTAX);
+		next = i + 1;
+	
+		while ( p < end && isSpace(*p) ) p++;
+		if ( p == end || *p != '=' ) return fail(ERR_SYNTAX);
+		p++;
+		while ( p < end && isSpace(*p) ) p++;
+		if ( p == end || (*p != '"' && *p != '\'') ) return fail(ERR_SYNTAX);
+		const char *value = static_cast<const char *>(memchr(p + 1, *p, end - p - 1));
+		if ( value == 0 || value == p + 1 ) return fail(ERR_SYNTAX);
+		p = value + 1;
+	}
+	return next > 0 ? TOKEN_OK : fail(ERR_SYNTAX);
+}
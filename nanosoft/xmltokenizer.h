@@ -0,0 +1,291 @@
+#ifndef NANOSOFT_XMLTOKENIZER_H
+#define NANOSOFT_XMLTOKENIZER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+class XMLParser;
+
+/**
+ * Собственный токенизатор XML-потока
+ *
+ * Альтернатива expat'у для XMLParser (см. XMLParser::setEngine()),
+ * вызывает те же обработчики onStartElementRaw(), onCharacterDataRaw()
+ * и onEndElementRaw(). Поддерживает подмножество XML, используемое в XMPP:
+ * элементы и атрибуты, текст, предопределенные сущности и ссылки на
+ * символы, секции CDATA, комментарии, инструкции обработки и
+ * XML-декларацию. DTD (<!DOCTYPE>) не поддерживается и считается ошибкой.
+ *
+ * Границы разметки (<, &, кавычки, управляющие и не-ASCII символы) ищутся
+ * векторно, по 16/32 байта за шаг. Текст передается обработчику прямо из
+ * буфера парсинга без копирования и дробится только на ссылках на
+ * сущности и переводах строк \r. Незавершенная в конце куска лексема
+ * сохраняется и разбирается заново вместе со следующим куском, но только
+ * когда в новых данных мог появиться её конец (см. mayComplete()).
+ *
+ * Имена с не-ASCII символами проверяются только на корректность UTF-8,
+ * без таблиц допустимых символов XML, т.е. мягче, чем в expat.
+ */
+class XMLTokenizer
+{
+private:
+	
+	/**
+	 * Положение в документе
+	 */
+	enum state_t
+	{
+		/**
+		 * До корневого элемента
+		 */
+		STATE_PROLOG,
+	
+		/**
+		 * Внутри корневого элемента
+		 */
+		STATE_CONTENT,
+	
+		/**
+		 * После корневого элемента
+		 */
+		STATE_EPILOG
+	};
+	
+	/**
+	 * Результат разбора лексемы
+	 */
+	enum result_t
+	{
+		/**
+		 * Лексема разобрана
+		 */
+		TOKEN_OK,
+	
+		/**
+		 * Лексема не закончилась, нужен следующий кусок
+		 */
+		TOKEN_PARTIAL,
+	
+		/**
+		 * Ошибка, текст ошибки в error
+		 */
+		TOKEN_ERROR
+	};
+	
+	/**
+	 * Парсер, обработчики которого вызываются
+	 */
+	XMLParser *owner;
+	
+	/**
+	 * Положение в документе
+	 */
+	state_t state;
+	
+	/**
+	 * TRUE - еще ничего не разобрано (допустима XML-декларация)
+	 */
+	bool at_start;
+	
+	/**
+	 * TRUE - метка порядка байт (BOM) уже проверена
+	 */
+	bool bom_checked;
+	
+	/**
+	 * Неразобранный хвост предыдущего куска
+	 */
+	std::string pending;
+	
+	/**
+	 * Позиция в pending, до которой незавершенная лексема уже просмотрена
+	 * в поисках конца
+	 */
+	size_t scan_pos;
+	
+	/**
+	 * Открытая кавычка в просмотренной части тега или 0
+	 */
+	char scan_quote;
+	
+	/**
+	 * Имена открытых элементов, записанные подряд
+	 */
+	std::string names;
+	
+	/**
+	 * Смещения имен открытых элементов в names
+	 */
+	std::vector<size_t> stack;
+	
+	/**
+	 * Имена и значения атрибутов текущего тега, завершенные нулем
+	 */
+	std::vector<char> scratch;
+	
+	/**
+	 * Смещения имен и значений атрибутов в scratch
+	 */
+	std::vector<size_t> offsets;
+	
+	/**
+	 * Массив атрибутов в формате expat'а для xml_atts_t
+	 */
+	std::vector<const char *> atts;
+	
+	/**
+	 * Текст ошибки или NULL
+	 */
+	const char *error;
+	
+	/**
+	 * Конструктор копий запрещен
+	 */
+	XMLTokenizer(const XMLTokenizer &) { }
+	
+	/**
+	 * Оператор присваивания запрещен
+	 */
+	XMLTokenizer& operator = (const XMLTokenizer &) { return *this; }
+	
+	/**
+	 * Запомнить ошибку
+	 */
+	result_t fail(const char *message)
+	{
+		error = message;
+		return TOKEN_ERROR;
+	}
+	
+	/**
+	 * Передать текст обработчику
+	 */
+	void characterData(const char *s, size_t len);
+	
+	/**
+	 * Проверить, мог ли в pending появиться конец незавершенной лексемы
+	 *
+	 * Просматривает только данные, добавленные после прошлой проверки,
+	 * так что лексема, приходящая по байту, не разбирается заново с начала
+	 * на каждом куске
+	 */
+	bool mayComplete();
+	
+	/**
+	 * Разобрать лексемы куска
+	 *
+	 * @param p начало куска, по выходу - начало неразобранной части
+	 */
+	result_t tokenize(const char *&p, const char *end, bool isFinal);
+	
+	/**
+	 * Разобрать разметку, начинающуюся с '<'
+	 */
+	result_t parseMarkup(const char *&p, const char *end);
+	
+	/**
+	 * Разобрать открывающий тег
+	 */
+	result_t parseStartTag(const char *&p, const char *end);
+	
+	/**
+	 * Разобрать значение атрибута в scratch
+	 *
+	 * @param p позиция после открывающей кавычки
+	 * @param quote кавычка
+	 */
+	result_t parseValue(const char *&p, const char *end, char quote);
+	
+	/**
+	 * Разобрать закрывающий тег
+	 */
+	result_t parseEndTag(const char *&p, const char *end);
+	
+	/**
+	 * Разобрать комментарий
+	 */
+	result_t parseComment(const char *&p, const char *end);
+	
+	/**
+	 * Разобрать секцию CDATA
+	 */
+	result_t parseCDATA(const char *&p, const char *end);
+	
+	/**
+	 * Разобрать инструкцию обработки или XML-декларацию
+	 */
+	result_t parsePI(const char *&p, const char *end);
+	
+	/**
+	 * Проверить XML-декларацию
+	 *
+	 * @param p позиция после "<?xml"
+	 * @param end позиция "?>"
+	 */
+	result_t checkDeclaration(const char *p, const char *end);
+	
+	/**
+	 * Разобрать текст внутри корневого элемента
+	 */
+	result_t parseText(const char *&p, const char *end, bool isFinal);
+	
+	/**
+	 * Пропустить пробелы вне корневого элемента
+	 */
+	result_t parseSpace(const char *&p, const char *end);
+	
+	/**
+	 * Разобрать ссылку на сущность или символ
+	 *
+	 * @param p позиция '&'
+	 * @param buf буфер для символа (не меньше 4 байт)
+	 * @param len длина символа в UTF-8
+	 */
+	result_t parseReference(const char *&p, const char *end, char *buf, size_t &len);
+	
+	/**
+	 * Разобрать имя
+	 */
+	result_t parseName(const char *&p, const char *end);
+	
+	/**
+	 * Проверить символы комментария, CDATA и т.п.
+	 */
+	result_t checkChars(const char *p, const char *end);
+
+public:
+	
+	/**
+	 * Конструктор
+	 */
+	explicit XMLTokenizer(XMLParser *parser);
+	
+	/**
+	 * Сбросить токенизатор для разбора нового документа
+	 *
+	 * Выделенные буферы сохраняются
+	 */
+	void reset();
+	
+	/**
+	 * Разобрать кусок XML
+	 *
+	 * Должен вызываться из XMLParser::parseXML(). Если в обработчике
+	 * парсер был закрыт (XMLParser::close() или reset()), то разбор
+	 * прерывается, остаток куска отбрасывается.
+	 *
+	 * @param data буфер с данными
+	 * @param len длина буфера с данными
+	 * @param isFinal TRUE - последний кусок, FALSE - будет продолжение
+	 * @return TRUE - успешно, FALSE - ошибка парсинга
+	 */
+	bool parse(const char *data, size_t len, bool isFinal);
+	
+	/**
+	 * Вернуть текст ошибки
+	 */
+	const char* getErrorString() const { return error ? error : "no error"; }
+};
+
+#endif // NANOSOFT_XMLTOKENIZER_H
@@ -1,5 +1,10 @@
 #include <nanosoft/xmlwriter.h>
 
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define XMLWRITER_SIMD
+#include <immintrin.h>
+#endif
+
 namespace
 {
 	template <class T>
@@ -7,6 +12,95 @@ namespace
 	{
 		return a < b ? a : b;
 	}
+	
+	/**
+	* Проверить является ли символ спец. символом XML
+	*/
+	inline bool isSpecial(char c)
+	{
+		return c == '<' || c == '>' || c == '&' || c == '"';
+	}
+	
+	/**
+	* Найти первый спец. символ (скалярная версия)
+	*
+	* @return позиция символа или len если спец. символов нет
+	*/
+	size_t scanScalar(const char *s, size_t len)
+	{
+		for(size_t i = 0; i < len; i++)
+		{
+			if ( isSpecial(s[i]) ) return i;
+		}
+		return len;
+	}
+	
+#ifdef XMLWRITER_SIMD
+	/**
+	* Найти первый спец. символ, по 16 байт за шаг
+	*/
+	size_t scanSSE2(const char *s, size_t len)
+	{
+		const __m128i lt = _mm_set1_epi8('<');
+		const __m128i gt = _mm_set1_epi8('>');
+		const __m128i amp = _mm_set1_epi8('&');
+		const __m128i quot = _mm_set1_epi8('"');
+		size_t i = 0;
+		for(; i + 16 <= len; i += 16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+			__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+			int mask = _mm_movemask_epi8(m);
+			if ( mask ) return i + __builtin_ctz(mask);
+		}
+		return i + scanScalar(s + i, len - i);
+	}
+	
+	/**
+	* Найти первый спец. символ, по 32 байта за шаг
+	*/
+	__attribute__((target("avx2")))
+	size_t scanAVX2(const char *s, size_t len)
+	{
+		const __m256i lt = _mm256_set1_epi8('<');
+		const __m256i gt = _mm256_set1_epi8('>');
+		const __m256i amp = _mm256_set1_epi8('&');
+		const __m256i quot = _mm256_set1_epi8('"');
+		size_t i = 0;
+		for(; i + 32 <= len; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+			__m256i m = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)));
+			unsigned mask = _mm256_movemask_epi8(m);
+			if ( mask ) return i + __builtin_ctz(mask);
+		}
+		return i + scanSSE2(s + i, len - i);
+	}
+#endif
+	
+	size_t scanAuto(const char *s, size_t len);
+	
+	/**
+	* Поиск спец. символов, реализация выбирается при первом вызове
+	*/
+	size_t (*scanSpecial)(const char *s, size_t len) = scanAuto;
+	
+	/**
+	* Выбрать реализацию поиска под текущий процессор
+	*/
+	size_t scanAuto(const char *s, size_t len)
+	{
+#ifdef XMLWRITER_SIMD
+		scanSpecial = __builtin_cpu_supports("avx2") ? scanAVX2 : scanSSE2;
+#else
+		scanSpecial = scanScalar;
+#endif
+		return scanSpecial(s, len);
+	}
 }
 
 namespace nanosoft
@@ -72,25 +166,113 @@ namespace nanosoft
 	}
 	
 	/**
-	* Экранировать спец. символы XML
+	* Записать данные с экранированием спец. символов
 	*
-	* TODO optimize
+	* Экранирует сразу в выходной буфер, без промежуточных строк
+	*/
+	void XMLWriter::outputEscaped(const char *text, size_t len)
+	{
+		if ( buflen < XMLWRITER_ESCAPE_MAX(1) )
+		{
+			output(escape(std::string(text, len)));
+			return;
+		}
+		
+		while ( len > 0 )
+		{
+			size_t room = buflen - buffered;
+			if ( room < XMLWRITER_ESCAPE_MAX(1) )
+			{
+				flushBuffer();
+				room = buflen;
+			}
+			size_t chunk = min(len, room / XMLWRITER_ESCAPE_MAX(1));
+			buffered += escape(outbuf + buffered, text, chunk);
+			text += chunk;
+			len -= chunk;
+		}
+	}
+	
+	/**
+	* Экранировать спец. символы XML
 	*/
 	std::string XMLWriter::escape(const std::string &text)
 	{
 		std::string result;
-		for(std::string::const_iterator pos = text.begin(); pos != text.end(); ++pos)
+		escape(result, text.data(), text.length());
+		return result;
+	}
+	
+	/**
+	* Экранировать спец. символы XML и дописать результат в строку
+	*/
+	void XMLWriter::escape(std::string &result, const char *text, size_t len)
+	{
+		size_t clean = scanSpecial(text, len);
+		if ( clean == len )
+		{
+			result.append(text, len);
+			return;
+		}
+		
+		size_t size = result.size();
+		result.resize(size + clean + XMLWRITER_ESCAPE_MAX(len - clean));
+		char *buf = &result[size];
+		memcpy(buf, text, clean);
+		size_t n = escape(buf + clean, text + clean, len - clean);
+		result.resize(size + clean + n);
+	}
+	
+	/**
+	* Экранировать спец. символы XML в буфер
+	*
+	* Буфер должен вмещать XMLWRITER_ESCAPE_MAX(len) байт
+	*
+	* @return число записанных байт
+	*/
+	size_t XMLWriter::escape(char *buf, const char *text, size_t len)
+	{
+		char *p = buf;
+		const char *end = text + len;
+		while ( text < end )
 		{
-			switch ( *pos )
+			size_t clean = scanSpecial(text, end - text);
+			memcpy(p, text, clean);
+			p += clean;
+			text += clean;
+			if ( text == end ) break;
+			
+			switch ( *text++ )
 			{
-			case '<': result.append("&lt;"); break;
-			case '>': result.append("&gt;"); break;
-			case '&': result.append("&amp;"); break;
-			case '"': result.append("&quot;"); break;
-			default: result.append( &*pos, 1 );
+			case '<': memcpy(p, "&lt;", 4); p += 4; break;
+			case '>': memcpy(p, "&gt;", 4); p += 4; break;
+			case '&': memcpy(p, "&amp;", 5); p += 5; break;
+			case '"': memcpy(p, "&quot;", 6); p += 6; break;
 			}
 		}
-		return result;
+		return p - buf;
+	}
+	
+	/**
+	* Вернуть точный размер строки после экранирования
+	*/
+	size_t XMLWriter::escapedSize(const char *text, size_t len)
+	{
+		size_t size = len;
+		const char *end = text + len;
+		while ( true )
+		{
+			text += scanSpecial(text, end - text);
+			if ( text == end ) break;
+			
+			switch ( *text++ )
+			{
+			case '<': case '>': size += 3; break;
+			case '&': size += 4; break;
+			case '"': size += 5; break;
+			}
+		}
+		return size;
 	}
 	
 	/**
@@ -100,7 +282,9 @@ namespace nanosoft
 	{
 		for(attributes_t::const_iterator pos = attributes.begin(); pos != attributes.end(); ++pos)
 		{
-			output(" " + pos->first + "=\"" + escape(pos->second) + "\"");
+			output(" " + pos->first + "=\"");
+			outputEscaped(pos->second.data(), pos->second.length());
+			output("\"", 1);
 		}
 		attributes.clear();
 	}
@@ -125,7 +309,7 @@ namespace nanosoft
 	{
 		stack.push_back(tag);
 	}
-
+	
 	/**
 	* Извлечь имя тега из стека
 	*/
@@ -181,7 +365,7 @@ namespace nanosoft
 	void XMLWriter::characterData(const std::string &cdata)
 	{
 		compliteTag();
-		output(escape(cdata));
+		outputEscaped(cdata.data(), cdata.length());
 	}
 	
 	/**
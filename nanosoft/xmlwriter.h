@@ -9,6 +9,11 @@
 #include <map>
 
 
+/**
+* Максимальный размер экранированной строки (&quot; - 6 байт на символ)
+*/
+#define XMLWRITER_ESCAPE_MAX(len) ((len) * 6)
+
 namespace nanosoft
 {
 	/**
@@ -64,6 +69,13 @@ namespace nanosoft
 		*/
 		void output(const std::string &data);
 		
+		/**
+		* Записать данные с экранированием спец. символов
+		*
+		* Экранирует сразу в выходной буфер, без промежуточных строк
+		*/
+		void outputEscaped(const char *text, size_t len);
+		
 		/**
 		* Записать атрибуты тега
 		*/
@@ -116,6 +128,27 @@ namespace nanosoft
 		*/
 		static std::string escape(const std::string &text);
 		
+		/**
+		* Экранировать спец. символы XML и дописать результат в строку
+		*/
+		static void escape(std::string &result, const char *text, size_t len);
+		
+		/**
+		* Экранировать спец. символы XML в буфер
+		*
+		* Буфер должен вмещать XMLWRITER_ESCAPE_MAX(len) байт. Участки без
+		* спец. символов ищутся векторными инструкциями (SSE2/AVX2, выбор
+		* во время выполнения) и копируются целиком
+		*
+		* @return число записанных байт
+		*/
+		static size_t escape(char *buf, const char *text, size_t len);
+		
+		/**
+		* Вернуть точный размер строки после экранирования
+		*/
+		static size_t escapedSize(const char *text, size_t len);
+		
 		/**
 		* Инициализация XML-потока
 		*/
@@ -11,8 +11,11 @@
 #include <nanosoft/easytag.h>
 #include <nanosoft/easynode.h>
 #include <nanosoft/tagparser.h>
+#include <nanosoft/tagstream.h>
+#include <nanosoft/xmlwriter.h>
 
 #include <string>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -135,6 +138,411 @@ void test_tagparser()
 	test_tag("parse-xml", tag, xml.c_str());
 }
 
+/**
+ * Парсер с обработчиками без копирования, записывает события в строку
+ */
+class RawParser: public XMLParser
+{
+public:
+	std::string trace;
+	
+protected:
+	virtual void onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts)
+	{
+		trace += "<" + name.str();
+		for(int i = 0; i < atts.count; i++)
+		{
+			trace += std::string(" ") + atts.name(i) + "=" + atts.value(i);
+		}
+		const char *id = atts.get("id");
+		if ( id ) trace += std::string(" #") + id;
+		trace += ">";
+	}
+	
+	virtual void onCharacterDataRaw(const xml_chars_t &cdata)
+	{
+		trace += "[" + cdata.str() + "]";
+	}
+	
+	virtual void onEndElementRaw(const xml_chars_t &name)
+	{
+		trace += "</" + name.str() + (name == "a" ? "!" : "") + ">";
+	}
+	
+	virtual void onParseError(const char *message)
+	{
+		trace += "error";
+	}
+};
+
+void test_rawparser()
+{
+	RawParser parser;
+	const char doc[] = "<a x=\"1\" id=\"2\"><b>text</b></a>";
+	parser.parseXML(doc, sizeof(doc) - 1, true);
+	const char *expect = "<a x=1 id=2 #2><b>[text]</b></a!>";
+	printf("[ %s ] raw-callbacks: %s\n", test(parser.trace == expect), parser.trace.c_str());
+	
+	// длинные лексемы с '>', кавычками и "--" внутри, поданные по байту
+	const char tricky[] = "<a x='\">\">\">\">\">\">' id=\"'>'>'>'>'>'>\"><!-- -> -> -> -> -> --><?pi ? > ? > ? > ?>"
+		"<![CDATA[ ]> ]> ]> ]> ]> ]]>&#x000000000041;&amp;<b/></a>";
+	RawParser whole, bytes;
+	whole.setEngine(XMLParser::ENGINE_NATIVE);
+	bytes.setEngine(XMLParser::ENGINE_NATIVE);
+	bool ok = whole.parseXML(tricky, sizeof(tricky) - 1, true);
+	for(size_t i = 0; i < sizeof(tricky) - 1; i++) ok = ok && bytes.parseXML(tricky + i, 1, false);
+	ok = ok && bytes.parseXML(0, 0, true);
+	printf("[ %s ] raw-callbacks-bytes: %s\n", test(ok && bytes.trace == whole.trace), bytes.trace.c_str());
+}
+
+/**
+ * Парсер, сбрасывающий контекст по </proceed>, как XMPP после STARTTLS
+ */
+class RestartParser: public RawParser
+{
+protected:
+	virtual void onEndElementRaw(const xml_chars_t &name)
+	{
+		RawParser::onEndElementRaw(name);
+		if ( name == "proceed" ) reset();
+	}
+};
+
+void test_reuse()
+{
+	TagParser parser;
+	EasyTag first = parser.parseString("<a><b>1</b></a>");
+	parser.parseString("<a><b>");
+	EasyTag second = parser.parseString("<c x='2'/>");
+	printf("[ %s ] tagparser-reuse\n", test(first.serialize() == "<a><b>1</b></a>" && second.serialize() == "<c x=\"2\" />"));
+	
+	ATXmlTag *t1 = parse_xml_string("<a>x</a>");
+	ATXmlTag *t2 = parse_xml_string("<a><b>");
+	ATXmlTag *t3 = parse_xml_string("<d>y</d>");
+	bool ok = t1 && ! t2 && t3 && t1->name() == "a" && t1->getCharacterData() == "x" && t3->name() == "d" && t3->getCharacterData() == "y";
+	printf("[ %s ] parse-xml-string-reuse\n", test(ok));
+	delete t1;
+	delete t3;
+	
+	XMLParser::engine_t engines[] = { XMLParser::ENGINE_EXPAT, XMLParser::ENGINE_NATIVE };
+	for(int i = 0; i < 2; i++)
+	{
+		RestartParser restart;
+		restart.setEngine(engines[i]);
+		const char s1[] = "<stream><proceed/>";
+		const char s2[] = "<stream><ok/>";
+		bool r = restart.parseXML(s1, sizeof(s1) - 1, false) && restart.parseXML(s2, sizeof(s2) - 1, false);
+		const char *expect = "<stream><proceed></proceed><stream><ok></ok>";
+		printf("[ %s ] restart-in-handler-%d: %s\n", test(r && restart.trace == expect), i, restart.trace.c_str());
+	}
+}
+
+void test_attributes()
+{
+	EasyTag tag("item");
+	tag.setAttribute("jid", "user@example.com");
+	tag.setAttribute("name", "User");
+	tag.setAttributef("order", "%d", 5);
+	tag.setAttribute("name", "Other");
+	test_tag("attr-order", tag, "<item jid=\"user@example.com\" name=\"Other\" order=\"5\" />");
+	printf("[ %s ] attr-get\n", test(tag.getAttribute("order") == "5" && tag.getAttribute("none", "x") == "x"));
+	
+	tag.removeAttribute("jid");
+	printf("[ %s ] attr-remove\n", test(! tag.hasAttribute("jid") && tag.hasAttribute("name")));
+	
+	EasyRow row = tag.getAttributes();
+	row["name"] = "Row";
+	printf("[ %s ] attr-copy\n", test(tag.getAttribute("name") == "Other" && row["order"] == "5"));
+	tag.setAttr(row);
+	printf("[ %s ] attr-set-row\n", test(tag.getAttribute("name") == "Row"));
+}
+
+void test_escape()
+{
+	// спец. символ в каждой позиции, в т.ч. на границах 16/32 байт
+	bool ok = true;
+	for(int len = 0; len < 80 && ok; len++)
+	{
+		for(int pos = 0; pos < len && ok; pos++)
+		{
+			std::string text(len, 'x');
+			text[pos] = "<>&\""[pos % 4];
+			std::string expect = text.substr(0, pos);
+			expect += pos % 4 == 0 ? "&lt;" : pos % 4 == 1 ? "&gt;" : pos % 4 == 2 ? "&amp;" : "&quot;";
+			expect += text.substr(pos + 1);
+			ok = nanosoft::XMLWriter::escape(text) == expect;
+		}
+	}
+	printf("[ %s ] escape-positions\n", test(ok));
+	
+	std::string text = "a<b>&\"'c";
+	char buf[XMLWRITER_ESCAPE_MAX(sizeof("a<b>&\"'c"))];
+	size_t n = nanosoft::XMLWriter::escape(buf, text.data(), text.size());
+	printf("[ %s ] escape-buffer: %s\n", test(std::string(buf, n) == "a&lt;b&gt;&amp;&quot;'c"), std::string(buf, n).c_str());
+}
+
+void test_serialize()
+{
+	EasyTag tag("iq");
+	tag.setAttribute("id", "a<b>\"&c\"");
+	tag["query/item"].setAttribute("jid", "user@example.com");
+	tag["query/item"] = "text";
+	tag["query/empty"];
+	std::string xml = tag.serialize();
+	printf("[ %s ] serialize-size: %d\n", test(tag.serializedSize() == xml.size()), (int) tag.serializedSize());
+	
+	std::string buf(xml.size(), 0);
+	char *end = tag.serialize(&buf[0]);
+	printf("[ %s ] serialize-buffer\n", test(buf == xml && end == &buf[0] + buf.size()));
+	
+	// дерево больше нескольких блоков, с экранированием на стыках
+	EasyTag roster("query");
+	for(int i = 0; i < 200; i++)
+	{
+		EasyTag item = roster.createTag("item", EasyRow());
+		item.setAttribute("name", "<<<<<<<<<<&&&&&&&&&&\"\"\"\"\"");
+		item += "some text";
+	}
+	xml = roster.serialize();
+	size_t size = roster.serializedSize();
+	BlocksPool pool;
+	pool.reserveBySize(size);
+	nano_block_t *blocks = pool.allocBySize(size);
+	std::string result;
+	if ( blocks )
+	{
+		roster.serialize(blocks);
+		size_t rest = size;
+		for(nano_block_t *block = blocks; block && rest > 0; block = block->next)
+		{
+			size_t n = rest < BLOCKSPOOL_BLOCK_SIZE ? rest : BLOCKSPOOL_BLOCK_SIZE;
+			result.append((const char *) block->data, n);
+			rest -= n;
+		}
+		pool.free(blocks);
+	}
+	printf("[ %s ] serialize-blocks: %d bytes\n", test(size == xml.size() && result == xml), (int) size);
+}
+
+void test_atom()
+{
+	Atom a("message");
+	Atom b(std::string("message"));
+	printf("[ %s ] atom-equal\n", test(a == b && a.c_str() == b.c_str()));
+	printf("[ %s ] atom-string\n", test(a == "message" && a != "presence" && a.length() == 7));
+	
+	size_t size = Atom::getTableSize();
+	Atom c = Atom::find("no-such-atom-name");
+	printf("[ %s ] atom-find-missing\n", test(c != a && c == "no-such-atom-name" && Atom::getTableSize() == size));
+	printf("[ %s ] atom-find\n", test(Atom::find("message") == a));
+	
+	TagParser parser;
+	EasyTag tag = parser.parseString("<message><body>hi</body></message>");
+	EasyTag body = tag["body"];
+	printf("[ %s ] atom-easynode-find\n", test(body.cdata() == "hi" && tag.serialize() == "<message><body>hi</body></message>"));
+	
+	// имена из разбираемого текста не засоряют таблицу атомов
+	size = Atom::getTableSize();
+	EasyTag junk = parser.parseString("<junk-1 junk-attr='v'><junk-2/></junk-1>");
+	bool ok = junk.serialize() == "<junk-1 junk-attr=\"v\"><junk-2 /></junk-1>" && junk.hasAttribute("junk-attr");
+	printf("[ %s ] atom-parsed-not-interned\n", test(ok && Atom::getTableSize() == size));
+	
+	// имена словаря XMPP находятся в таблице и сравниваются по указателю
+	printf("[ %s ] atom-vocabulary\n", test(tag.name() == "message" && Atom::find("body").c_str() == Atom("body").c_str()));
+}
+
+/**
+ * Поток станз, сохраняет сериализованные станзы в строку
+ */
+class StanzaStream: public TagStream
+{
+public:
+	std::string trace;
+	
+	std::string error;
+	
+	/**
+	 * TRUE - удерживать последнюю станзу
+	 */
+	bool keep;
+	
+	EasyTag last;
+	
+	StanzaStream(): keep(false) { }
+	
+protected:
+	virtual void onStartStream(const std::string &name, const EasyRow &atts)
+	{
+	}
+	
+	virtual void onEndStream()
+	{
+	}
+	
+	virtual void onParseError(const char *message)
+	{
+		trace += "error";
+		error = message;
+	}
+	
+	virtual void onStanza(EasyTag stanza)
+	{
+		stanza["x"] = "y";
+		trace += stanza.serialize();
+		if ( keep ) last = stanza;
+	}
+};
+
+void test_arena()
+{
+	int created = EasyArena::arena_created;
+	int nodes = EasyNode::node_created - EasyNode::node_destroyed;
+	{
+		StanzaStream stream;
+		stream.setArenaMode(true);
+		const char head[] = "<stream>";
+		stream.parseXML(head, sizeof(head) - 1, false);
+		std::string expect;
+		for(int i = 0; i < 100; i++)
+		{
+			const char stanza[] = "<message to=\"a\"><body>some long enough message text</body></message>";
+			stream.parseXML(stanza, sizeof(stanza) - 1, false);
+			expect += "<message to=\"a\"><body>some long enough message text</body><x>y</x></message>";
+		}
+		printf("[ %s ] arena-stanzas\n", test(stream.trace == expect));
+		printf("[ %s ] arena-reuse: %d arena(s)\n", test(EasyArena::arena_created - created == 1), EasyArena::arena_created - created);
+		
+		stream.keep = true;
+		const char stanza[] = "<iq><query /></iq>";
+		stream.parseXML(stanza, sizeof(stanza) - 1, false);
+		stream.parseXML(stanza, sizeof(stanza) - 1, false);
+		printf("[ %s ] arena-busy: %d arena(s)\n", test(EasyArena::arena_created - created == 2), EasyArena::arena_created - created);
+		printf("[ %s ] arena-keep: %s\n", test(stream.last.serialize() == "<iq><query /><x>y</x></iq>"), stream.last.serialize().c_str());
+	}
+	int leak = EasyNode::node_created - EasyNode::node_destroyed - nodes;
+	printf("[ %s ] arena EasyNode leakage = %d\n", test(leak == 0), leak);
+	printf("[ %s ] arena leakage = %d\n", test(EasyArena::arena_created == EasyArena::arena_destroyed), EasyArena::arena_created - EasyArena::arena_destroyed);
+}
+
+void test_coalesce()
+{
+	// текст с сущностями, переводом строки и CDATA - один текстовый узел
+	TagParser parser;
+	int created = EasyNode::node_created;
+	EasyTag tag = parser.parseString("<m><body>a &amp; b&#65;\r\nc<![CDATA[<d>]]></body></m>");
+	int nodes = EasyNode::node_created - created;
+	std::string body = tag["body"].cdata();
+	printf("[ %s ] coalesce-parser: %d node(s), %s\n", test(nodes == 3 && body == "a & bA\nc<d>"), nodes, body.c_str());
+	
+	// станза, поданная по байту
+	StanzaStream stream;
+	const char head[] = "<stream>";
+	stream.parseXML(head, sizeof(head) - 1, false);
+	const char stanza[] = "<message><body>hello &lt;world&gt;</body></message>";
+	created = EasyNode::node_created;
+	for(size_t i = 0; i < sizeof(stanza) - 1; i++) stream.parseXML(stanza + i, 1, false);
+	// expat откладывает разбор мелких кусков до накопления данных
+	std::string pad(4096, '\n');
+	stream.parseXML(pad.data(), pad.size(), false);
+	nodes = EasyNode::node_created - created;
+	// message, body, текст + добавленные в onStanza() x и его текст
+	bool ok = nodes == 5 && stream.trace == "<message><body>hello <world></body><x>y</x></message>";
+	printf("[ %s ] coalesce-stream: %d node(s), %s\n", test(ok), nodes, stream.trace.c_str());
+	
+	std::string out = "body: ";
+	tag.cdata(out);
+	printf("[ %s ] cdata-append: %s\n", test(out == "body: a & bA\nc<d>"), out.c_str());
+}
+
+/**
+* Подать станзу потоку с ограничениями кусками по chunk байт
+*
+* Возвращает текст ошибки или сериализованные станзы
+*/
+std::string parse_limited(XMLParser::engine_t engine, const std::string &stanza, size_t chunk)
+{
+	StanzaStream stream;
+	stream.setEngine(engine);
+	stream.setMaxStanzaSize(256);
+	stream.setMaxDepth(3);
+	stream.setMaxAttributes(2);
+	stream.setMaxChildren(2);
+	const char head[] = "<stream>";
+	stream.parseXML(head, sizeof(head) - 1, false);
+	for(size_t pos = 0; pos < stanza.size(); pos += chunk)
+	{
+		if ( ! stream.parseXML(stanza.data() + pos, std::min(chunk, stanza.size() - pos), false) ) break;
+	}
+	if ( stream.trace != "error" ) return stream.trace;
+	
+	// после нарушения поток непригоден до сброса
+	const char ok[] = "<ok/>";
+	if ( stream.parseXML(ok, sizeof(ok) - 1, false) ) return "not stopped";
+	return stream.error;
+}
+
+void test_limits()
+{
+	const char *big = "<a>xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx";
+	
+	std::string many;
+	for(int i = 0; i < 10; i++) many += "<a x='1' y='2'><b><c>text</c></b><d/></a>";
+	std::string many_expect;
+	for(int i = 0; i < 10; i++) many_expect += "<a x=\"1\" y=\"2\"><b><c>text</c></b><d /><x>y</x></a>";
+	
+	XMLParser::engine_t engines[] = { XMLParser::ENGINE_EXPAT, XMLParser::ENGINE_NATIVE };
+	for(int i = 0; i < 2; i++)
+	{
+		std::string r = parse_limited(engines[i], many, 7);
+		printf("[ %s ] limits-ok-%d\n", test(r == many_expect), i);
+		
+		r = parse_limited(engines[i], "<a><b><c><d/></c></b></a>", 1024);
+		printf("[ %s ] limits-depth-%d: %s\n", test(r == "stanza is too deep"), i, r.c_str());
+		
+		r = parse_limited(engines[i], "<a x='1' y='2' z='3'/>", 1024);
+		printf("[ %s ] limits-attributes-%d: %s\n", test(r == "too many attributes"), i, r.c_str());
+		
+		r = parse_limited(engines[i], "<a><b/><b/><b/></a>", 1024);
+		printf("[ %s ] limits-children-%d: %s\n", test(r == "too many children"), i, r.c_str());
+		
+		// повтор среди множества атрибутов, первого и последнего
+		std::string atts;
+		for(int j = 0; j < 200; j++)
+		{
+			char buf[32];
+			sprintf(buf, " a%d=''", j);
+			atts += buf;
+		}
+		RawParser distinct, duplicate;
+		distinct.setEngine(engines[i]);
+		duplicate.setEngine(engines[i]);
+		std::string doc = "<a" + atts + "/>";
+		bool ok = distinct.parseXML(doc.data(), doc.size(), true) && distinct.trace.find(" a0= a1=") != std::string::npos && distinct.trace.find(" a199=></a!>") != std::string::npos;
+		doc = "<a" + atts + " a0='x'/>";
+		ok = ok && ! duplicate.parseXML(doc.data(), doc.size(), true) && duplicate.trace == "error";
+		printf("[ %s ] duplicate-attribute-%d\n", test(ok), i);
+		
+		std::string text = big;
+		for(int j = 0; j < 4; j++) text += big + 3;
+		r = parse_limited(engines[i], text + "</a>", 16);
+		printf("[ %s ] limits-text-%d: %s\n", test(r == "stanza is too large"), i, r.c_str());
+		
+		// незавершенный тег, который парсер копит в буфере
+		std::string tag = "<a x='";
+		for(int j = 0; j < 10; j++) tag += big + 3;
+		r = parse_limited(engines[i], tag, 64);
+		printf("[ %s ] limits-token-%d: %s\n", test(r == "stanza is too large"), i, r.c_str());
+	}
+	
+	// сброс снимает блокировку
+	RawParser parser;
+	parser.setMaxAttributes(1);
+	const char bad[] = "<stream><a x='1' y='2'/>";
+	const char good[] = "<stream><a x='1'/>";
+	bool r = ! parser.parseXML(bad, sizeof(bad) - 1, false) && parser.reset() && parser.parseXML(good, sizeof(good) - 1, false);
+	printf("[ %s ] limits-reset: %s\n", test(r && parser.trace == "<stream>error<stream><a x=1></a!>"), parser.trace.c_str());
+}
+
 int main(int argc, char** argv)
 {
 	test_count = 0;
@@ -155,6 +563,42 @@ int main(int argc, char** argv)
 	printf("[ %s ] EasyNode leakage = %d \n", test(leak == 0), leak);
 	printf("\n");
 	
+	printf("test raw callbacks\n");
+	test_rawparser();
+	printf("\n");
+	
+	printf("test parser reuse\n");
+	test_reuse();
+	printf("\n");
+	
+	printf("test escape\n");
+	test_escape();
+	printf("\n");
+	
+	printf("test serialize\n");
+	test_serialize();
+	printf("\n");
+	
+	printf("test attributes\n");
+	test_attributes();
+	printf("\n");
+	
+	printf("test atoms\n");
+	test_atom();
+	printf("\n");
+	
+	printf("test stanza arena\n");
+	test_arena();
+	printf("\n");
+	
+	printf("test text coalescing\n");
+	test_coalesce();
+	printf("\n");
+	
+	printf("test limits\n");
+	test_limits();
+	printf("\n");
+	
 	printf("[ %s ] result %d of %d \n", test(fail_count==0), (test_count - fail_count), test_count);
 	
 	return 0;
@@ -0,0 +1,844 @@
+/****************************************************************************
+
+Тест №06: тест очередей исходящих данных NetDaemon
+
+****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include <nanosoft/netdaemon.h>
+#include <nanosoft/asyncstream.h>
+#include <nanosoft/logger.h>
+#include <nanosoft/config.h>
+
+int test_count;
+int fail_count;
+
+const char *test(bool status)
+{
+	test_count++;
+	if ( ! status ) fail_count++;
+	return status ? "ok" : "fail";
+}
+
+/**
+* Объект-обертка над eventfd
+*
+* Первый сработавший объект удаляет своего соседа и регистрирует на его
+* дескрипторе новый объект
+*/
+class EventObject: public AsyncObject
+{
+public:
+	EventObject *peer;
+	EventObject *replacement;
+	int events;
+	
+	EventObject(int afd): AsyncObject(afd), peer(0), replacement(0), events(0) { }
+	
+protected:
+	virtual uint32_t getEventsMask()
+	{
+		return EPOLLIN;
+	}
+	
+	virtual void onEvent(uint32_t)
+	{
+		events++;
+		uint64_t v;
+		if ( read(getFd(), &v, sizeof(v)) != sizeof(v) ) perror("read");
+		NetDaemon *daemon = getDaemon();
+		if ( peer )
+		{
+			int fd = peer->getFd();
+			peer->peer = 0;
+			daemon->removeObject(peer);
+			close(fd);
+			replacement = new EventObject(eventfd(0, EFD_NONBLOCK));
+			replacement->lock();
+			if ( replacement->getFd() == fd ) daemon->addObject(replacement);
+			peer = 0;
+		}
+		daemon->stop();
+	}
+	
+	virtual void onTerminate()
+	{
+	}
+};
+
+/**
+* Записать в fd всё что лежит в буфере, попутно вычитывая данные из peer
+*/
+std::string drain(NetDaemon &daemon, int fd, int peer)
+{
+	std::string result;
+	char buf[4096];
+	for(int i = 0; i < 100000; i++)
+	{
+		daemon.push(fd);
+		ssize_t r;
+		while ( (r = read(peer, buf, sizeof(buf))) > 0 ) result.append(buf, r);
+		if ( daemon.getBufferedSize(fd) == 0 && r < 0 ) break;
+	}
+	return result;
+}
+
+/**
+* Объект, удаляющий себя из демона в обработчике события
+*/
+class SelfRemoveObject: public AsyncObject
+{
+public:
+	bool *destroyed;
+	bool *alive;
+	
+	SelfRemoveObject(int afd, bool *d, bool *a): AsyncObject(afd), destroyed(d), alive(a) { }
+	~SelfRemoveObject() { *destroyed = true; close(getFd()); }
+	
+protected:
+	virtual uint32_t getEventsMask()
+	{
+		return EPOLLIN;
+	}
+	
+	virtual void onEvent(uint32_t)
+	{
+		NetDaemon *daemon = getDaemon();
+		daemon->removeObject(this);
+		
+		// других ссылок нет, но объект живет до конца пачки
+		*alive = ! *destroyed;
+		daemon->stop();
+	}
+	
+	virtual void onTerminate()
+	{
+	}
+};
+
+/**
+* Обработчик удаляет свой объект: ссылка таблицы освобождается в конце пачки
+*/
+void test_self_remove(NetDaemon &daemon)
+{
+	bool destroyed = false, alive = false;
+	SelfRemoveObject *obj = new SelfRemoveObject(eventfd(0, EFD_NONBLOCK), &destroyed, &alive);
+	daemon.addObject(obj);
+	uint64_t one = 1;
+	write(obj->getFd(), &one, sizeof(one));
+	daemon.run();
+	printf("self-removed object released after batch [ %s ]\n", test(alive && destroyed));
+}
+
+/**
+* stop() из обработчика прерывает пачку событий, остальные события
+* доставляются при следующем запуске
+*/
+void test_stop(NetDaemon &daemon)
+{
+	EventObject *a = new EventObject(eventfd(0, EFD_NONBLOCK));
+	EventObject *b = new EventObject(eventfd(0, EFD_NONBLOCK));
+	a->lock();
+	b->lock();
+	daemon.addObject(a);
+	daemon.addObject(b);
+	uint64_t one = 1;
+	write(a->getFd(), &one, sizeof(one));
+	write(b->getFd(), &one, sizeof(one));
+	daemon.run();
+	printf("stop() ends the batch [ %s ]\n", test(a->events + b->events == 1));
+	daemon.run();
+	printf("rest of the batch delivered [ %s ]\n", test(a->events == 1 && b->events == 1));
+	daemon.removeObject(a);
+	daemon.removeObject(b);
+	close(a->getFd());
+	close(b->getFd());
+	a->release();
+	b->release();
+}
+
+/**
+* Поток, считающий события записи
+*/
+class TestStream: public AsyncStream
+{
+public:
+	std::string input;
+	int blocked;
+	int writable;
+	int empty;
+	int relay_errors;
+	int reads;
+	size_t max_read;
+	
+	TestStream(int afd): AsyncStream(afd), blocked(0), writable(0), empty(0), relay_errors(0), reads(0), max_read(0) { }
+	
+protected:
+	virtual void onRead(const char *data, size_t len)
+	{
+		input.append(data, len);
+		reads++;
+		if ( len > max_read ) max_read = len;
+	}
+	virtual void onWriteBlocked() { blocked++; }
+	virtual void onWritable() { writable++; }
+	virtual void onEmpty() { empty++; }
+	virtual void onRelayError(const char *message) { relay_errors++; }
+	virtual void onPeerDown() { }
+	virtual void onTerminate() { }
+};
+
+/**
+* Глобальный таймер: вернуть управление из run()
+*/
+void stop_daemon(const timeval &tv, NetDaemon *daemon)
+{
+	daemon->stop();
+}
+
+/**
+* Прокрутить цикл демона (каждый run() длится не дольше sleep_time)
+*/
+void spin(NetDaemon &daemon, int turns)
+{
+	for(int i = 0; i < turns; i++) daemon.run();
+}
+
+/**
+* Создать неблокирующую пару сокетов
+*/
+void make_pair(int sv[2], int sndbuf)
+{
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	if ( sndbuf ) setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL, 0) | O_NONBLOCK);
+}
+
+/**
+* Вычитать всё, что есть в сокете
+*/
+std::string read_all(int fd)
+{
+	std::string result;
+	char buf[4096];
+	ssize_t r;
+	while ( (r = read(fd, buf, sizeof(buf))) > 0 ) result.append(buf, r);
+	return result;
+}
+
+/**
+* Писать в сокет, пока он принимает, прокручивая демона
+*
+* @return число записанных байт
+*/
+size_t fill(NetDaemon &daemon, int fd, const std::string &data)
+{
+	size_t pos = 0;
+	for(int idle = 0; idle < 5 && pos < data.size(); )
+	{
+		ssize_t r = write(fd, data.data() + pos, data.size() - pos);
+		if ( r > 0 ) pos += r;
+		else idle++;
+		spin(daemon, 1);
+	}
+	return pos;
+}
+
+/**
+* Ретрансляция через splice()
+*/
+void test_relay()
+{
+	NetDaemon daemon(16, 64);
+	daemon.setSleepTime(10);
+	daemon.setGlobalTimer(stop_daemon, &daemon);
+	
+	int a[2], b[2];
+	make_pair(a, 0);
+	make_pair(b, 4096);
+	TestStream *src = new TestStream(a[0]);
+	TestStream *dst = new TestStream(b[0]);
+	src->lock();
+	dst->lock();
+	daemon.addObject(src);
+	daemon.addObject(dst);
+	printf("startRelay() [ %s ]\n", test(src->startRelay(dst)));
+	
+	write(a[1], "hello relay", 11);
+	spin(daemon, 2);
+	std::string out = read_all(b[1]);
+	printf("relay data [ %s ]\n", test(out == "hello relay" && src->input.empty()));
+	
+	// получатель не успевает: канал заполняется частично, источник ждет
+	std::string blob;
+	for(int i = 0; blob.size() < 512 * 1024; i++) blob += (char) ('a' + i % 26);
+	size_t pos = 0;
+	out.clear();
+	for(int i = 0; i < 10000 && out.size() < blob.size(); i++)
+	{
+		ssize_t r = write(a[1], blob.data() + pos, std::min((size_t) 16384, blob.size() - pos));
+		if ( r > 0 ) pos += r;
+		spin(daemon, 1);
+		char buf[1024];
+		r = read(b[1], buf, sizeof(buf));
+		if ( r > 0 ) out.append(buf, r);
+	}
+	printf("relay slow target [ %s ]\n", test(out == blob));
+	
+	// получатель удален из демона, пока источник ждет его
+	size_t sent = fill(daemon, a[1], blob);
+	daemon.removeObject(dst);
+	printf("relay target removed: errors = %d [ %s ]\n", src->relay_errors, test(src->relay_errors == 1 && ! src->isRelayActive()));
+	spin(daemon, 3);
+	write(a[1], "tail", 4);
+	spin(daemon, 3);
+	bool resumed = src->input.size() >= 4 && src->input.compare(src->input.size() - 4, 4, "tail") == 0;
+	printf("relay source reads again [ %s ]\n", test(sent > 0 && resumed));
+	
+	daemon.removeObject(src);
+	src->release();
+	dst->release();
+	close(a[0]);
+	close(a[1]);
+	close(b[0]);
+	close(b[1]);
+}
+
+/**
+* Уровни буфера: onWriteBlocked() / onWritable()
+*/
+void test_watermarks()
+{
+	NetDaemon daemon(16, 64);
+	daemon.setSleepTime(10);
+	daemon.setGlobalTimer(stop_daemon, &daemon);
+	
+	int c[2];
+	make_pair(c, 4096);
+	TestStream *stream = new TestStream(c[0]);
+	stream->lock();
+	daemon.addObject(stream);
+	printf("setWatermarks(low >= high) [ %s ]\n", test(! stream->setWatermarks(4096, 4096)));
+	stream->setWatermarks(8192, 32768);
+	
+	std::string a(16384, 'a'), b(24576, 'b'), c2(100, 'c');
+	bool r = stream->put(a.data(), a.size());
+	printf("below high watermark [ %s ]\n", test(r && stream->blocked == 0));
+	r = stream->put(b.data(), b.size()) && stream->put(c2.data(), c2.size());
+	printf("high watermark: blocked = %d [ %s ]\n", stream->blocked, test(r && stream->blocked == 1 && stream->isWriteBlocked()));
+	
+	// получатель не читает - буфер выше нижнего уровня
+	spin(daemon, 2);
+	printf("slow reader: writable = %d [ %s ]\n", stream->writable, test(stream->writable == 0 && stream->getBufferedSize() > 8192));
+	
+	std::string out;
+	for(int i = 0; i < 1000 && out.size() < a.size() + b.size() + c2.size(); i++)
+	{
+		out += read_all(c[1]);
+		spin(daemon, 1);
+	}
+	out += read_all(c[1]);
+	bool ok = out == a + b + c2 && stream->writable == 1 && ! stream->isWriteBlocked();
+	printf("low watermark: writable = %d [ %s ]\n", stream->writable, test(ok));
+	
+	// отказ по квоте тоже блокирует запись
+	daemon.setQuota(c[0], 1000);
+	r = stream->put(a.data(), a.size());
+	printf("put over quota: blocked = %d [ %s ]\n", stream->blocked, test(! r && stream->blocked == 2));
+	
+	daemon.removeObject(stream);
+	stream->release();
+	close(c[0]);
+	close(c[1]);
+}
+
+/**
+* Прямая запись в сокет (setDirectWrite())
+*/
+void test_direct_write()
+{
+	NetDaemon daemon(16, 64);
+	daemon.setSleepTime(10);
+	daemon.setGlobalTimer(stop_daemon, &daemon);
+	
+	int c[2];
+	make_pair(c, 4096);
+	TestStream *stream = new TestStream(c[0]);
+	stream->lock();
+	daemon.addObject(stream);
+	stream->setDirectWrite(true);
+	
+	// очередь пуста - данные уходят сразу, минуя буфер
+	bool r = stream->put("direct", 6);
+	bool ok = r && stream->getBufferedSize() == 0 && read_all(c[1]) == "direct";
+	printf("direct write [ %s ]\n", test(ok));
+	
+	// сокет принял часть - остаток уходит в буфер
+	std::string a(65536, 'a'), b(100, 'b');
+	r = stream->put(a.data(), a.size());
+	size_t buffered = stream->getBufferedSize();
+	printf("partial direct write: buffered %d [ %s ]\n", (int) buffered, test(r && buffered > 0 && buffered < a.size()));
+	
+	// очередь не пуста - новые данные встают за остатком
+	r = stream->put(b.data(), b.size());
+	printf("put after remainder: buffered %d [ %s ]\n", (int) stream->getBufferedSize(), test(r && stream->getBufferedSize() == buffered + b.size()));
+	
+	std::string out;
+	for(int i = 0; i < 1000 && out.size() < a.size() + b.size(); i++)
+	{
+		out += read_all(c[1]);
+		spin(daemon, 1);
+	}
+	out += read_all(c[1]);
+	printf("direct write order [ %s ]\n", test(out == a + b && stream->getBufferedSize() == 0));
+	
+	// остаток не поместится в буфер - в сокет не пишем ничего
+	daemon.setQuota(c[0], 1000);
+	r = stream->put(a.data(), a.size());
+	printf("direct write over quota [ %s ]\n", test(! r && read_all(c[1]).empty()));
+	
+	daemon.removeObject(stream);
+	stream->release();
+	close(c[0]);
+	close(c[1]);
+}
+
+/**
+* Прокручивать демона, пока поток не примет size байт
+*/
+bool wait_input(NetDaemon &daemon, TestStream *stream, size_t size)
+{
+	for(int i = 0; i < 100 && stream->input.size() < size; i++) spin(daemon, 1);
+	return stream->input.size() == size;
+}
+
+/**
+* Компрессия: парковка и восстановление контекстов zlib
+*/
+void test_compression()
+{
+	NetDaemon daemon(16, 64);
+	daemon.setSleepTime(10);
+	daemon.setGlobalTimer(stop_daemon, &daemon);
+	
+	int c[2];
+	make_pair(c, 0);
+	TestStream *a = new TestStream(c[0]);
+	TestStream *b = new TestStream(c[1]);
+	a->lock();
+	b->lock();
+	daemon.addObject(a);
+	daemon.addObject(b);
+	
+	if ( ! a->canCompression("zlib") )
+	{
+		printf("compression not supported [ skip ]\n");
+	}
+	else
+	{
+		a->setCompressionDictionary(zlib_xmpp_dictionary, zlib_xmpp_dictionary_size);
+		b->setCompressionDictionary(zlib_xmpp_dictionary, zlib_xmpp_dictionary_size);
+		bool ok = a->enableCompression("zlib") && b->enableCompression("zlib");
+		printf("enableCompression() [ %s ]\n", test(ok));
+		
+		std::string msg1 = "<message to='romeo@example.net' from='juliet@example.com'><body>Wherefore art thou, Romeo?</body></message>";
+		size_t idle = b->getCompressionMemory();
+		a->put(msg1.data(), msg1.size());
+		ok = wait_input(daemon, b, msg1.size()) && b->input == msg1;
+		printf("compressed round trip [ %s ]\n", test(ok));
+		
+		// между чтениями добавляется только окно декомпрессора (32К),
+		// буфер распакованных данных уже освобожден
+		size_t grown = b->getCompressionMemory() - idle;
+		printf("inflate buffer released after read: +%d [ %s ]\n", (int) grown, test(grown <= 32768 + 64));
+		
+		// паркуем только получателя: компрессор отправителя продолжает
+		// ссылаться на окно, которое получатель должен восстановить
+		ok = b->parkCompression() && b->isCompressionParked();
+		printf("park receiver [ %s ]\n", test(ok));
+		
+		b->input.clear();
+		a->put(msg1.data(), msg1.size());
+		ok = wait_input(daemon, b, msg1.size()) && b->input == msg1 && ! b->isCompressionParked();
+		printf("resume receiver with saved window [ %s ]\n", test(ok));
+		
+		// паркуем оба конца: контексты zlib освобождаются, остается только
+		// сохраненное окно декомпрессора (не больше 32К)
+		size_t before = a->getCompressionMemory();
+		ok = a->parkCompression() && b->parkCompression();
+		size_t after = a->getCompressionMemory();
+		printf("park both: memory %d -> %d [ %s ]\n", (int) before, (int) after, test(ok && after < before && after <= 32768));
+		
+		b->input.clear();
+		a->put(msg1.data(), msg1.size());
+		ok = wait_input(daemon, b, msg1.size()) && b->input == msg1;
+		printf("resume both [ %s ]\n", test(ok));
+		
+		// и в обратную сторону
+		a->input.clear();
+		b->put(msg1.data(), msg1.size());
+		ok = wait_input(daemon, a, msg1.size()) && a->input == msg1;
+		printf("resume reverse direction [ %s ]\n", test(ok));
+		
+		// хорошо сжимаемые данные: распакованное передается крупными
+		// порциями, но не больше ZLIB_INFLATE_CHUNK_SIZE
+		std::string big;
+		while ( big.size() < 256 * 1024 ) big += msg1;
+		b->input.clear();
+		b->reads = 0;
+		b->max_read = 0;
+		a->put(big.data(), big.size());
+		ok = wait_input(daemon, b, big.size()) && b->input == big;
+		printf("inflate large stream [ %s ]\n", test(ok));
+		ok = b->max_read == ZLIB_INFLATE_CHUNK_SIZE && b->reads <= (int) (big.size() / ZLIB_INFLATE_CHUNK_SIZE) + 4;
+		printf("inflate spans: %d reads, max %d [ %s ]\n", b->reads, (int) b->max_read, test(ok));
+	}
+	
+	daemon.removeObject(a);
+	daemon.removeObject(b);
+	a->release();
+	b->release();
+	close(c[0]);
+	close(c[1]);
+}
+
+/**
+* Объект-обертка над eventfd с медленным обработчиком
+*/
+class SlowObject: public AsyncObject
+{
+public:
+	int delay;
+	
+	SlowObject(int afd): AsyncObject(afd), delay(0) { }
+	
+protected:
+	virtual uint32_t getEventsMask()
+	{
+		return EPOLLIN;
+	}
+	
+	virtual void onEvent(uint32_t)
+	{
+		uint64_t v;
+		if ( read(getFd(), &v, sizeof(v)) != sizeof(v) ) perror("read");
+		
+		// активное ожидание: сигнал сторожа не должен прерывать sleep
+		timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do clock_gettime(CLOCK_MONOTONIC, &now);
+		while ( (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < delay );
+		
+		getDaemon()->stop();
+	}
+	
+	virtual void onTerminate()
+	{
+	}
+};
+
+/**
+* Подсчитать вхождения строки в файле
+*/
+int count_in_file(const char *path, const char *needle)
+{
+	FILE *f = fopen(path, "r");
+	if ( ! f ) return -1;
+	int count = 0;
+	char line[1024];
+	while ( fgets(line, sizeof(line), f) ) if ( strstr(line, needle) ) count++;
+	fclose(f);
+	return count;
+}
+
+/**
+* Сторож медленных обработчиков (setWatchdog())
+*/
+void test_watchdog()
+{
+	char path[] = "/tmp/test06_watchdog.XXXXXX";
+	int log = mkstemp(path);
+	if ( log < 0 )
+	{
+		printf("mkstemp() [ fail ]\n");
+		return;
+	}
+	close(log);
+	logger.open(path);
+	
+	NetDaemon daemon(16, 64);
+	daemon.setSleepTime(10);
+	daemon.setGlobalTimer(stop_daemon, &daemon);
+	daemon.setWatchdog(20, true);
+	
+	SlowObject *slow = new SlowObject(eventfd(0, EFD_NONBLOCK));
+	slow->lock();
+	daemon.addObject(slow);
+	uint64_t one = 1;
+	
+	// обработчик не уложился в порог: SIGALRM снимает стек
+	slow->delay = 60;
+	write(slow->getFd(), &one, sizeof(one));
+	daemon.run();
+	int reports = count_in_file(path, "slow handler SlowObject");
+	int frames = count_in_file(path, "  #0 ");
+	printf("watchdog fired: %d reports, %d backtraces [ %s ]\n", reports, frames, test(reports == 1 && frames == 1));
+	
+	itimerval it;
+	getitimer(ITIMER_REAL, &it);
+	printf("watchdog disarmed after handler [ %s ]\n", test(it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0));
+	
+	// быстрый обработчик не попадает в лог
+	slow->delay = 0;
+	write(slow->getFd(), &one, sizeof(one));
+	daemon.run();
+	printf("fast handler not reported [ %s ]\n", test(count_in_file(path, "slow handler") == 1));
+	
+	// сторож взводится заново для каждого обработчика
+	slow->delay = 60;
+	write(slow->getFd(), &one, sizeof(one));
+	daemon.run();
+	reports = count_in_file(path, "slow handler SlowObject");
+	frames = count_in_file(path, "  #0 ");
+	printf("watchdog re-armed: %d reports, %d backtraces [ %s ]\n", reports, frames, test(reports == 2 && frames == 2));
+	
+	// выключенный сторож возвращает SIGALRM обработчик по умолчанию
+	daemon.setWatchdog(0);
+	struct sigaction sa;
+	sigaction(SIGALRM, 0, &sa);
+	write(slow->getFd(), &one, sizeof(one));
+	daemon.run();
+	bool ok = sa.sa_handler == SIG_DFL && count_in_file(path, "slow handler") == 2;
+	printf("watchdog disabled [ %s ]\n", test(ok));
+	
+	daemon.removeObject(slow);
+	close(slow->getFd());
+	slow->release();
+	unlink(path);
+}
+
+/**
+* Отложенная запись (setDeferredFlush())
+*/
+void test_deferred_flush()
+{
+	NetDaemon daemon(16, 64);
+	daemon.setSleepTime(10);
+	daemon.setGlobalTimer(stop_daemon, &daemon);
+	
+	int c[2];
+	make_pair(c, 0);
+	TestStream *stream = new TestStream(c[0]);
+	stream->lock();
+	daemon.addObject(stream);
+	stream->setDeferredFlush(true);
+	stream->setWatermarks(1024, 4096);
+	
+	// верхний уровень достигнут, но сокет принимает всё в конце хода -
+	// onWritable() должен прийти без EPOLLOUT
+	std::string data(8192, 'W');
+	bool r = stream->put(data.data(), data.size());
+	printf("deferred put: blocked = %d [ %s ]\n", stream->blocked, test(r && stream->blocked == 1 && stream->getBufferedSize() == data.size()));
+	spin(daemon, 1);
+	std::string out = read_all(c[1]);
+	bool ok = out == data && stream->writable == 1 && stream->empty == 1 && ! stream->isWriteBlocked();
+	printf("deferred flush: writable = %d, empty = %d [ %s ]\n", stream->writable, stream->empty, test(ok));
+	
+	daemon.removeObject(stream);
+	stream->release();
+	close(c[0]);
+	close(c[1]);
+}
+
+int main()
+{
+	printf("test NetDaemon output queues\n");
+	
+	NetDaemon daemon(16, 64);
+	BlocksPool *bp = daemon.getPool();
+	
+	int sv[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 )
+	{
+		printf("socketpair() [ fail ]\n");
+		return 1;
+	}
+	int sndbuf = 4096;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL, 0) | O_NONBLOCK);
+	
+	std::string bulk(32 * 1024, 'B');
+	std::string control(100, 'C');
+	std::string tail(100, 'D');
+	std::string out;
+	
+	// срочные данные обгоняют ещё не начатые объемные
+	daemon.put(sv[0], bulk.data(), bulk.size(), NetDaemon::LANE_BULK);
+	daemon.put(sv[0], control.data(), control.size());
+	printf("getBufferedSize() = %d [ %s ]\n", (int)daemon.getBufferedSize(sv[0]), test(daemon.getBufferedSize(sv[0]) == bulk.size() + control.size()));
+	out = drain(daemon, sv[0], sv[1]);
+	printf("control before bulk [ %s ]\n", test(out == control + bulk));
+	
+	// начатое объемное сообщение не прерывается
+	daemon.put(sv[0], bulk.data(), bulk.size(), NetDaemon::LANE_BULK);
+	daemon.push(sv[0]);
+	daemon.put(sv[0], control.data(), control.size());
+	daemon.put(sv[0], tail.data(), tail.size(), NetDaemon::LANE_BULK);
+	out = drain(daemon, sv[0], sv[1]);
+	printf("started bulk is not split [ %s ]\n", test(out == bulk + control + tail));
+	
+	// фрагменты iovec дописываются через границы блоков без склейки
+	std::string x(3000, 'x'), y(5000, 'y');
+	struct iovec iov[3];
+	iov[0].iov_base = (void *) x.data();
+	iov[0].iov_len = x.size();
+	iov[1].iov_base = (void *) y.data();
+	iov[1].iov_len = y.size();
+	iov[2].iov_base = (void *) tail.data();
+	iov[2].iov_len = tail.size();
+	daemon.put(sv[0], control.data(), control.size());
+	printf("put(iovec) [ %s ]\n", test(daemon.put(sv[0], iov, 3, NetDaemon::LANE_CONTROL)));
+	out = drain(daemon, sv[0], sv[1]);
+	printf("iovec data [ %s ]\n", test(out == control + x + y + tail));
+	
+	// цепочка блоков ставится в очередь без копирования
+	nano_block_t *chain = bp->allocBySize(BLOCKSPOOL_BLOCK_SIZE + 100);
+	memset(chain->data, 'P', BLOCKSPOOL_BLOCK_SIZE);
+	memset(chain->next->data, 'Q', 100);
+	printf("putBlocks() [ %s ]\n", test(daemon.putBlocks(sv[0], chain, BLOCKSPOOL_BLOCK_SIZE + 100, NetDaemon::LANE_BULK)));
+	out = drain(daemon, sv[0], sv[1]);
+	printf("blocks data [ %s ]\n", test(out == std::string(BLOCKSPOOL_BLOCK_SIZE, 'P') + std::string(100, 'Q')));
+	
+	// фрагмент файла отправляется в порядке объемной полосы
+	FILE *f = tmpfile();
+	std::string file(20000, 'F');
+	fwrite(file.data(), 1, file.size(), f);
+	fflush(f);
+	daemon.put(sv[0], tail.data(), tail.size(), NetDaemon::LANE_BULK);
+	daemon.putFile(sv[0], fileno(f), 1000, 15000);
+	fclose(f);
+	daemon.put(sv[0], tail.data(), tail.size(), NetDaemon::LANE_BULK);
+	daemon.put(sv[0], control.data(), control.size());
+	out = drain(daemon, sv[0], sv[1]);
+	printf("putFile() [ %s ]\n", test(out == control + tail + file.substr(1000, 15000) + tail));
+	
+	// cleanup() возвращает блоки в пул
+	daemon.put(sv[0], bulk.data(), bulk.size(), NetDaemon::LANE_BULK);
+	daemon.put(sv[0], control.data(), control.size());
+	NetDaemon::stats_t st;
+	daemon.getStats(st);
+	printf("stats.output_size = %d [ %s ]\n", (int)st.output_size, test(st.output_size == bulk.size() + control.size()));
+	daemon.cleanup(sv[0]);
+	daemon.getStats(st);
+	printf("stats.output_size = %d [ %s ]\n", (int)st.output_size, test(st.output_size == 0));
+	printf("getBufferedSize() = %d [ %s ]\n", (int)daemon.getBufferedSize(sv[0]), test(daemon.getBufferedSize(sv[0]) == 0));
+	printf("bp.busy = %d [ %s ]\n", bp->getBusyCount(), test(bp->getBusyCount() == 0));
+	
+	// при нехватке буфера медленный получатель не занимает весь пул
+	int sv2[2];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv2);
+	fcntl(sv2[0], F_SETFL, fcntl(sv2[0], F_GETFL, 0) | O_NONBLOCK);
+	std::string chunk(BLOCKSPOOL_BLOCK_SIZE, 'S');
+	int chunks = 0;
+	while ( daemon.put(sv[0], chunk.data(), chunk.size()) ) chunks++;
+	printf("slow fd chunks = %d, bp.free = %d [ %s ]\n", chunks, bp->getFreeCount(), test(bp->getFreeCount() > 0));
+	printf("other fd put [ %s ]\n", test(daemon.put(sv2[0], chunk.data(), chunk.size())));
+	nano_block_t *extra = bp->allocBySize(chunk.size());
+	bool refused = extra && ! daemon.putBlocks(sv[0], extra, chunk.size(), NetDaemon::LANE_BULK);
+	printf("slow fd putBlocks() refused [ %s ]\n", test(refused));
+	if ( refused ) bp->free(extra);
+	
+	// пустая очередь при нехватке ограничена своей долей, но блок получит
+	daemon.setWeight(sv2[0], 8);
+	std::string share(BLOCKSPOOL_BLOCK_SIZE * 8, 'G');
+	bool over = share.size() / BLOCKSPOOL_BLOCK_SIZE <= (size_t) bp->getFreeCount() && ! daemon.put(sv2[1], share.data(), share.size());
+	printf("empty fd over fair share refused [ %s ]\n", test(over));
+	printf("empty fd gets one block [ %s ]\n", test(daemon.put(sv2[1], chunk.data(), chunk.size())));
+	daemon.cleanup(sv[0]);
+	daemon.cleanup(sv2[0]);
+	daemon.cleanup(sv2[1]);
+	printf("bp.busy = %d [ %s ]\n", bp->getBusyCount(), test(bp->getBusyCount() == 0));
+	
+	// резерв пула не занимает даже пустая очередь свободного пула
+	std::string huge(BLOCKSPOOL_BLOCK_SIZE * bp->getTotalCount(), 'H');
+	std::string half(BLOCKSPOOL_BLOCK_SIZE * bp->getTotalCount() / 2, 'H');
+	printf("put into pool reserve refused [ %s ]\n", test(! daemon.put(sv[0], huge.data(), huge.size()) && bp->getBusyCount() == 0));
+	printf("put of half pool accepted [ %s ]\n", test(daemon.put(sv[0], half.data(), half.size())));
+	daemon.cleanup(sv[0]);
+	
+	// событие удаленного объекта не доставляется новому объекту на том же fd
+	EventObject *a = new EventObject(eventfd(0, EFD_NONBLOCK));
+	EventObject *b = new EventObject(eventfd(0, EFD_NONBLOCK));
+	a->lock();
+	b->lock();
+	a->peer = b;
+	b->peer = a;
+	daemon.addObject(a);
+	daemon.addObject(b);
+	uint64_t one = 1;
+	write(a->getFd(), &one, sizeof(one));
+	write(b->getFd(), &one, sizeof(one));
+	daemon.run();
+	EventObject *first = a->events ? a : b;
+	EventObject *other = a->events ? b : a;
+	bool reused = first->replacement && first->replacement->getFd() == other->getFd();
+	printf("stale event dropped [ %s ]\n", test(reused && a->events + b->events == 1 && first->replacement->events == 0));
+	daemon.getStats(st);
+	printf("stats.events = %d, stale = %d [ %s ]\n", (int)st.events, (int)st.stale_events, test(st.events == 2 && st.stale_events == 1));
+	if ( first->replacement )
+	{
+		int fd = first->replacement->getFd();
+		daemon.removeObject(first->replacement);
+		first->replacement->release();
+		close(fd);
+	}
+	daemon.removeObject(first);
+	close(first->getFd());
+	a->release();
+	b->release();
+	
+	test_stop(daemon);
+	test_self_remove(daemon);
+	test_watermarks();
+	test_direct_write();
+	test_relay();
+	test_compression();
+	test_watchdog();
+	test_deferred_flush();
+	
+	// таблица дескрипторов растет за пределы fd_limit
+	int big = dup2(sv[0], 5000);
+	if ( big == 5000 )
+	{
+		printf("put() to fd 5000 [ %s ]\n", test(daemon.put(big, control.data(), control.size())));
+		out = drain(daemon, big, sv[1]);
+		printf("fd 5000 data [ %s ]\n", test(out == control));
+		printf("getTableSize() = %d [ %s ]\n", (int)daemon.getTableSize(), test(daemon.getTableSize() == 2 * FDTABLE_PAGE_SIZE));
+		close(big);
+	}
+	
+	close(sv[0]);
+	close(sv[1]);
+	close(sv2[0]);
+	close(sv2[1]);
+	
+	printf("\n");
+	printf("test result %d of %d [ %s ]\n", (test_count - fail_count), test_count, (fail_count==0 ? "ok" : "fail"));
+	
+	return fail_count == 0 ? 0 : 1;
+}
@@ -0,0 +1,417 @@
+
+/****************************************************************************
+
+Тест №07: сверка собственного токенизатора XML с expat
+
+Один и тот же документ разбирается движками ENGINE_EXPAT и ENGINE_NATIVE,
+события записываются в трассу и сравниваются. Документы подаются кусками
+случайной длины, чтобы лексемы разрывались в произвольных местах. Соседние
+куски текста в трассе склеиваются, т.к. expat и токенизатор делят текст
+на куски по-разному.
+
+Кроме готовых примеров проверяются случайные документы и их случайные
+искажения: для искаженных документов оба движка должны одинаково
+определять ошибку.
+
+Использование: test07_xmlfuzz [число документов] [seed]
+
+****************************************************************************/
+
+#include <nanosoft/xmlparser.h>
+
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+int test_count;
+int fail_count;
+
+const char *test(bool status)
+{
+	test_count++;
+	if ( ! status ) fail_count++;
+	return status ? " ok " : "fail";
+}
+
+/**
+* Парсер, записывающий события в трассу
+*/
+class TraceParser: public XMLParser
+{
+private:
+	/**
+	* Накопленный текст
+	*/
+	std::string text;
+	
+	void flush()
+	{
+		if ( text.empty() ) return;
+		trace += "T " + text + "\n";
+		text.clear();
+	}
+
+protected:
+	virtual void onStartElementRaw(const xml_chars_t &name, const xml_atts_t &atts)
+	{
+		flush();
+		trace += "S " + name.str();
+		for(int i = 0; i < atts.count; i++)
+		{
+			trace += std::string(" ") + atts.name(i) + "=[" + atts.value(i) + "]";
+		}
+		trace += "\n";
+	}
+	
+	virtual void onCharacterDataRaw(const xml_chars_t &cdata)
+	{
+		text.append(cdata.data, cdata.len);
+	}
+	
+	virtual void onEndElementRaw(const xml_chars_t &name)
+	{
+		flush();
+		trace += "E " + name.str() + "\n";
+	}
+	
+	virtual void onParseError(const char *message)
+	{
+		flush();
+		failed = true;
+		error = message;
+	}
+
+public:
+	std::string trace;
+	bool failed;
+	std::string error;
+	
+	TraceParser(engine_t engine): failed(false)
+	{
+		setEngine(engine);
+	}
+	
+	/**
+	* Разобрать документ кусками случайной длины (max_chunk = 0 - целиком)
+	*/
+	void run(const std::string &doc, int max_chunk)
+	{
+		size_t pos = 0;
+		while ( ! failed )
+		{
+			size_t len = doc.size() - pos;
+			if ( max_chunk && len > 0 ) len = std::min(len, size_t(rand() % max_chunk + 1));
+			bool final = pos + len == doc.size();
+			parseXML(doc.data() + pos, len, final);
+			pos += len;
+			if ( final ) break;
+		}
+		flush();
+	}
+};
+
+/**
+* Разобрать документ обоими движками и сравнить трассы
+*
+* @param strict TRUE - трассы должны совпасть полностью, FALSE - должен
+*   совпасть только признак ошибки (после ошибки expat и токенизатор могут
+*   успеть отдать разное число событий)
+* @return TRUE - совпадают
+*/
+bool compare(const std::string &doc, int max_chunk, bool strict, bool verbose = false)
+{
+	TraceParser expat(XMLParser::ENGINE_EXPAT);
+	TraceParser native(XMLParser::ENGINE_NATIVE);
+	expat.run(doc, 0);
+	native.run(doc, max_chunk);
+	
+	bool same = expat.failed == native.failed;
+	if ( strict || ! expat.failed ) same = same && expat.trace == native.trace;
+	if ( ! same && verbose )
+	{
+		printf("document: [%s]\n", doc.c_str());
+		printf("expat (%s):\n%s", expat.failed ? expat.error.c_str() : "ok", expat.trace.c_str());
+		printf("native (%s):\n%s", native.failed ? native.error.c_str() : "ok", native.trace.c_str());
+	}
+	return same;
+}
+
+/**
+* Готовые примеры
+*/
+const char *samples[] = {
+	"<a/>",
+	"<?xml version='1.0'?><a>text</a>",
+	"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone='yes' ?>\n<a/>\n",
+	"\xEF\xBB\xBF<a>bom</a>",
+	"<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='example.com' version='1.0'>"
+		"<message to='user@example.com' type='chat'><body>Привет, мир!</body></message>"
+		"</stream:stream>",
+	"<a x=\"1\" y='2' z = \"a'b\" w='a\"b'>t</a>",
+	"<a x=\"&lt;&gt;&amp;&quot;&apos;\" y='&#65;&#x42;&#1055;&#x1F600;'/>",
+	"<a x=\"a\tb\nc\r\nd\re\" y='&#9;&#10;&#13;'/>",
+	"<a>&lt;b&gt; &amp; &quot;c&quot; &apos;d&apos; &#65;&#x10FFFF;</a>",
+	"<a>line1\r\nline2\rline3\n\r</a>",
+	"<a><![CDATA[<b>&amp;]] ]>\r\n]]></a>",
+	"<a><!-- comment - with dash --><?pi data?><?pi?>text<!----></a>",
+	"<!-- before --><?pi x?>\n<a/>\n<!-- after --><?pi y?>\n",
+	"<a><b><c/></b><b></b ></a>",
+	"<a>x > y ] z ]] w</a>",
+	"<_a:b-c.d e.f-g='1'/>",
+	"<a>\xC2\xA0\xE2\x82\xAC\xF0\x9F\x98\x80\xC2\x85</a>",
+	// ошибки
+	"",
+	"<a>",
+	"<a",
+	"text<a/>",
+	"<a/>junk",
+	"<a/><b/>",
+	"<a></b>",
+	"</a>",
+	"<a x='1' x='2'/>",
+	"<a x='1'y='2'/>",
+	"<a x=1/>",
+	"<a x='<'/>",
+	"<a>&unknown;</a>",
+	"<a>&#0;</a>",
+	"<a>&#xD800;</a>",
+	"<a>&#x110000;</a>",
+	"<a>&#xFFFE;</a>",
+	"<a>&#;</a>",
+	"<a>&amp</a>",
+	"<a>]]></a>",
+	"<a>\x01</a>",
+	"<a>\xFF</a>",
+	"<a>\xC0\x80</a>",
+	"<a>\xED\xA0\x80</a>",
+	"<a>\xEF\xBF\xBF</a>",
+	"<a>\xC3</a>",
+	"<a><!-- a -- b --></a>",
+	"<a><!-- a ---></a>",
+	"<1a/>",
+	"< a/>",
+	"<a/ >",
+	"<a><![CDATA[x]]></a><![CDATA[y]]>",
+	"<a/><?xml version='1.0'?>",
+	" <?xml version='1.0'?><a/>",
+	"<a><?xml version='1.0'?></a>",
+	"<a><!ELEMENT></a>",
+	"<a><?pi\x01?></a>",
+	0
+};
+
+void test_samples()
+{
+	for(int i = 0; samples[i]; i++)
+	{
+		std::string doc = samples[i];
+		bool whole = compare(doc, 0, true, true);
+		bool bytes = compare(doc, 1, true, true);
+		bool chunks = compare(doc, 7, true, true);
+		printf("[ %s ] sample %d\n", test(whole && bytes && chunks), i);
+	}
+}
+
+/**
+* Случайный элемент массива
+*/
+template <class T, size_t N>
+const T& pick(const T (&a)[N])
+{
+	return a[rand() % N];
+}
+
+const char *names[] = { "a", "b", "message", "body", "stream:stream", "x-y.z", "_q1", "iq" };
+
+const char *text_parts[] = {
+	"hello", " ", "world", "\n", "\r\n", "\r", "\t", "Привет", "\xE2\x82\xAC", "\xF0\x9F\x98\x80",
+	"&lt;", "&gt;", "&amp;", "&quot;", "&apos;", "&#65;", "&#x44F;", "&#10;", "&#13;",
+	">", "]", "]]", "'", "\"", "=", "/", "?", "!", "-", "--"
+};
+
+const char *value_parts[] = {
+	"v", "1.0", " ", "\t", "\n", "\r\n", "\r", "ёж", "&lt;", "&amp;", "&quot;", "&apos;", "&#x9;",
+	"&#10;", ">", "/", "=", "]]>", "--"
+};
+
+/**
+* Дописать случайный текст
+*/
+void random_text(std::string &s, int parts)
+{
+	for(int i = 0; i < parts; i++)
+	{
+		// "]]>" в тексте запрещено
+		std::string part = pick(text_parts);
+		if ( part == ">" && s.size() >= 2 && s.compare(s.size() - 2, 2, "]]") == 0 ) continue;
+		s += part;
+	}
+}
+
+std::string random_attributes()
+{
+	std::string s;
+	int count = rand() % 4;
+	for(int i = 0; i < count; i++)
+	{
+		const char *quote = rand() % 2 ? "\"" : "'";
+		s += rand() % 4 ? " " : "\r\n\t";
+		s += "attr";
+		s += char('0' + i);
+		s += rand() % 3 ? "=" : " = ";
+		s += quote;
+		int parts = rand() % 5;
+		for(int j = 0; j < parts; j++)
+		{
+			std::string part = pick(value_parts);
+			if ( part != quote ) s += part;
+		}
+		s += quote;
+	}
+	return s;
+}
+
+std::string random_element(int depth)
+{
+	std::string name = pick(names);
+	std::string s = "<" + name + random_attributes();
+	if ( rand() % 5 == 0 ) return s + (rand() % 2 ? "/>" : " />");
+	s += ">";
+	
+	int count = depth > 0 ? rand() % 6 : 0;
+	for(int i = 0; i < count; i++)
+	{
+		switch ( rand() % 8 )
+		{
+		case 0:
+		case 1:
+			s += random_element(depth - 1);
+			break;
+		case 2:
+			s += "<![CDATA[";
+			random_text(s, rand() % 4);
+			s += "]]>";
+			break;
+		case 3:
+			s += rand() % 2 ? "<!-- note -->" : "<?pi some data?>";
+			break;
+		default:
+			random_text(s, rand() % 6 + 1);
+		}
+	}
+	
+	return s + "</" + name + (rand() % 4 ? ">" : " >");
+}
+
+/**
+* Случайный документ
+*
+* @param prolog длина пролога, который не нужно искажать
+*/
+std::string random_document(size_t &prolog)
+{
+	std::string s;
+	if ( rand() % 2 ) s += "<?xml version='1.0' encoding='UTF-8'?>\n";
+	prolog = s.size();
+	if ( rand() % 3 == 0 ) s += "<!-- prolog -->\n";
+	s += random_element(4);
+	if ( rand() % 3 == 0 ) s += "\n<!-- epilog -->\n";
+	return s;
+}
+
+/**
+* Исказить документ: вставить, удалить или заменить символ
+*/
+std::string mutate(const std::string &doc, size_t prolog)
+{
+	static const char chars[] = "<>&;\"'=/!?-[] \r\n\t#xa:\x01\xFF\xC3\xD0";
+	std::string s = doc;
+	int count = rand() % 3 + 1;
+	for(int i = 0; i < count && s.size() > prolog; i++)
+	{
+		size_t pos = prolog + rand() % (s.size() - prolog);
+		char c = chars[rand() % (sizeof(chars) - 1)];
+		switch ( rand() % 3 )
+		{
+		case 0: s.insert(pos, 1, c); break;
+		case 1: s.erase(pos, 1); break;
+		default: s[pos] = c;
+		}
+	}
+	return s;
+}
+
+void test_random(int count)
+{
+	int valid = 0, valid_same = 0;
+	int broken = 0, broken_same = 0, broken_failed = 0;
+	for(int i = 0; i < count; i++)
+	{
+		size_t prolog;
+		std::string doc = random_document(prolog);
+		valid++;
+		if ( compare(doc, rand() % 64 + 1, true, valid_same + 3 > valid) ) valid_same++;
+	
+		std::string bad = mutate(doc, prolog);
+		broken++;
+		if ( compare(bad, rand() % 64 + 1, false, broken_same + 3 > broken) ) broken_same++;
+	
+		TraceParser expat(XMLParser::ENGINE_EXPAT);
+		expat.run(bad, 0);
+		if ( expat.failed ) broken_failed++;
+	}
+	printf("[ %s ] random documents: %d of %d match\n", test(valid_same == valid), valid_same, valid);
+	printf("[ %s ] mutated documents: %d of %d match (%d invalid)\n", test(broken_same == broken), broken_same, broken, broken_failed);
+}
+
+/**
+* Парсер, сбрасывающий контекст в обработчике, как XMPP после STARTTLS
+*/
+class ResetParser: public TraceParser
+{
+protected:
+	virtual void onEndElementRaw(const xml_chars_t &name)
+	{
+		TraceParser::onEndElementRaw(name);
+		if ( name == "proceed" ) reset();
+	}
+
+public:
+	ResetParser(engine_t engine): TraceParser(engine) { }
+};
+
+void test_reset()
+{
+	ResetParser parser(XMLParser::ENGINE_NATIVE);
+	std::string s1 = "<stream><proceed/><ignored/>";
+	std::string s2 = "<stream><ok/>";
+	bool r1 = parser.parseXML(s1.data(), s1.size(), false);
+	bool r2 = parser.parseXML(s2.data(), s2.size(), false);
+	printf("[ %s ] reset from handler\n", test(r1 && r2 && parser.trace == "S stream\nS proceed\nE proceed\nS stream\nS ok\nE ok\n"));
+}
+
+int main(int argc, char** argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 2000;
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+	
+	test_count = 0;
+	fail_count = 0;
+	
+	printf("test samples\n");
+	test_samples();
+	printf("\n");
+	
+	printf("test random documents\n");
+	test_random(count);
+	printf("\n");
+	
+	printf("test reset\n");
+	test_reset();
+	printf("\n");
+	
+	printf("[ %s ] result %d of %d \n", test(fail_count==0), (test_count - fail_count), test_count);
+	
+	return fail_count ? 1 : 0;
+}